@@ -52,31 +52,203 @@ public class Font
 public class Image
 {
     internal Texture2D RayImage;
+    internal Rectangle Source;
+    internal bool Shared;
 
     public Image(string filename)
     {
         this.RayImage = Raylib.LoadTexture(filename);
+        this.Source = new Rectangle(0, 0, RayImage.width, RayImage.height);
+    }
+
+    internal Image(Texture2D texture, Rectangle source)
+    {
+        this.RayImage = texture;
+        this.Source = source;
+        this.Shared = true;
     }
 
     public void Release()
     {
+        // Atlas images share the page texture, which the atlas releases.
+        if (Shared)
+            return;
+
         Graphics.LoadedImages.Remove(this);
         Raylib.UnloadTexture(RayImage);
     }
 
     public Vector2 GetDimensions()
     {
-        return new Vector2(RayImage.width, RayImage.height);
+        return new Vector2(Source.width, Source.height);
     }
 
     public int GetHeight()
     {
-        return RayImage.height;
+        return (int)Source.height;
     }
 
     public int GetWidth()
     {
-        return RayImage.width;
+        return (int)Source.width;
+    }
+}
+
+public class Atlas
+{
+    // Images are packed on shelves, tallest first, with a pixel of padding
+    // between them so filtering does not bleed into neighbours.
+    private const int Padding = 1;
+
+    private static readonly string[] Extensions = { ".png", ".bmp", ".tga", ".jpg", ".jpeg", ".gif", ".qoi", ".psd", ".hdr" };
+
+    internal List<Texture2D> Pages = new();
+
+    private readonly Dictionary<string, Image> _images = new();
+
+    public Atlas(string directory, int size = 2048) : this(FindImages(directory), size)
+    {
+    }
+
+    public Atlas(IEnumerable<string> filenames, int size = 2048)
+    {
+        List<(string Name, Raylib_cs.Image Image)> entries = new();
+
+        foreach (string filename in filenames)
+        {
+            Raylib_cs.Image image = Raylib.LoadImage(filename);
+
+            if (image.data == IntPtr.Zero)
+            {
+                foreach (var loaded in entries)
+                {
+                    Raylib.UnloadImage(loaded.Image);
+                }
+
+                throw new IOException($"Could not load {filename}.");
+            }
+
+            entries.Add((filename, image));
+        }
+
+        foreach (var entry in entries)
+        {
+            if (entry.Image.width > size || entry.Image.height > size)
+            {
+                foreach (var loaded in entries)
+                {
+                    Raylib.UnloadImage(loaded.Image);
+                }
+
+                throw new ArgumentException($"{entry.Name} is larger than the atlas size.");
+            }
+        }
+
+        entries.Sort((a, b) => a.Image.height != b.Image.height ? b.Image.height - a.Image.height : string.CompareOrdinal(a.Name, b.Name));
+
+        List<(string Name, Rectangle Rect)> placed = new();
+        Raylib_cs.Image page = Raylib.GenImageColor(size, size, new Raylib_cs.Color(0, 0, 0, 0));
+
+        int x = 0;
+        int y = 0;
+        int shelfHeight = 0;
+        int usedHeight = 0;
+
+        foreach (var entry in entries)
+        {
+            int width = entry.Image.width;
+            int height = entry.Image.height;
+
+            if (x + width > size)
+            {
+                y += shelfHeight;
+                x = 0;
+                shelfHeight = 0;
+            }
+
+            if (y + height > size)
+            {
+                AddPage(page, usedHeight, placed);
+                page = Raylib.GenImageColor(size, size, new Raylib_cs.Color(0, 0, 0, 0));
+
+                x = 0;
+                y = 0;
+                shelfHeight = 0;
+                usedHeight = 0;
+            }
+
+            Rectangle rect = new Rectangle(x, y, width, height);
+
+            Raylib.ImageDraw(ref page, entry.Image, new Rectangle(0, 0, width, height), rect, new Raylib_cs.Color(255, 255, 255, 255));
+            Raylib.UnloadImage(entry.Image);
+
+            placed.Add((entry.Name, rect));
+
+            x += width + Padding;
+            shelfHeight = System.Math.Max(shelfHeight, height + Padding);
+            usedHeight = System.Math.Max(usedHeight, y + height);
+        }
+
+        AddPage(page, usedHeight, placed);
+    }
+
+    private static List<string> FindImages(string directory)
+    {
+        List<string> files = new();
+
+        foreach (string file in Directory.GetFiles(directory))
+        {
+            if (Array.IndexOf(Extensions, Path.GetExtension(file).ToLowerInvariant()) >= 0)
+            {
+                files.Add(file);
+            }
+        }
+
+        files.Sort(string.CompareOrdinal);
+
+        return files;
+    }
+
+    private void AddPage(Raylib_cs.Image page, int height, List<(string Name, Rectangle Rect)> placed)
+    {
+        Raylib.ImageCrop(ref page, new Rectangle(0, 0, page.width, System.Math.Max(height, 1)));
+
+        Texture2D texture = Raylib.LoadTextureFromImage(page);
+        Raylib.UnloadImage(page);
+
+        Pages.Add(texture);
+
+        foreach (var (name, rect) in placed)
+        {
+            _images[name] = new Image(texture, rect);
+        }
+
+        placed.Clear();
+    }
+
+    public void Release()
+    {
+        Graphics.LoadedAtlases.Remove(this);
+
+        foreach (Texture2D page in Pages)
+        {
+            Raylib.UnloadTexture(page);
+        }
+    }
+
+    public Image GetImage(string filename)
+    {
+        return _images[filename];
+    }
+
+    public bool HasImage(string filename)
+    {
+        return _images.ContainsKey(filename);
+    }
+
+    public int GetPageCount()
+    {
+        return Pages.Count;
     }
 }
 
@@ -84,6 +256,7 @@ public static class Graphics
 {
     internal static List<Image> LoadedImages = new();
     internal static List<Font> LoadedFonts = new();
+    internal static List<Atlas> LoadedAtlases = new();
 
     private static Raylib_cs.Color _currentBackgroundColor = new(0, 0, 0, 255);
     private static Raylib_cs.Color _currentColor = new(255, 255, 255, 255);
@@ -122,6 +295,14 @@ public static class Graphics
             Raylib.UnloadFont(font.RayFont);
         }
 
+        foreach (Atlas atlas in LoadedAtlases)
+        {
+            foreach (Texture2D page in atlas.Pages)
+            {
+                Raylib.UnloadTexture(page);
+            }
+        }
+
         Raylib.UnloadRenderTexture(_renderTarget);
     }
 
@@ -223,12 +404,14 @@ public static class Graphics
 
     public static void Draw(Image image, int x, int y, float rotation = 0, float scale = 1)
     {
-        Raylib.DrawTextureEx(image.RayImage, new Vector2(x, y), rotation, scale, _currentColor);
+        Draw(image, new Vector2(x, y), rotation, scale);
     }
 
     public static void Draw(Image image, Vector2 position, float rotation = 0, float scale = 1)
     {
-        Raylib.DrawTextureEx(image.RayImage, position, rotation, scale, _currentColor);
+        Rectangle dest = new Rectangle(position.X, position.Y, image.Source.width * scale, image.Source.height * scale);
+
+        Raylib.DrawTexturePro(image.RayImage, image.Source, dest, Vector2.Zero, rotation, _currentColor);
     }
 
     public static void Ellipse(DrawMode mode, int x, int y, float radiusX, float radiusY)
@@ -375,6 +558,22 @@ public static class Graphics
         return newImage;
     }
 
+    public static Atlas NewAtlas(string directory, int size = 2048)
+    {
+        Atlas newAtlas = new(directory, size);
+        LoadedAtlases.Add(newAtlas);
+
+        return newAtlas;
+    }
+
+    public static Atlas NewAtlas(IEnumerable<string> filenames, int size = 2048)
+    {
+        Atlas newAtlas = new(filenames, size);
+        LoadedAtlases.Add(newAtlas);
+
+        return newAtlas;
+    }
+
     public static Font SetNewFont(string filename, int size)
     {
         Font newFont = new(filename, size);
@@ -0,0 +1,80 @@
+// Physics scaling benchmark: run with `build/turtle bench/physics`.
+// Keys 1-4 select the solver thread count.
+
+const WIDTH = 800;
+const HEIGHT = 600;
+
+const COUNT = 5000;
+
+const bodies: number[] = [];
+
+let elapsed = 0;
+let frames = 0;
+let physics = 0;
+
+function spawn()
+{
+    const floor = turtle.physics.newRectangleCollider(WIDTH / 2, HEIGHT, WIDTH, 20);
+    turtle.physics.setType(floor, "static");
+
+    const left = turtle.physics.newRectangleCollider(0, HEIGHT / 2, 20, HEIGHT * 4);
+    turtle.physics.setType(left, "static");
+
+    const right = turtle.physics.newRectangleCollider(WIDTH, HEIGHT / 2, 20, HEIGHT * 4);
+    turtle.physics.setType(right, "static");
+
+    const columns = 100;
+
+    for (let i = 0; i < COUNT; i++)
+    {
+        const x = 20 + (i % columns) * 7.5 + (Math.floor(i / columns) % 2) * 3;
+        const y = HEIGHT - 40 - Math.floor(i / columns) * 7;
+
+        bodies.push(turtle.physics.newCircleCollider(x, y, 3));
+    }
+}
+
+spawn();
+
+const transforms = new Float32Array(bodies.length * 5);
+
+function update(dt)
+{
+    for (let threads = 1; threads <= 4; threads++)
+    {
+        if (turtle.keyboard.isPressed(String(threads)))
+            turtle.physics.setThreads(threads);
+    }
+
+    elapsed += dt;
+    frames++;
+
+    if (elapsed >= 1)
+    {
+        const profile = turtle.timer.getProfile(frames);
+
+        physics = 0;
+
+        for (const frame of profile)
+            physics += frame.physics;
+
+        physics /= profile.length;
+        elapsed = 0;
+        frames = 0;
+    }
+}
+
+function draw()
+{
+    turtle.physics.readTransforms(bodies, transforms, true);
+
+    turtle.graphics.setColor(120, 200, 255, 255);
+
+    for (let i = 0; i < bodies.length; i++)
+        turtle.graphics.point(transforms[i * 5], transforms[i * 5 + 1]);
+
+    turtle.graphics.setColor(255, 255, 255, 255);
+    turtle.graphics.print("bodies: " + bodies.length, 10, 10, 20);
+    turtle.graphics.print("threads: " + turtle.physics.getThreads() + " (1-4)", 10, 35, 20);
+    turtle.graphics.print("physics: " + physics.toFixed(2) + " ms, fps: " + turtle.timer.getFPS(), 10, 60, 20);
+}
@@ -3095,6 +3095,12 @@ typedef struct duk_hthread duk_context;
  *  anything; these require direct changes above.
  */
 
+/* The engine runs mark-and-sweep itself at the end of a frame, after main
+ * and on the error screen instead of in the middle of an allocation, see
+ * frameGarbageCollection() in turtle.c.
+ */
+#undef DUK_USE_VOLUNTARY_GC
+
 /* __OVERRIDE_DEFINES__ */
 
 /*
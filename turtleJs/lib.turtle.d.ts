@@ -4,21 +4,36 @@ declare var exports;
 
 interface E {
     type: string;
-    peer: string;
-    data?: string;
+    peer: number;
+    data?: ArrayBuffer;
+    channel?: number;
+}
+
+interface GCStats {
+    mode: "frame" | "manual";
+    threshold: number;
+    compact: boolean;
+    heapSize: number;
+    allocated: number;
+    collections: number;
+    lastTime: number;
+    totalTime: number;
 }
 
 declare namespace turtle {
     namespace audio {
-        function newSource(filename: string): string;
+        function newSource(filename: string): number;
+        function newSourceAsync(filename: string, callback?: (source: number, error?: string) => void): number;
+        function isLoaded(source: number): boolean;
+        function releaseSource(source: number): void;
         function setMasterVolume(volume: number): void;
-        function play(sound: string): void;
-        function stop(sound: string): void;
-        function pause(sound: string): void;
-        function resume(sound: string): void;
-        function isPlaying(sound: string): boolean;
-        function setVolume(sound: string, volume: number): void;
-        function setPitch(sound: string, pitch: number): void;
+        function play(sound: number): void;
+        function stop(sound: number): void;
+        function pause(sound: number): void;
+        function resume(sound: number): void;
+        function isPlaying(sound: number): boolean;
+        function setVolume(sound: number, volume: number): void;
+        function setPitch(sound: number, pitch: number): void;
     }
 
     namespace camera {
@@ -37,24 +52,42 @@ declare namespace turtle {
     }
 
     namespace filesystem {
-
+        function exists(file: string): boolean;
+        function isDirectory(file: string): boolean;
+        function list(directory: string): string[];
+        function read(file: string): ArrayBuffer;
+        function readText(file: string): string;
+        function write(file: string, data: string | ArrayBuffer | ArrayBufferView): void;
+        function map(file: string): ArrayBuffer;
+        function readAsync(file: string, callback?: (data?: ArrayBuffer, error?: string) => void): void;
+        function writeAsync(file: string, data: string | ArrayBuffer | ArrayBufferView, callback?: (data?: undefined, error?: string) => void): void;
     }
 
     namespace graphics {
         function print(text: string, x: number, y: number, size: number): void;
         function circle(mode: string, x: number, y: number, radius: number): void;
-        function draw(image: string, x: number, y: number, rotation: number, scale: number): void;
+        function draw(image: number, x: number, y: number, rotation: number, scale: number): void;
+        function newSpriteBatch(image: number, capacity: number): number;
+        function setSpriteBatch(batch: number, data: Float32Array, count?: number): void;
+        function drawSpriteBatch(batch: number): void;
+        function releaseSpriteBatch(batch: number): void;
         function ellipse(mode: string, x: number, y: number, radiusX: number, radiusY: number): void;
         function line(x1: number, y1: number, x2: number, y2: number): void;
         function point(x: number, y: number): void;
         function rectangle(mode: string, x: number, y: number, width: number, height: number): void;
         function triangle(mode: string, x1: number, y1: number, x2: number, y2: number, x3: number, y3: number,): void;
-        function newImage(filename: string): string;
-        function newFont(filename: string): string;
+        function newImage(filename: string): number;
+        function newImageAsync(filename: string, callback?: (image: number, error?: string) => void): number;
+        function isLoaded(image: number): boolean;
+        function newAtlas(files: string | string[], size?: number): { pages: number[]; images: { [file: string]: number } };
+        function getViewport(image: number): [number, number, number, number];
+        function newFont(filename: string): number;
+        function releaseImage(image: number): void;
+        function releaseFont(font: number): void;
         function captureScreenshot(filename: string): void;
         function setBackgroundColor(r: number, g: number, b: number, a: number): void;
         function setColor(r: number, g: number, b: number, a: number): void;
-        function setFont(font: string);
+        function setFont(font: number);
     }
 
     namespace keyboard {
@@ -82,28 +115,65 @@ declare namespace turtle {
     }
 
     namespace network {
-        function newServer(address: string, port: number): string;
-        function newClient(): string;
-        function service(host: string, timeout: number): E;
-        function send(peer: string, data: string, method?: string): void;
-        function connect(host: string, address: string, port: number): string;
+        function newServer(address: string, port: number, channels?: number): number;
+        function newClient(channels?: number): number;
+        function service(host: number, timeout: number): E;
+        function poll(host: number, maxEvents?: number, timeout?: number): E[];
+        function send(peer: number, data: string | ArrayBuffer | ArrayBufferView, method?: string, channel?: number): boolean;
+        function connect(host: number, address: string, port: number): number;
+        function releasePeer(peer: number): void;
+        function releaseHost(host: number): void;
+        function setBackground(host: number, background: boolean): void;
+        function isBackground(host: number): boolean;
     }
 
     namespace physics {
-        function newCircleCollider(x: number, y: number, radius: number): string;
-        function newRectangleCollider(x: number, y: number, width: number, height: number): string;
-        function getX(collider: string): number;
-        function getY(collider: string): number;
-        function getType(collider: string): string;
-        function getMass(collider: string): number;
-        function getFriction(collider: string): number;
-        function setType(collider: string, type: string): void;
-        function setX(collider: string, x: number): void;
-        function setY(collider: string, y: number): void;
-        function setMass(collider: string, mass: number): void;
-        function setFriction(collider: string, friction: number): void;
-        function setCollisionClass(collider: string, collisionClass: string): void;
-        function isColliding(collider1: string, collider2: string): boolean;
+        function newCircleCollider(x: number, y: number, radius: number): number;
+        function newRectangleCollider(x: number, y: number, width: number, height: number): number;
+        function releaseCollider(collider: number): void;
+        function getX(collider: number): number;
+        function getY(collider: number): number;
+        function getType(collider: number): string;
+        function getMass(collider: number): number;
+        function getFriction(collider: number): number;
+        function setType(collider: number, type: string): void;
+        function setX(collider: number, x: number): void;
+        function setY(collider: number, y: number): void;
+        function setMass(collider: number, mass: number): void;
+        function setFriction(collider: number, friction: number): void;
+        function setCollisionClass(collider: number, collisionClass: string): void;
+        function isColliding(collider1: number, collider2: number): boolean;
+        function setTimestep(step: number, maxSubsteps?: number): void;
+        function getTimestep(): number;
+        function getInterpolation(): number;
+        function setThreads(threads: number): void;
+        function getThreads(): number;
+        function setIterations(iterations: number): void;
+        function getIterations(): number;
+        function setSpatialIndex(index: string, cellSize?: number, count?: number): void;
+        function queryPoint(x: number, y: number): Float64Array;
+        function queryRect(x: number, y: number, width: number, height: number): Float64Array;
+        function queryCircle(x: number, y: number, radius: number): Float64Array;
+        function raycast(x1: number, y1: number, x2: number, y2: number, radius?: number): Float64Array;
+        function getContacts(collider: number): Float64Array;
+        function getCollisions(): Float64Array;
+        function readTransforms(colliders: number[] | Float64Array, transforms: Float32Array, interpolate?: boolean): number;
+        function writeTransforms(colliders: number[] | Float64Array, transforms: Float32Array): void;
+    }
+
+    namespace profiler {
+        function setEnabled(enabled: boolean): void;
+        function isEnabled(): boolean;
+        function getZone(name: string): number;
+        function begin(zone: string | number): void;
+        function end(): void;
+        function clear(): void;
+        function getTrace(): string;
+        function saveTrace(file: string): void;
+        function setNativeStats(enabled: boolean): void;
+        function isNativeStats(): boolean;
+        function resetNativeStats(): void;
+        function getNativeStats(): { name: string; calls: number; time: number; timePerCall: number; callsPerFrame: number; lastFrameCalls: number; handleLookups: number; stringArguments: number }[];
     }
 
     namespace system {
@@ -111,12 +181,32 @@ declare namespace turtle {
         function setClipboardText(text: string): void;
         function getOS(): string;
         function openURL(url: string): void;
+        function isHeadless(): boolean;
+        function setUploadBudget(bytes: number): void;
+        function getUploadBudget(): number;
+        function setCacheMode(mode: "none" | "path" | "content"): void;
+        function getCacheStats(): { hits: number; misses: number; entries: number; bytes: number };
+        function gc(options?: { mode?: "frame" | "manual"; threshold?: number; compact?: boolean }): GCStats;
+        function getGCStats(): GCStats;
+        function getMemoryStats(): {
+            heapSize: number;
+            peak: number;
+            reserved: number;
+            fragmentation: number;
+            slabs: number;
+            classes: { size: number; blocks: number; freeBlocks: number; bytes: number }[];
+            large: { blocks: number; bytes: number };
+        };
+        function releaseWith(owner: object, type: "image" | "font" | "source" | "collider" | "spriteBatch" | "host" | "peer", handle: number): void;
     }
 
     namespace timer {
         function getDelta(): number;
         function getFPS(): number;
         function getTime(): number;
+        function getProfile(count?: number): { frame: number; upload: number; physics: number; update: number; draw: number; present: number; gc: number; nativeCalls: number }[];
+        function setProfileOverlay(enabled: boolean): void;
+        function isProfileOverlay(): boolean;
     }
 
     namespace window {
@@ -1,4 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "chipmunk/chipmunk.h"
+#include "chipmunk/cpHastySpace.h"
 #include "enet/enet.h"
 #include "raylib.h"
 
@@ -10,2277 +13,9953 @@
 #include "sds.h"
 #include "map.h"
 #include "vec.h"
-#include "uuid4.h"
 #include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
 
 #define VERSION "alpha 0.1"
 
-// STRUCTS
+// RLGL
+
+// libraylib.a contains rlgl but its header is not shipped with raylib 4.0, so
+// declare the immediate mode functions used by sprite batches here.
+
+#define RL_QUADS 0x0007
+
+void rlBegin(int mode);
+void rlEnd(void);
+void rlVertex2f(float x, float y);
+void rlTexCoord2f(float x, float y);
+void rlNormal3f(float x, float y, float z);
+void rlColor4ub(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
+void rlSetTexture(unsigned int id);
+bool rlCheckRenderBatchLimit(int vCount);
+
+// RESOURCES
+
+// An image is the region of a texture it covers. Plain images cover their
+// whole texture, atlas sub-images share the texture of the page image whose
+// handle they keep in page. Plain images have no page, which is 0.
+
+typedef struct TextureRegion
+{
+    Texture2D texture;
+    Rectangle source;
+    uint64_t page;
+} TextureRegion;
 
 typedef struct Collider
 {
     cpBody *body;
     cpShape *shape;
     const char *class;
+    cpVect previousPosition;
+    cpFloat previousAngle;
 } Collider;
 
-typedef struct Collision
-{
-    const char *idA;
-    const char *idB;
-} Collision;
-
-typedef struct Client
-{
-    const char *id;
-    const char *address;
-    int port;
-} Client;
+// HANDLES
 
-// STATE
+// A handle packs a slot index (low 32 bits) and that slot's generation (high
+// bits) into an integer that is exactly representable as a javascript number.
+// Removing a resource bumps the slot generation, so stale handles are detected
+// instead of aliasing whatever reuses the slot.
 
-typedef map_t(Texture2D) img_map_t;
-typedef map_t(Font) fnt_map_t;
-typedef map_t(Sound) snd_map_t;
-typedef map_t(Collider) col_map_t;
-typedef map_t(ENetHost *) host_map_t;
-typedef map_t(ENetPeer *) peer_map_t;
+typedef uint64_t Handle;
 
-typedef vec_t(Collision) col_vec_t;
+#define HANDLE_GENERATION_MAX (1 << 20)
 
-typedef struct State
+typedef struct Slot
 {
-    bool close;
-    bool error;
-    char errorString[1000];
-    char *title;
-    bool vSync;
-    bool grabbed;
-    bool typescript;
-    const char *baseDir;
-    map_int_t keys;
-    Color currentColor;
-    Color currentBackgroundColor;
-    Font currentFont;
-    img_map_t images;
-    fnt_map_t fonts;
-    snd_map_t sounds;
-    cpSpace *space;
-    col_map_t colliders;
-    Camera2D camera;
-    col_vec_t collisions;
-    host_map_t hosts;
-    peer_map_t peers;
-} State;
+    uint32_t generation;
+    bool alive;
+} Slot;
 
-State state;
+typedef vec_t(Slot) slot_vec_t;
 
-// AUDIO MODULE
+#define pool_t(T)\
+    struct { vec_t(T) items; slot_vec_t slots; vec_int_t free; int tmp; }
 
-duk_ret_t audioNewSource(duk_context *ctx)
-{
-    const char *filename = duk_require_string(ctx, 0);
+#define pool_init(p)\
+    memset((p), 0, sizeof(*(p)))
 
-    sds path = sdsempty();
-    path = sdscatprintf(path, "%s/%s", state.baseDir, filename);
+#define pool_deinit(p)\
+    ( vec_deinit(&(p)->items), vec_deinit(&(p)->slots), vec_deinit(&(p)->free) )
 
-    if (!FileExists(path))
-    {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "File does not exist.");
-        duk_throw(ctx);
-    }
+#define pool_get(p, handle)\
+    ( (p)->tmp = poolIndex_(&(p)->slots, handle),\
+      (p)->tmp < 0 ? NULL : &(p)->items.data[(p)->tmp] )
 
-    Sound sound = LoadSound(path);
+#define pool_add(p, value)\
+    ( (p)->tmp = poolAcquire_(&(p)->slots, &(p)->free),\
+      (p)->tmp == (p)->items.length ? vec_push(&(p)->items, value)\
+                                    : ((p)->items.data[(p)->tmp] = (value), 0),\
+      poolHandle_(&(p)->slots, (p)->tmp) )
 
-    sdsfree(path);
+#define pool_remove(p, handle)\
+    poolRelease_(&(p)->slots, &(p)->free, handle)
 
-    char soundId[UUID4_LEN];
-    uuid4_generate(soundId);
-    map_set(&state.sounds, soundId, sound);
+#define pool_foreach(p, i)\
+    for ((i) = 0; (i) < (p)->slots.length; (i)++)\
+        if ((p)->slots.data[(i)].alive)
 
-    duk_push_string(ctx, soundId);
+#define pool_handle(p, i)\
+    poolHandle_(&(p)->slots, i)
 
-    return 1;
+int handleIndex(Handle handle)
+{
+    return handle & 0xFFFFFFFF;
 }
 
-// REFACTORED
-
-duk_ret_t audioSetMasterVolume(duk_context *ctx)
+Handle poolHandle_(slot_vec_t *slots, int index)
 {
-    float volume = duk_require_number(ctx, 0);
-
-    SetMasterVolume(volume);
-
-    return 0;
+    return ((Handle)slots->data[index].generation << 32) | (uint32_t)index;
 }
 
-duk_ret_t audioPlay(duk_context *ctx)
+int poolIndex_(slot_vec_t *slots, Handle handle)
 {
-    const char *soundId = duk_require_string(ctx, 0);
+    int index = handleIndex(handle);
+    uint32_t generation = handle >> 32;
 
-    Sound sound = *map_get(&state.sounds, soundId);
+    if (index >= slots->length)
+        return -1;
 
-    PlaySound(sound);
+    Slot slot = slots->data[index];
 
-    return 0;
+    if (!slot.alive || slot.generation != generation)
+        return -1;
+
+    return index;
 }
 
-duk_ret_t audioStop(duk_context *ctx)
+int poolAcquire_(slot_vec_t *slots, vec_int_t *free)
 {
-    const char *soundId = duk_require_string(ctx, 0);
+    if (free->length > 0)
+    {
+        int index = vec_pop(free);
+        slots->data[index].alive = true;
+        return index;
+    }
 
-    Sound sound = *map_get(&state.sounds, soundId);
+    Slot slot;
+    slot.generation = 1;
+    slot.alive = true;
 
-    StopSound(sound);
+    vec_push(slots, slot);
 
-    return 0;
+    return slots->length - 1;
 }
 
-duk_ret_t audioPause(duk_context *ctx)
+bool poolRelease_(slot_vec_t *slots, vec_int_t *free, Handle handle)
 {
-    const char *soundId = duk_require_string(ctx, 0);
+    int index = poolIndex_(slots, handle);
 
-    Sound sound = *map_get(&state.sounds, soundId);
+    if (index < 0)
+        return false;
 
-    PauseSound(sound);
+    Slot *slot = &slots->data[index];
+    slot->alive = false;
+    slot->generation = slot->generation % HANDLE_GENERATION_MAX + 1;
 
-    return 0;
+    vec_push(free, index);
+
+    return true;
 }
 
-duk_ret_t audioResume(duk_context *ctx)
-{
-    const char *soundId = duk_require_string(ctx, 0);
+// QUEUES
 
-    Sound sound = *map_get(&state.sounds, soundId);
+// Fixed size single producer, single consumer ring buffers. The producer only
+// writes tail and the consumer only writes head, so no lock is needed.
 
-    ResumeSound(sound);
+#define QUEUE_SIZE 4096
 
-    return 0;
-}
+#define ring_t(T)\
+    struct { T items[QUEUE_SIZE]; unsigned head, tail; }
 
-duk_ret_t audioIsPlaying(duk_context *ctx)
-{
-    const char *soundId = duk_require_string(ctx, 0);
+#define ring_init(r)\
+    ( (r)->head = 0, (r)->tail = 0 )
 
-    Sound sound = *map_get(&state.sounds, soundId);
+#define ring_push(r, value)\
+    ( (r)->tail - __atomic_load_n(&(r)->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE ? false :\
+      ((r)->items[(r)->tail % QUEUE_SIZE] = (value),\
+       __atomic_store_n(&(r)->tail, (r)->tail + 1, __ATOMIC_RELEASE), true) )
 
-    bool playing = IsSoundPlaying(sound);
+#define ring_pop(r, out)\
+    ( __atomic_load_n(&(r)->tail, __ATOMIC_ACQUIRE) == (r)->head ? false :\
+      (*(out) = (r)->items[(r)->head % QUEUE_SIZE],\
+       __atomic_store_n(&(r)->head, (r)->head + 1, __ATOMIC_RELEASE), true) )
 
-    duk_push_boolean(ctx, playing);
+// STRUCTS
 
-    return 1;
-}
+// Every kind of handle, to release handles generically and to report the
+// ones still alive at shutdown.
 
-duk_ret_t audioSetVolume(duk_context *ctx)
+typedef enum HandleType
 {
-    const char *soundId = duk_require_string(ctx, 0);
-    float volume = duk_require_number(ctx, 1);
+    HANDLE_IMAGE,
+    HANDLE_FONT,
+    HANDLE_SOURCE,
+    HANDLE_COLLIDER,
+    HANDLE_SPRITE_BATCH,
+    HANDLE_HOST,
+    HANDLE_PEER,
+    HANDLE_TYPES
+} HandleType;
 
-    Sound sound = *map_get(&state.sounds, soundId);
-
-    SetSoundVolume(sound, volume);
+// Bulk transforms are packed as TRANSFORM_STRIDE floats per body:
+// x, y, angle in degrees, velocity x, velocity y.
 
-    return 0;
-}
+#define TRANSFORM_STRIDE 5
 
-duk_ret_t audioSetPitch(duk_context *ctx)
+typedef struct Collision
 {
-    const char *soundId = duk_require_string(ctx, 0);
-    float pitch = duk_require_number(ctx, 1);
-
-    Sound sound = *map_get(&state.sounds, soundId);
+    Handle idA;
+    Handle idB;
+} Collision;
 
-    SetSoundPitch(sound, pitch);
+// Raycasts return RAYCAST_STRIDE numbers per hit, nearest first:
+// collider, x, y, normal x, normal y, fraction along the ray.
 
-    return 0;
-}
+#define RAYCAST_STRIDE 6
 
-void registerAudioFunctions(duk_context *ctx)
+typedef struct RaycastHit
 {
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "audio");
+    Handle collider;
+    cpVect point;
+    cpVect normal;
+    cpFloat alpha;
+} RaycastHit;
+
+// Instances are packed as SPRITE_BATCH_STRIDE floats:
+// x, y, rotation, scale, source x, source y, source width, source height, r, g, b, a.
+// A zero source width or height draws the whole image, a negative one flips it.
+// Source rectangles are relative to the image, so for an atlas sub-image they
+// index into its region of the page.
+
+#define SPRITE_BATCH_STRIDE 12
+#define SPRITE_BATCH_CHUNK 1024
+#define SPRITE_BATCH_CAPACITY_MAX (1 << 24)
+
+typedef struct SpriteBatch
+{
+    Handle image;
+    float *instances;
+    int count;
+    int capacity;
+} SpriteBatch;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioNewSource, 1);
-    duk_put_prop_string(ctx, -2, "newSource");
-    duk_pop(ctx);
+// Atlases pack images into pages with a shelf packer: images sorted by
+// height are placed left to right on shelves, each shelf as tall as its first
+// image. ATLAS_PADDING pixels are left between images against filtering bleed.
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioSetMasterVolume, 1);
-    duk_put_prop_string(ctx, -2, "setMasterVolume");
-    duk_pop(ctx);
+#define ATLAS_SIZE 2048
+#define ATLAS_PADDING 1
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioPlay, 1);
-    duk_put_prop_string(ctx, -2, "play");
-    duk_pop(ctx);
+typedef struct AtlasEntry
+{
+    sds name;
+    Image image;
+    int page;
+    Rectangle rect;
+} AtlasEntry;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioStop, 1);
-    duk_put_prop_string(ctx, -2, "stop");
-    duk_pop(ctx);
+// A host can be serviced on its own thread. The thread owns the ENetHost:
+// events reach the main thread through one queue, packets to send leave it
+// through another, and the few other calls take the lock.
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioPause, 1);
-    duk_put_prop_string(ctx, -2, "pause");
-    duk_pop(ctx);
+typedef struct NetworkEvent
+{
+    ENetEvent event;
+    enet_uint32 connectID;
+} NetworkEvent;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioResume, 1);
-    duk_put_prop_string(ctx, -2, "resume");
-    duk_pop(ctx);
+typedef struct NetworkCommand
+{
+    ENetPeer *peer;
+    enet_uint32 connectID;
+    enet_uint8 channel;
+    ENetPacket *packet;
+} NetworkCommand;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioIsPlaying, 1);
-    duk_put_prop_string(ctx, -2, "isPlaying");
-    duk_pop(ctx);
+typedef vec_t(NetworkEvent) network_event_vec_t;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioSetVolume, 2);
-    duk_put_prop_string(ctx, -2, "setVolume");
-    duk_pop(ctx);
+typedef struct NetworkThread
+{
+    ENetHost *host;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool running;
+    ring_t(NetworkEvent) events;
+    ring_t(NetworkCommand) commands;
+    NetworkEvent held;
+    bool holding;
+} NetworkThread;
+
+// Async loads decode files on a pool of worker threads. Decoded jobs wait
+// in a queue until the main thread uploads them at the start of a frame.
+
+#define ASSET_WORKERS_MAX 4
+#define ASSET_UPLOAD_BUDGET (4 * 1024 * 1024)
+
+typedef enum AssetType
+{
+    ASSET_IMAGE,
+    ASSET_SOUND,
+    ASSET_FONT
+} AssetType;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "audio");
-    duk_push_c_function(ctx, audioSetPitch, 2);
-    duk_put_prop_string(ctx, -2, "setPitch");
-    duk_pop(ctx);
-}
+// A cached job carries no file: it only delivers callbacks for an asset that
+// was already loaded when it was requested again.
 
-// CAMERA MODULE
+typedef struct AssetJob
+{
+    AssetType type;
+    Handle handle;
+    vec_int_t callbacks;
+    bool cached;
+    bool keyed;
+    sds path;
+    sds key;
+    Image image;
+    Wave wave;
+} AssetJob;
+
+typedef vec_t(AssetJob *) job_vec_t;
+
+typedef struct AssetLoader
+{
+    pthread_t threads[ASSET_WORKERS_MAX];
+    int threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    job_vec_t queued;
+    job_vec_t decoded;
+} AssetLoader;
+
+// Loaders look files up in the cache before loading them. Keys are the asset
+// type and either the path or, in content mode, a hash of the file contents.
+
+typedef enum CacheMode
+{
+    CACHE_NONE,
+    CACHE_PATH,
+    CACHE_CONTENT
+} CacheMode;
 
-duk_ret_t cameraAttach(duk_context *ctx)
+typedef struct CacheEntry
 {
-    BeginMode2D(state.camera);
+    Handle handle;
+    int references;
+    int bytes;
+} CacheEntry;
 
-    return 0;
-}
+typedef map_t(CacheEntry) cache_map_t;
 
-duk_ret_t cameraDetach(duk_context *ctx)
+// Every handle that uses a cached resource, aliases included, maps back to
+// the key of its entry.
+
+typedef struct CacheHandle
 {
-    EndMode2D();
+    sds key;
+    AssetType type;
+    Handle handle;
+} CacheHandle;
 
-    return 0;
-}
+typedef map_t(CacheHandle) cache_handle_map_t;
 
-duk_ret_t cameraLookAt(duk_context *ctx)
+// In content mode an async load only learns its key on the worker. When the
+// content turns out to be cached already, its fresh handle becomes an alias
+// that shares the cached resource and holds one of its references.
+
+typedef enum CacheRelease
 {
-    int x = duk_require_number(ctx, 0);
-    int y = duk_require_number(ctx, 1);
+    RELEASE_KEEP,
+    RELEASE_REMOVE,
+    RELEASE_UNLOAD
+} CacheRelease;
 
-    state.camera.target = (Vector2){x, y};
+// Events a stopped network thread had not delivered wait in pending until the
+// next poll.
 
-    return 0;
-}
+typedef struct Host
+{
+    ENetHost *host;
+    NetworkThread *thread;
+    network_event_vec_t pending;
+} Host;
 
-duk_ret_t cameraZoom(duk_context *ctx)
+typedef struct Peer
 {
-    float zoom = duk_require_number(ctx, 0);
+    ENetPeer *peer;
+    enet_uint32 connectID;
+    Handle host;
+} Peer;
 
-    state.camera.zoom = zoom;
+// The profiler keeps the timings of the last PROFILE_FRAMES frames in a ring.
+// Every phase is in seconds, measured with the monotonic clock.
 
-    return 0;
-}
+#define PROFILE_FRAMES 240
 
-duk_ret_t cameraRotate(duk_context *ctx)
+typedef enum ProfilePhase
 {
-    float rotation = duk_require_number(ctx, 0);
-
-    state.camera.rotation = rotation;
+    PHASE_UPLOAD,
+    PHASE_PHYSICS,
+    PHASE_UPDATE,
+    PHASE_DRAW,
+    PHASE_PRESENT,
+    PHASE_GC,
+    PHASE_COUNT
+} ProfilePhase;
+
+const char *phaseNames[PHASE_COUNT] = {"upload", "physics", "update", "draw", "present", "gc"};
+
+typedef struct FrameProfile
+{
+    double frame;
+    double phases[PHASE_COUNT];
+    int nativeCalls;
+} FrameProfile;
 
-    return 0;
-}
+// While the profiler or the native statistics are on, registered C functions
+// are replaced by a trampoline that finds the original through its magic, an
+// index into state.natives.
 
-duk_ret_t cameraToWorldX(duk_context *ctx)
+typedef struct Native
 {
-    int x = duk_require_number(ctx, 0);
+    duk_c_function function;
+    int nargs;
+    sds module;
+    sds key;
+    sds name;
+    int zone;
+    int calls;
+    int frameCalls;
+    int lastFrameCalls;
+    double time;
+    int handleLookups;
+    int stringArguments;
+} Native;
+
+typedef vec_t(Native) native_vec_t;
+
+// Profiler zones are recorded into a ring when they end, so a trace holds the
+// last ZONE_EVENTS of them. The first zone ids are the automatic zones.
+
+#define ZONE_EVENTS 65536
+#define ZONE_DEPTH 64
+
+typedef enum AutoZone
+{
+    ZONE_FRAME,
+    ZONE_UPDATE,
+    ZONE_DRAW,
+    ZONE_STEP
+} AutoZone;
 
-    int transformed = x + state.camera.target.x;
+typedef struct ZoneEvent
+{
+    int zone;
+    double start;
+    double duration;
+} ZoneEvent;
 
-    duk_push_number(ctx, transformed);
+// Duktape collects no garbage on its own. Refcounting frees most of it and
+// the engine runs mark-and-sweep for cycles at the end of a frame, once
+// state.gcThreshold bytes were allocated since the last collection.
 
-    return 1;
-}
+#define GC_THRESHOLD (4 * 1024 * 1024)
 
-duk_ret_t cameraToWorldY(duk_context *ctx)
+typedef enum GCMode
 {
-    int y = duk_require_number(ctx, 0);
+    GC_FRAME,
+    GC_MANUAL
+} GCMode;
+
+// The Duktape heap serves small blocks from pools of fixed size classes,
+// carved out of HEAP_SLAB_SIZE slabs, and larger blocks from malloc. Every
+// block starts with a header holding its size, or the next free block of its
+// class while it is free, and the slab it was carved from. Slabs count their
+// live blocks, so compacting collections can give empty slabs back.
+
+#define HEAP_HEADER 16
+#define HEAP_SLAB_SIZE (16 * 1024)
+#define HEAP_CLASSES 10
+#define HEAP_CLASS_MAX 512
+
+typedef struct HeapSlab
+{
+    int live;
+} HeapSlab;
 
-    int transformed = y + state.camera.target.y;
+typedef struct HeapBlock
+{
+    struct HeapBlock *next;
+    HeapSlab *slab;
+} HeapBlock;
 
-    duk_push_number(ctx, transformed);
+typedef struct HeapClass
+{
+    int size;
+    HeapBlock *free;
+    int blocks;
+    int used;
+    size_t bytes;
+} HeapClass;
+
+// Compiled scripts are cached as bytecode, one file per script. The header
+// holds the hash of the source the bytecode was compiled from, whether it
+// was compiled as a program or as a module function, and a fingerprint of
+// the build that wrote it. Duktape bytecode is only valid for the exact
+// build and config that dumped it, and loading anything else is unsafe.
+
+#define BYTECODE_MAGIC 0x4342544a
+#define MODULE_PREFIX "function (require, exports, module) {"
+#define MODULE_SUFFIX "\n}"
+
+typedef struct BytecodeHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t build;
+    uint64_t hash;
+    uint64_t length;
+} BytecodeHeader;
+
+// A pack holds a whole game in one file: a header, the entries sorted by
+// name, the names and then the data of every entry, aligned to PACK_ALIGN.
+// Scripts are stored with their bytecode next to them, as name.jsbc.
+
+#define PACK_MAGIC "TURTLEPK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 16
+
+typedef struct PackHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} PackHeader;
 
-    return 1;
-}
+typedef struct PackEntry
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t name;
+    uint32_t nameLength;
+} PackEntry;
 
-duk_ret_t cameraGetX(duk_context *ctx)
+typedef struct Pack
 {
-    int x = state.camera.target.x;
+    unsigned char *data;
+    size_t size;
+    uint32_t count;
+    PackEntry *entries;
+    const char *names;
+} Pack;
+
+// Files are read through the virtual filesystem: from the pack mounted on the
+// game directory if there is one, otherwise from disk. Pack files are not
+// copied, they point into the mapping.
+
+typedef struct VfsFile
+{
+    unsigned char *data;
+    unsigned int size;
+    bool mapped;
+} VfsFile;
 
-    duk_push_number(ctx, x);
+// Async file reads and writes run in order on a single worker thread, so
+// writes to the same file land in the order they were made. Finished jobs
+// call their callback at the start of the next frame.
 
-    return 1;
-}
+typedef enum FileJobType
+{
+    FILE_READ,
+    FILE_WRITE
+} FileJobType;
 
-duk_ret_t cameraGetY(duk_context *ctx)
+typedef struct FileJob
 {
-    int y = state.camera.target.y;
+    FileJobType type;
+    sds path;
+    sds input;
+    unsigned char *data;
+    unsigned int size;
+    int callback;
+    bool failed;
+} FileJob;
+
+typedef vec_t(FileJob *) file_job_vec_t;
+
+typedef struct FileWorker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    file_job_vec_t queued;
+    file_job_vec_t finished;
+} FileWorker;
+
+// TypeScript files are compiled into a build directory in the user cache, by
+// one swc process per core that each take a share of the changed files. The
+// manifest there keeps the hash of every source that was compiled, so only
+// changed files are compiled again.
+
+#define SWC_MODULE "module.type=commonjs"
+#define SWC_STRICT "module.strictMode=false"
+
+typedef struct Compilation
+{
+    sds source;
+    sds output;
+    sds relative;
+    uint64_t hash;
+    pid_t pid;
+    double start;
+    double time;
+    bool failed;
+} Compilation;
 
-    duk_push_number(ctx, y);
+typedef vec_t(Compilation) compilation_vec_t;
 
-    return 1;
-}
+// A file going into a pack, read from path or held in data.
 
-duk_ret_t cameraGetZoom(duk_context *ctx)
+typedef struct PackItem
 {
-    float zoom = state.camera.zoom;
+    sds name;
+    sds path;
+    sds data;
+} PackItem;
 
-    duk_push_number(ctx, zoom);
+typedef vec_t(PackItem) pack_item_vec_t;
 
-    return 1;
-}
+// With --watch, images and sounds loaded from a file are remembered by path,
+// so a change to the file can be reloaded behind the same handles.
 
-duk_ret_t cameraGetRotation(duk_context *ctx)
+typedef struct WatchedAsset
 {
-    float rotation = state.camera.rotation;
-
-    duk_push_number(ctx, rotation);
+    AssetType type;
+    Handle handle;
+} WatchedAsset;
 
-    return 1;
-}
+typedef vec_t(WatchedAsset) watched_asset_vec_t;
+typedef map_t(watched_asset_vec_t) watched_asset_map_t;
+typedef map_t(uint64_t) hash_map_t;
 
-void registerCameraFunctions(duk_context *ctx)
+typedef struct Client
 {
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "camera");
+    const char *id;
+    const char *address;
+    int port;
+} Client;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraAttach, 0);
-    duk_put_prop_string(ctx, -2, "attach");
-    duk_pop(ctx);
+// STATE
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraDetach, 0);
-    duk_put_prop_string(ctx, -2, "detach");
-    duk_pop(ctx);
+typedef pool_t(TextureRegion) img_pool_t;
+typedef pool_t(Font) fnt_pool_t;
+typedef pool_t(Sound) snd_pool_t;
+typedef pool_t(Collider) col_pool_t;
+typedef pool_t(Host) host_pool_t;
+typedef pool_t(Peer) peer_pool_t;
+typedef pool_t(SpriteBatch) batch_pool_t;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraLookAt, 2);
-    duk_put_prop_string(ctx, -2, "lookAt");
-    duk_pop(ctx);
+typedef vec_t(Collision) col_vec_t;
+typedef vec_t(RaycastHit) hit_vec_t;
+typedef vec_t(AtlasEntry) atlas_vec_t;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraZoom, 1);
-    duk_put_prop_string(ctx, -2, "zoom");
-    duk_pop(ctx);
+typedef struct State
+{
+    bool close;
+    bool error;
+    char errorString[1000];
+    char *title;
+    bool vSync;
+    bool grabbed;
+    bool headless;
+    int tickRate;
+    double headlessStart;
+    double headlessDelta;
+    const char *baseDir;
+    map_int_t keys;
+    Color currentColor;
+    Color currentBackgroundColor;
+    Font currentFont;
+    img_pool_t images;
+    fnt_pool_t fonts;
+    snd_pool_t sounds;
+    cpSpace *space;
+    int physicsThreads;
+    double spatialHashCellSize;
+    int spatialHashCount;
+    vec_double_t queryResults;
+    hit_vec_t raycastHits;
+    double physicsStep;
+    int physicsMaxSubsteps;
+    double physicsAccumulator;
+    col_pool_t colliders;
+    Camera2D camera;
+    col_vec_t collisions;
+    int *collisionTable;
+    int collisionTableSize;
+    host_pool_t hosts;
+    peer_pool_t peers;
+    batch_pool_t batches;
+    AssetLoader loader;
+    bool loaderStarted;
+    job_vec_t loading;
+    int nextCallbackId;
+    int uploadBudget;
+    cache_map_t cache;
+    cache_handle_map_t cacheKeys;
+    CacheMode cacheMode;
+    int cacheHits;
+    int cacheMisses;
+    bool trackHandles;
+    vec_int_t handleSites[HANDLE_TYPES];
+    vec_str_t siteNames;
+    map_int_t siteIds;
+    FrameProfile profiles[PROFILE_FRAMES];
+    FrameProfile profile;
+    int profileCount;
+    int profileHead;
+    double frameStart;
+    bool profileOverlay;
+    native_vec_t natives;
+    bool nativeStats;
+    int nativeStatFrames;
+    int handleLookups;
+    bool profiling;
+    double profilerStart;
+    ZoneEvent *zoneEvents;
+    int zoneHead;
+    int zoneCount;
+    ZoneEvent openZones[ZONE_DEPTH];
+    int openZoneCount;
+    vec_str_t zoneNames;
+    map_int_t zoneIds;
+    HeapClass heapClasses[HEAP_CLASSES];
+    unsigned char heapClassIndex[HEAP_CLASS_MAX / 16 + 1];
+    vec_void_t heapSlabs;
+    int largeBlocks;
+    size_t largeBytes;
+    size_t heapSize;
+    size_t heapPeak;
+    size_t heapAllocated;
+    GCMode gcMode;
+    size_t gcThreshold;
+    bool gcCompact;
+    int gcCollections;
+    double gcLastTime;
+    double gcTotalTime;
+    bool scriptCache;
+    sds bytecodeDirectory;
+    sds scriptDirectory;
+    Pack pack;
+    FileWorker fileWorker;
+    bool fileWorkerStarted;
+    int watcher;
+    vec_str_t watchDirectories;
+    watched_asset_map_t watchedAssets;
+    bool trampolines;
+    bool profileNatives;
+} State;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraRotate, 1);
-    duk_put_prop_string(ctx, -2, "rotate");
-    duk_pop(ctx);
+State state;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraToWorldX, 1);
-    duk_put_prop_string(ctx, -2, "toWorldX");
-    duk_pop(ctx);
+void error(duk_context *ctx)
+{
+    duk_get_prop_string(ctx, -1, "stack");
+    strcpy(state.errorString, duk_safe_to_string(ctx, -1));
+    state.error = true;
+}
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraToWorldY, 1);
-    duk_put_prop_string(ctx, -2, "toWorldY");
-    duk_pop(ctx);
+// HANDLE ARGUMENTS
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraGetX, 0);
-    duk_put_prop_string(ctx, -2, "getX");
-    duk_pop(ctx);
+void pushHandle(duk_context *ctx, Handle handle)
+{
+    duk_push_number(ctx, (double)handle);
+}
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraGetY, 0);
-    duk_put_prop_string(ctx, -2, "getY");
-    duk_pop(ctx);
+// Casting NaN or a number outside the range of Handle is undefined, and no
+// handle is negative or above 2^53, so those become the invalid handle 0.
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraGetZoom, 0);
-    duk_put_prop_string(ctx, -2, "getZoom");
-    duk_pop(ctx);
+Handle numberHandle(double value)
+{
+    if (!(value >= 0 && value < 9007199254740992.0))
+        return 0;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "camera");
-    duk_push_c_function(ctx, cameraGetRotation, 0);
-    duk_put_prop_string(ctx, -2, "getRotation");
-    duk_pop(ctx);
+    return (Handle)value;
 }
 
-void registerFilesystemFunctions(duk_context *ctx)
+Handle requireHandle(duk_context *ctx, duk_idx_t idx)
 {
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "filesystem");
+    state.handleLookups++;
+
+    return numberHandle(duk_require_number(ctx, idx));
 }
 
-duk_ret_t graphicsCircle(duk_context *ctx)
+void throwInvalidHandle(duk_context *ctx)
 {
-    const char *mode = duk_require_string(ctx, 0);
-    int x = duk_require_number(ctx, 1);
-    int y = duk_require_number(ctx, 2);
-    float radius = duk_require_number(ctx, 3);
+    duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Invalid or released handle.");
+    duk_throw(ctx);
+}
 
-    if (strcmp("line", mode) == 0)
+// Returns true when the value at idx is a typed array made by the named
+// global constructor, such as "Float32Array".
+
+bool isTypedArray(duk_context *ctx, duk_idx_t idx, const char *constructor)
+{
+    idx = duk_require_normalize_index(ctx, idx);
+
+    if (!duk_is_buffer_data(ctx, idx))
+        return false;
+
+    duk_get_global_string(ctx, constructor);
+    bool typed = duk_instanceof(ctx, idx, -1);
+    duk_pop(ctx);
+
+    return typed;
+}
+
+// Bulk functions take handles either as an array or as a Float64Array, which
+// holds every handle exactly and is read without a property lookup per element.
+
+typedef struct HandleList
+{
+    duk_idx_t idx;
+    double *data;
+    int length;
+} HandleList;
+
+HandleList requireHandleList(duk_context *ctx, duk_idx_t idx)
+{
+    HandleList list;
+    list.idx = duk_require_normalize_index(ctx, idx);
+    idx = list.idx;
+
+    if (duk_is_buffer_data(ctx, idx))
     {
-        DrawCircleLines(x, y, radius, state.currentColor);
+        if (!isTypedArray(ctx, idx, "Float64Array"))
+        {
+            duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Handle buffers must be a Float64Array.");
+            duk_throw(ctx);
+        }
+
+        duk_size_t size;
+        list.data = duk_get_buffer_data(ctx, idx, &size);
+        list.length = size / sizeof(double);
     }
-    else if (strcmp("fill", mode) == 0)
+    else
     {
-        DrawCircle(x, y, radius, state.currentColor);
+        duk_require_object(ctx, idx);
+        list.data = NULL;
+        list.length = duk_get_length(ctx, idx);
     }
 
-    return 0;
+    return list;
 }
 
-duk_ret_t graphicsDraw(duk_context *ctx)
+double *pushHandleArray(duk_context *ctx, int length)
 {
-    const char *imageId = duk_require_string(ctx, 0);
-    int x = duk_require_number(ctx, 1);
-    int y = duk_require_number(ctx, 2);
-    float rotation = duk_require_number(ctx, 3);
-    float scale = duk_require_number(ctx, 4);
+    double *handles = duk_push_fixed_buffer(ctx, sizeof(double) * length);
+    duk_push_buffer_object(ctx, -1, 0, sizeof(double) * length, DUK_BUFOBJ_FLOAT64ARRAY);
+    duk_remove(ctx, -2);
+
+    return handles;
+}
 
-    Texture2D image = *map_get(&state.images, imageId);
+Handle handleListGet(duk_context *ctx, HandleList *list, int i)
+{
+    if (list->data != NULL)
+    {
+        state.handleLookups++;
+        return numberHandle(list->data[i]);
+    }
 
-    DrawTextureEx(image, (Vector2){x, y}, rotation, scale, state.currentColor);
+    duk_get_prop_index(ctx, list->idx, i);
+    Handle handle = requireHandle(ctx, -1);
+    duk_pop(ctx);
 
-    return 0;
+    return handle;
 }
 
-duk_ret_t graphicsEllipse(duk_context *ctx)
+TextureRegion *requireImage(duk_context *ctx, duk_idx_t idx)
 {
-    const char *mode = duk_require_string(ctx, 0);
-    int x = duk_require_number(ctx, 1);
-    int y = duk_require_number(ctx, 2);
-    float radiusX = duk_require_number(ctx, 3);
-    float radiusY = duk_require_number(ctx, 4);
+    TextureRegion *image = pool_get(&state.images, requireHandle(ctx, idx));
 
-    if (strcmp("line", mode) == 0)
-    {
-        DrawEllipseLines(x, y, radiusX, radiusY, state.currentColor);
-    }
-    else if (strcmp("fill", mode) == 0)
-    {
-        DrawEllipse(x, y, radiusX, radiusY, state.currentColor);
-    }
+    if (image == NULL)
+        throwInvalidHandle(ctx);
 
-    return 0;
+    return image;
 }
 
-duk_ret_t graphicsLine(duk_context *ctx)
+TextureRegion textureRegion(Texture2D texture)
 {
-    int x1 = duk_require_number(ctx, 0);
-    int y1 = duk_require_number(ctx, 1);
-    int x2 = duk_require_number(ctx, 2);
-    int y2 = duk_require_number(ctx, 3);
+    TextureRegion region;
+    region.texture = texture;
+    region.source = (Rectangle){0, 0, texture.width, texture.height};
+    region.page = 0;
 
-    DrawLine(x1, y1, x2, y2, state.currentColor);
+    return region;
+}
 
-    return 0;
+Font *requireFont(duk_context *ctx, duk_idx_t idx)
+{
+    Font *font = pool_get(&state.fonts, requireHandle(ctx, idx));
+
+    if (font == NULL)
+        throwInvalidHandle(ctx);
+
+    return font;
 }
 
-duk_ret_t graphicsPoint(duk_context *ctx)
+Sound *requireSound(duk_context *ctx, duk_idx_t idx)
 {
-    int x = duk_require_number(ctx, 0);
-    int y = duk_require_number(ctx, 1);
+    Sound *sound = pool_get(&state.sounds, requireHandle(ctx, idx));
 
-    DrawPixel(x, y, state.currentColor);
+    if (sound == NULL)
+        throwInvalidHandle(ctx);
 
-    return 0;
+    return sound;
 }
 
-duk_ret_t graphicsPrint(duk_context *ctx)
+Collider *requireCollider(duk_context *ctx, duk_idx_t idx)
 {
-    const char *text = duk_require_string(ctx, 0);
-    int x = duk_require_number(ctx, 1);
-    int y = duk_require_number(ctx, 2);
-    int size = duk_require_number(ctx, 3);
+    Collider *collider = pool_get(&state.colliders, requireHandle(ctx, idx));
 
-    DrawTextEx(state.currentFont, text, (Vector2){x, y}, size, 2, state.currentColor);
+    if (collider == NULL)
+        throwInvalidHandle(ctx);
 
-    return 0;
+    return collider;
 }
 
-duk_ret_t graphicsRectangle(duk_context *ctx)
+SpriteBatch *requireSpriteBatch(duk_context *ctx, duk_idx_t idx)
 {
-    const char *mode = duk_require_string(ctx, 0);
-    int x = duk_require_number(ctx, 1);
-    int y = duk_require_number(ctx, 2);
-    int width = duk_require_number(ctx, 3);
-    int height = duk_require_number(ctx, 4);
+    SpriteBatch *batch = pool_get(&state.batches, requireHandle(ctx, idx));
 
-    if (strcmp("line", mode) == 0)
-    {
-        DrawRectangleLines(x, y, width, height, state.currentColor);
-    }
-    else if (strcmp("fill", mode) == 0)
-    {
-        DrawRectangle(x, y, width, height, state.currentColor);
-    }
+    if (batch == NULL)
+        throwInvalidHandle(ctx);
 
-    return 0;
+    return batch;
 }
 
-duk_ret_t graphicsTriangle(duk_context *ctx)
+Host *requireHost(duk_context *ctx, duk_idx_t idx)
 {
-    const char *mode = duk_require_string(ctx, 0);
-    int x1 = duk_require_number(ctx, 1);
-    int y1 = duk_require_number(ctx, 2);
-    int x2 = duk_require_number(ctx, 3);
-    int y2 = duk_require_number(ctx, 4);
-    int x3 = duk_require_number(ctx, 5);
-    int y3 = duk_require_number(ctx, 6);
+    Host *host = pool_get(&state.hosts, requireHandle(ctx, idx));
 
-    if (strcmp("line", mode) == 0)
-    {
-        DrawTriangleLines((Vector2){x1, y1}, (Vector2){x2, y2}, (Vector2){x3, y3}, state.currentColor);
-    }
-    else if (strcmp("fill", mode) == 0)
-    {
-        DrawTriangle((Vector2){x1, y1}, (Vector2){x2, y2}, (Vector2){x3, y3}, state.currentColor);
-    }
+    if (host == NULL)
+        throwInvalidHandle(ctx);
 
-    return 0;
+    return host;
 }
 
-duk_ret_t graphicsNewImage(duk_context *ctx)
+Peer *requirePeer(duk_context *ctx, duk_idx_t idx)
 {
-    const char *filename = duk_require_string(ctx, 0);
+    Peer *peer = pool_get(&state.peers, requireHandle(ctx, idx));
 
-    char path[1000];
-    strcpy(path, state.baseDir);
-    strcat(path, "/");
-    strcat(path, filename);
+    if (peer == NULL)
+        throwInvalidHandle(ctx);
 
-    Texture2D image = LoadTexture(path);
+    return peer;
+}
 
-    char imageId[UUID4_LEN];
-    uuid4_generate(imageId);
+// HANDLE TRACKING
 
-    map_set(&state.images, imageId, image);
+// With --leaks every handle remembers the script location that created it,
+// as an index into the interned site names, so the handles still alive at
+// shutdown can be reported by where they came from.
 
-    duk_push_string(ctx, imageId);
+const char *handleTypeNames[HANDLE_TYPES] = {"image", "font", "source", "collider", "spriteBatch", "host", "peer"};
 
-    return 1;
+int internSite(const char *site)
+{
+    int *id = map_get(&state.siteIds, site);
+
+    if (id != NULL)
+        return *id;
+
+    int newId = state.siteNames.length;
+
+    vec_push(&state.siteNames, sdsnew(site));
+    map_set(&state.siteIds, site, newId);
+
+    return newId;
 }
 
-duk_ret_t graphicsNewFont(duk_context *ctx)
+// Returns the site of the script function calling the current native one.
+
+int creationSite(duk_context *ctx)
 {
-    const char *filename = duk_require_string(ctx, 0);
+    duk_inspect_callstack_entry(ctx, -2);
 
-    Font font = LoadFont(filename);
+    if (!duk_is_object(ctx, -1))
+    {
+        duk_pop(ctx);
+        return internSite("unknown");
+    }
 
-    char fontId[UUID4_LEN];
-    uuid4_generate(fontId);
+    duk_get_prop_string(ctx, -1, "lineNumber");
+    int line = duk_get_int(ctx, -1);
+    duk_pop(ctx);
 
-    map_set(&state.fonts, fontId, font);
+    duk_get_prop_string(ctx, -1, "function");
+    duk_get_prop_string(ctx, -1, "fileName");
+    const char *file = duk_get_string(ctx, -1);
 
-    duk_push_string(ctx, fontId);
+    sds site = sdsempty();
+    site = sdscatprintf(site, "%s:%d", file != NULL ? file : "unknown", line);
 
-    return 1;
-}
+    duk_pop_3(ctx);
 
-duk_ret_t graphicsCaptureScreenshot(duk_context *ctx)
-{
-    const char *filename = duk_require_string(ctx, 0);
+    int id = internSite(site);
 
-    TakeScreenshot(filename);
+    sdsfree(site);
 
-    return 0;
+    return id;
 }
 
-duk_ret_t graphicsSetBackgroundColor(duk_context *ctx)
+void trackHandle(duk_context *ctx, HandleType type, Handle handle)
 {
-    int r = duk_require_number(ctx, 0);
-    int g = duk_require_number(ctx, 1);
-    int b = duk_require_number(ctx, 2);
-    int a = duk_require_number(ctx, 3);
+    if (!state.trackHandles)
+        return;
 
-    Color color;
-    color.r = r;
-    color.g = g;
-    color.b = b;
-    color.a = a;
+    vec_int_t *sites = &state.handleSites[type];
+    int index = handleIndex(handle);
 
-    state.currentBackgroundColor = color;
+    while (sites->length <= index)
+        vec_push(sites, -1);
 
-    return 0;
+    sites->data[index] = creationSite(ctx);
 }
 
-duk_ret_t graphicsSetColor(duk_context *ctx)
-{
-    int r = duk_require_number(ctx, 0);
-    int g = duk_require_number(ctx, 1);
-    int b = duk_require_number(ctx, 2);
-    int a = duk_require_number(ctx, 3);
+// HEADLESS
 
-    Color color;
-    color.r = r;
-    color.g = g;
-    color.b = b;
-    color.a = a;
+// Without a window there is no GL context, input or audio device. Frame timing
+// comes from the monotonic clock, and every function that would touch raylib's
+// window, GL or audio state is replaced by a no-op when the modules are
+// registered. Resource constructors still return handles, to empty resources.
 
-    state.currentColor = color;
+double monotonicTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    return 0;
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-duk_ret_t graphicsSetFont(duk_context *ctx)
+double frameTime()
 {
-    const char *fontId = duk_require_string(ctx, 0);
+    if (state.headless)
+        return state.headlessDelta;
 
-    Font font = *map_get(&state.fonts, fontId);
+    return GetFrameTime();
+}
 
-    state.currentFont = font;
+double currentTime()
+{
+    if (state.headless)
+        return monotonicTime() - state.headlessStart;
+
+    return GetTime();
+}
 
+duk_ret_t headlessNoop(duk_context *ctx)
+{
     return 0;
 }
 
-void registerGraphicsFunctions(duk_context *ctx)
+// Replaces every function of a module except the ones in keep, a NULL
+// terminated list of names.
+
+void disableModule(duk_context *ctx, const char *module, const char **keep)
 {
     duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "graphics");
+    duk_get_prop_string(ctx, -1, module);
+    duk_enum(ctx, -1, 0);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsCircle, 4);
-    duk_put_prop_string(ctx, -2, "circle");
-    duk_pop(ctx);
+    while (duk_next(ctx, -1, 0))
+    {
+        const char *name = duk_get_string(ctx, -1);
+        bool kept = false;
 
+        for (int i = 0; keep != NULL && keep[i] != NULL; i++)
+        {
+            if (strcmp(name, keep[i]) == 0)
+                kept = true;
+        }
+
+        if (kept)
+        {
+            duk_pop(ctx);
+            continue;
+        }
+
+        duk_push_c_function(ctx, headlessNoop, DUK_VARARGS);
+        duk_put_prop(ctx, -4);
+    }
+
+    duk_pop_3(ctx);
+}
+
+void disableFunction(duk_context *ctx, const char *module, const char *name)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, module);
+    duk_push_c_function(ctx, headlessNoop, DUK_VARARGS);
+    duk_put_prop_string(ctx, -2, name);
+    duk_pop_2(ctx);
+}
+
+void registerHeadlessFunctions(duk_context *ctx)
+{
+    static const char *graphicsKeep[] = {"newImage", "newImageAsync", "isLoaded", "newAtlas", "getViewport", "newFont", "releaseImage", "releaseFont", "releaseSpriteBatch", "newSpriteBatch", "setSpriteBatch", NULL};
+    static const char *audioKeep[] = {"newSource", "newSourceAsync", "isLoaded", "releaseSource", NULL};
+    static const char *windowKeep[] = {"close", NULL};
+
+    disableModule(ctx, "graphics", graphicsKeep);
+    disableModule(ctx, "audio", audioKeep);
+    disableModule(ctx, "window", windowKeep);
+    disableModule(ctx, "keyboard", NULL);
+    disableModule(ctx, "mouse", NULL);
+
+    disableFunction(ctx, "camera", "attach");
+    disableFunction(ctx, "camera", "detach");
+    disableFunction(ctx, "system", "getClipboardText");
+    disableFunction(ctx, "system", "setClipboardText");
+}
+
+// HEAP
+
+void initHeap()
+{
+    static const int sizes[HEAP_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+    int index = 0;
+
+    for (int i = 0; i < HEAP_CLASSES; i++)
+    {
+        state.heapClasses[i] = (HeapClass){sizes[i], NULL, 0, 0, 0};
+
+        while (index <= sizes[i] / 16)
+            state.heapClassIndex[index++] = i;
+    }
+
+    vec_init(&state.heapSlabs);
+}
+
+// Splits a new slab into free blocks of the class. The slab's own header
+// takes the first HEAP_HEADER bytes so the blocks stay aligned.
+
+bool growHeapClass(HeapClass *heapClass)
+{
+    char *slab = malloc(HEAP_SLAB_SIZE);
+
+    if (slab == NULL)
+        return false;
+
+    vec_push(&state.heapSlabs, slab);
+
+    ((HeapSlab *)slab)->live = 0;
+
+    int stride = HEAP_HEADER + heapClass->size;
+
+    for (int offset = HEAP_HEADER; offset + stride <= HEAP_SLAB_SIZE; offset += stride)
+    {
+        HeapBlock *block = (HeapBlock *)(slab + offset);
+        block->next = heapClass->free;
+        block->slab = (HeapSlab *)slab;
+        heapClass->free = block;
+        heapClass->blocks++;
+    }
+
+    return true;
+}
+
+void *heapAlloc(void *udata, duk_size_t size)
+{
+    size_t *block;
+
+    if (size <= HEAP_CLASS_MAX)
+    {
+        HeapClass *heapClass = &state.heapClasses[state.heapClassIndex[(size + 15) / 16]];
+
+        if (heapClass->free == NULL && !growHeapClass(heapClass))
+            return NULL;
+
+        block = (size_t *)heapClass->free;
+        heapClass->free->slab->live++;
+        heapClass->free = heapClass->free->next;
+        heapClass->used++;
+        heapClass->bytes += size;
+    }
+    else
+    {
+        block = malloc(HEAP_HEADER + size);
+
+        if (block == NULL)
+            return NULL;
+
+        state.largeBlocks++;
+        state.largeBytes += size;
+    }
+
+    *block = size;
+
+    state.heapSize += size;
+    state.heapAllocated += size;
+
+    if (state.heapSize > state.heapPeak)
+        state.heapPeak = state.heapSize;
+
+    return (char *)block + HEAP_HEADER;
+}
+
+void heapFree(void *udata, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    size_t *block = (size_t *)((char *)ptr - HEAP_HEADER);
+    size_t size = *block;
+
+    state.heapSize -= size;
+
+    if (size <= HEAP_CLASS_MAX)
+    {
+        HeapClass *heapClass = &state.heapClasses[state.heapClassIndex[(size + 15) / 16]];
+
+        ((HeapBlock *)block)->slab->live--;
+        ((HeapBlock *)block)->next = heapClass->free;
+        heapClass->free = (HeapBlock *)block;
+        heapClass->used--;
+        heapClass->bytes -= size;
+    }
+    else
+    {
+        state.largeBlocks--;
+        state.largeBytes -= size;
+
+        free(block);
+    }
+}
+
+// Blocks that stay in their size class are resized in place.
+
+void *heapRealloc(void *udata, void *ptr, duk_size_t size)
+{
+    if (ptr == NULL)
+        return heapAlloc(udata, size);
+
+    if (size == 0)
+    {
+        heapFree(udata, ptr);
+        return NULL;
+    }
+
+    size_t *block = (size_t *)((char *)ptr - HEAP_HEADER);
+    size_t oldSize = *block;
+
+    if (oldSize <= HEAP_CLASS_MAX && size <= HEAP_CLASS_MAX &&
+        state.heapClassIndex[(oldSize + 15) / 16] == state.heapClassIndex[(size + 15) / 16])
+    {
+        HeapClass *heapClass = &state.heapClasses[state.heapClassIndex[(size + 15) / 16]];
+        heapClass->bytes += size - oldSize;
+
+        *block = size;
+
+        state.heapSize += size - oldSize;
+
+        if (size > oldSize)
+            state.heapAllocated += size - oldSize;
+
+        if (state.heapSize > state.heapPeak)
+            state.heapPeak = state.heapSize;
+
+        return ptr;
+    }
+
+    if (oldSize > HEAP_CLASS_MAX && size > HEAP_CLASS_MAX)
+    {
+        block = realloc(block, HEAP_HEADER + size);
+
+        if (block == NULL)
+            return NULL;
+
+        *block = size;
+
+        state.largeBytes += size - oldSize;
+        state.heapSize += size - oldSize;
+
+        if (size > oldSize)
+            state.heapAllocated += size - oldSize;
+
+        if (state.heapSize > state.heapPeak)
+            state.heapPeak = state.heapSize;
+
+        return (char *)block + HEAP_HEADER;
+    }
+
+    void *resized = heapAlloc(udata, size);
+
+    if (resized == NULL)
+        return NULL;
+
+    memcpy(resized, ptr, oldSize < size ? oldSize : size);
+
+    heapFree(udata, ptr);
+
+    return resized;
+}
+
+// Gives back the slabs without live blocks. Their blocks are unlinked from
+// the free lists first, which walks every free block, so this only runs with
+// compacting collections.
+
+void releaseEmptySlabs()
+{
+    for (int i = 0; i < HEAP_CLASSES; i++)
+    {
+        HeapClass *heapClass = &state.heapClasses[i];
+        HeapBlock **link = &heapClass->free;
+
+        while (*link != NULL)
+        {
+            if ((*link)->slab->live == 0)
+            {
+                *link = (*link)->next;
+                heapClass->blocks--;
+            }
+            else
+            {
+                link = &(*link)->next;
+            }
+        }
+    }
+
+    for (int i = state.heapSlabs.length - 1; i >= 0; i--)
+    {
+        HeapSlab *slab = state.heapSlabs.data[i];
+
+        if (slab->live == 0)
+        {
+            free(slab);
+            vec_splice(&state.heapSlabs, i, 1);
+        }
+    }
+}
+
+void freeHeap()
+{
+    int i;
+    void *slab;
+
+    vec_foreach(&state.heapSlabs, slab, i) {
+        free(slab);
+    }
+
+    vec_deinit(&state.heapSlabs);
+}
+
+size_t heapReserved()
+{
+    return (size_t)state.heapSlabs.length * HEAP_SLAB_SIZE + state.largeBytes + (size_t)state.largeBlocks * HEAP_HEADER;
+}
+
+// GARBAGE COLLECTION
+
+// Accounts for a collection that started at start and ends now.
+
+void recordCollection(double start)
+{
+    double time = monotonicTime() - start;
+
+    state.profile.phases[PHASE_GC] += time;
+    state.gcLastTime = time;
+    state.gcTotalTime += time;
+    state.gcCollections++;
+    state.heapAllocated = 0;
+}
+
+void collectGarbage(duk_context *ctx, duk_uint_t flags)
+{
+    double start = monotonicTime();
+
+    duk_gc(ctx, flags | (state.gcCompact ? DUK_GC_COMPACT : 0));
+
+    if (state.gcCompact || (flags & DUK_GC_COMPACT))
+        releaseEmptySlabs();
+
+    recordCollection(start);
+}
+
+// Called at the end of a frame, after the frame was presented, and at the
+// other safe points where no frame runs: after main and on the error screen.
+
+void frameGarbageCollection(duk_context *ctx)
+{
+    if (state.gcMode == GC_FRAME && state.heapAllocated >= state.gcThreshold)
+        collectGarbage(ctx, 0);
+}
+
+// PROFILER
+
+int internZone(const char *name)
+{
+    int *id = map_get(&state.zoneIds, name);
+
+    if (id != NULL)
+        return *id;
+
+    int newId = state.zoneNames.length;
+
+    vec_push(&state.zoneNames, sdsnew(name));
+    map_set(&state.zoneIds, name, newId);
+
+    return newId;
+}
+
+void initProfiler()
+{
+    vec_init(&state.zoneNames);
+    map_init(&state.zoneIds);
+
+    internZone("frame");
+    internZone("update");
+    internZone("draw");
+    internZone("cpSpaceStep");
+
+    state.profilerStart = monotonicTime();
+}
+
+// Records a zone that started at start and ends now, if the profiler is on.
+
+void profileZone(int zone, double start)
+{
+    if (!state.profiling)
+        return;
+
+    double now = monotonicTime();
+
+    ZoneEvent *event = &state.zoneEvents[state.zoneHead];
+    event->zone = zone;
+    event->start = start;
+    event->duration = now - start;
+
+    state.zoneHead = (state.zoneHead + 1) % ZONE_EVENTS;
+
+    if (state.zoneCount < ZONE_EVENTS)
+        state.zoneCount++;
+}
+
+// Zones belong to a frame: the ones scripts leave open are closed with it.
+
+void closeOpenZones()
+{
+    while (state.openZoneCount > 0)
+    {
+        state.openZoneCount--;
+        profileZone(state.openZones[state.openZoneCount].zone, state.openZones[state.openZoneCount].start);
+    }
+}
+
+sds catJsonString(sds s, const char *string)
+{
+    s = sdscat(s, "\"");
+
+    for (const char *c = string; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            s = sdscatprintf(s, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            s = sdscatprintf(s, "\\u%04x", *c);
+        else
+            s = sdscatlen(s, c, 1);
+    }
+
+    return sdscat(s, "\"");
+}
+
+// Builds a Chrome trace of the recorded zones, with timestamps in
+// microseconds since the profiler started.
+
+sds traceJson()
+{
+    sds trace = sdsnew("{\"traceEvents\":[");
+
+    for (int i = 0; i < state.zoneCount; i++)
+    {
+        ZoneEvent *event = &state.zoneEvents[(state.zoneHead - state.zoneCount + i + ZONE_EVENTS) % ZONE_EVENTS];
+
+        if (i > 0)
+            trace = sdscat(trace, ",");
+
+        trace = sdscat(trace, "{\"name\":");
+        trace = catJsonString(trace, state.zoneNames.data[event->zone]);
+        trace = sdscatprintf(trace, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+                             (event->start - state.profilerStart) * 1e6, event->duration * 1e6);
+    }
+
+    return sdscat(trace, "],\"displayTimeUnit\":\"ms\"}");
+}
+
+void freeProfiler()
+{
+    int i;
+    sds name;
+
+    vec_foreach(&state.zoneNames, name, i) {
+        sdsfree(name);
+    }
+
+    vec_deinit(&state.zoneNames);
+    map_deinit(&state.zoneIds);
+
+    free(state.zoneEvents);
+}
+
+// Natives keep the calls of the frame in progress and of the last one, next
+// to totals since the statistics were last reset.
+
+void endNativeFrame()
+{
+    if (!state.nativeStats)
+        return;
+
+    for (int i = 0; i < state.natives.length; i++)
+    {
+        state.natives.data[i].lastFrameCalls = state.natives.data[i].frameCalls;
+        state.natives.data[i].frameCalls = 0;
+    }
+
+    state.nativeStatFrames++;
+}
+
+void resetNativeStats()
+{
+    for (int i = 0; i < state.natives.length; i++)
+    {
+        Native *native = &state.natives.data[i];
+        native->calls = 0;
+        native->frameCalls = 0;
+        native->lastFrameCalls = 0;
+        native->time = 0;
+        native->handleLookups = 0;
+        native->stringArguments = 0;
+    }
+
+    state.nativeStatFrames = 0;
+}
+
+int compareNativeTimes(const void *a, const void *b)
+{
+    double timeA = state.natives.data[*(const int *)a].time;
+    double timeB = state.natives.data[*(const int *)b].time;
+
+    return (timeA < timeB) - (timeA > timeB);
+}
+
+// Each frame is measured phase by phase into state.profile, which is pushed
+// into the ring of past frames when the frame ends.
+
+void beginFrameProfile()
+{
+    memset(&state.profile, 0, sizeof(FrameProfile));
+    state.frameStart = monotonicTime();
+}
+
+void endFrameProfile()
+{
+    closeOpenZones();
+    profileZone(ZONE_FRAME, state.frameStart);
+
+    state.profile.frame = monotonicTime() - state.frameStart;
+
+    state.profiles[state.profileHead] = state.profile;
+    state.profileHead = (state.profileHead + 1) % PROFILE_FRAMES;
+
+    if (state.profileCount < PROFILE_FRAMES)
+        state.profileCount++;
+
+    endNativeFrame();
+}
+
+void profilePhase(ProfilePhase phase, double start)
+{
+    state.profile.phases[phase] += monotonicTime() - start;
+}
+
+// Returns the i-th frame of the ring, oldest first.
+
+FrameProfile *profileFrame(int i)
+{
+    return &state.profiles[(state.profileHead - state.profileCount + i + PROFILE_FRAMES) % PROFILE_FRAMES];
+}
+
+duk_ret_t nativeTrampoline(duk_context *ctx)
+{
+    Native *native = &state.natives.data[duk_get_current_magic(ctx)];
+
+    state.profile.nativeCalls++;
+
+    bool zoned = state.profiling && native->zone >= 0;
+
+    if (!zoned && !state.nativeStats)
+        return native->function(ctx);
+
+    int lookups = state.handleLookups;
+
+    if (state.nativeStats)
+    {
+        native->calls++;
+        native->frameCalls++;
+
+        for (duk_idx_t i = 0; i < duk_get_top(ctx); i++)
+        {
+            if (duk_is_string(ctx, i))
+                native->stringArguments++;
+        }
+    }
+
+    double start = monotonicTime();
+
+    duk_ret_t result = native->function(ctx);
+
+    if (state.nativeStats)
+    {
+        native->time += monotonicTime() - start;
+        native->handleLookups += state.handleLookups - lookups;
+    }
+
+    if (zoned)
+        profileZone(native->zone, start);
+
+    return result;
+}
+
+// Duktape.gc() goes through the engine, so the collections scripts ask for
+// are timed and counted too. The original is kept in the heap stash.
+
+duk_ret_t profiledGC(duk_context *ctx)
+{
+    duk_push_heap_stash(ctx);
+    duk_get_prop_string(ctx, -1, "gc");
+    duk_push_uint(ctx, duk_get_uint(ctx, 0) | (state.gcCompact ? DUK_GC_COMPACT : 0));
+
+    double start = monotonicTime();
+
+    duk_call(ctx, 1);
+
+    recordCollection(start);
+
+    return 1;
+}
+
+// Lists every C function of the turtle modules, so it has to run after all of
+// them are registered. The originals are kept in the heap stash for when the
+// trampolines come off again. The nargs of a function is read back from its
+// length.
+
+void collectNatives(duk_context *ctx)
+{
+    duk_push_heap_stash(ctx);
+    duk_push_array(ctx);
+    duk_get_global_string(ctx, "turtle");
+    duk_enum(ctx, -1, 0);
+
+    while (duk_next(ctx, -1, 1))
+    {
+        const char *module = duk_get_string(ctx, -2);
+
+        if (!duk_is_object(ctx, -1))
+        {
+            duk_pop_2(ctx);
+            continue;
+        }
+
+        duk_enum(ctx, -1, 0);
+
+        while (duk_next(ctx, -1, 1))
+        {
+            if (!duk_is_c_function(ctx, -1))
+            {
+                duk_pop_2(ctx);
+                continue;
+            }
+
+            Native native = {0};
+            native.function = duk_get_c_function(ctx, -1);
+            duk_get_prop_string(ctx, -1, "length");
+            native.nargs = duk_get_int(ctx, -1);
+            duk_pop(ctx);
+            native.module = sdsnew(module);
+            native.key = sdsnew(duk_get_string(ctx, -2));
+            native.name = sdscatprintf(sdsempty(), "%s.%s", module, native.key);
+            native.zone = strcmp(module, "profiler") == 0 ? -1 : internZone(native.name);
+
+            vec_push(&state.natives, native);
+
+            duk_put_prop_index(ctx, -8, state.natives.length - 1);
+            duk_pop(ctx);
+        }
+
+        duk_pop_3(ctx);
+    }
+
+    duk_pop_2(ctx);
+    duk_put_prop_string(ctx, -2, "natives");
+
+    duk_get_global_string(ctx, "Duktape");
+    duk_get_prop_string(ctx, -1, "gc");
+    duk_put_prop_string(ctx, -3, "gc");
+    duk_push_c_function(ctx, profiledGC, 1);
+    duk_put_prop_string(ctx, -2, "gc");
+    duk_pop_2(ctx);
+}
+
+// Installs the trampolines when the profiler or the native statistics come
+// on, and puts the originals back once both are off. Functions a script kept
+// before that still call the originals and are not counted, so --profile
+// installs them at startup for good. Calls that throw are counted but leave
+// no zone, and the profiler functions get no zones of their own.
+
+void updateTrampolines(duk_context *ctx)
+{
+    bool wrapped = state.profileNatives || state.profiling || state.nativeStats;
+
+    if (wrapped == state.trampolines)
+        return;
+
+    state.trampolines = wrapped;
+
+    duk_push_heap_stash(ctx);
+    duk_get_prop_string(ctx, -1, "natives");
+    duk_get_global_string(ctx, "turtle");
+
+    for (int i = 0; i < state.natives.length; i++)
+    {
+        Native *native = &state.natives.data[i];
+
+        duk_get_prop_string(ctx, -1, native->module);
+
+        if (wrapped)
+        {
+            duk_push_c_function(ctx, nativeTrampoline, native->nargs);
+            duk_set_magic(ctx, -1, i);
+        }
+        else
+        {
+            duk_get_prop_index(ctx, -3, i);
+        }
+
+        duk_put_prop_string(ctx, -2, native->key);
+        duk_pop(ctx);
+    }
+
+    duk_pop_3(ctx);
+}
+
+void freeNatives()
+{
+    int i;
+    Native native;
+
+    vec_foreach(&state.natives, native, i)
+    {
+        sdsfree(native.module);
+        sdsfree(native.key);
+        sdsfree(native.name);
+    }
+
+    vec_deinit(&state.natives);
+}
+
+// The overlay stacks the phases of every frame in the ring into a column,
+// with a line at the frame time of 60 FPS. Averages are in milliseconds.
+
+void drawProfileOverlay()
+{
+    static const Color colors[PHASE_COUNT] = {PURPLE, BLUE, GREEN, ORANGE, GRAY, RED};
+
+    int x = 10;
+    int y = 10;
+    int width = PROFILE_FRAMES * 2;
+    int height = 120;
+    double scale = height / (2 / 60.0);
+
+    DrawRectangle(x, y, width, height + 44, Fade(BLACK, 0.6f));
+
+    double averages[PHASE_COUNT] = {0};
+    double average = 0;
+
+    for (int i = 0; i < state.profileCount; i++)
+    {
+        FrameProfile *frame = profileFrame(i);
+        int bottom = y + height;
+
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            int size = (int)(frame->phases[phase] * scale + 0.5);
+
+            if (bottom - size < y)
+                size = bottom - y;
+
+            DrawRectangle(x + i * 2, bottom - size, 2, size, colors[phase]);
+            bottom -= size;
+
+            averages[phase] += frame->phases[phase] / state.profileCount;
+        }
+
+        average += frame->frame / state.profileCount;
+    }
+
+    DrawLine(x, y + height / 2, x + width, y + height / 2, WHITE);
+
+    DrawText(TextFormat("frame %.2f ms", average * 1000), x + 4, y + height + 4, 10, WHITE);
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        DrawText(TextFormat("%s %.2f", phaseNames[phase], averages[phase] * 1000), x + 4 + (phase % 3) * 100, y + height + 16 + (phase / 3) * 12, 10, colors[phase]);
+    }
+}
+
+// VIRTUAL FILESYSTEM
+
+bool mountPack(const char *path)
+{
+    int descriptor = open(path, O_RDONLY);
+
+    if (descriptor < 0)
+        return false;
+
+    struct stat info;
+
+    if (fstat(descriptor, &info) != 0 || (size_t)info.st_size < sizeof(PackHeader))
+    {
+        close(descriptor);
+        return false;
+    }
+
+    unsigned char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+    close(descriptor);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    PackHeader header;
+    memcpy(&header, data, sizeof(PackHeader));
+
+    size_t size = info.st_size;
+    size_t index = sizeof(PackHeader) + (size_t)header.count * sizeof(PackEntry);
+    bool valid = memcmp(header.magic, PACK_MAGIC, 8) == 0 && header.version == PACK_VERSION && index <= size;
+
+    PackEntry *entries = (PackEntry *)(data + sizeof(PackHeader));
+
+    for (uint32_t i = 0; valid && i < header.count; i++)
+    {
+        valid = index + entries[i].name + entries[i].nameLength <= size &&
+                entries[i].offset <= size && entries[i].size <= size - entries[i].offset;
+    }
+
+    if (!valid)
+    {
+        munmap(data, size);
+        return false;
+    }
+
+    state.pack.data = data;
+    state.pack.size = size;
+    state.pack.count = header.count;
+    state.pack.entries = entries;
+    state.pack.names = (const char *)data + index;
+
+    return true;
+}
+
+void unmountPack()
+{
+    if (state.pack.data != NULL)
+        munmap(state.pack.data, state.pack.size);
+
+    state.pack.data = NULL;
+}
+
+// Returns the name of a path inside the mounted pack, or NULL if there is no
+// pack or the path is outside of it.
+
+const char *packName(const char *path)
+{
+    if (state.pack.data == NULL)
+        return NULL;
+
+    size_t length = strlen(state.baseDir);
+
+    if (strncmp(path, state.baseDir, length) != 0)
+        return NULL;
+
+    if (path[length] == '\0')
+        return path + length;
+
+    if (path[length] != '/')
+        return NULL;
+
+    return path + length + 1;
+}
+
+int comparePackName(const PackEntry *entry, const char *name, size_t length)
+{
+    size_t shortest = entry->nameLength < length ? entry->nameLength : length;
+    int order = memcmp(state.pack.names + entry->name, name, shortest);
+
+    if (order != 0)
+        return order;
+
+    return (entry->nameLength > length) - (entry->nameLength < length);
+}
+
+// Returns the index of the first entry not ordered before name.
+
+uint32_t packLowerBound(const char *name, size_t length)
+{
+    uint32_t low = 0;
+    uint32_t high = state.pack.count;
+
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (comparePackName(&state.pack.entries[middle], name, length) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+PackEntry *findPackEntry(const char *name)
+{
+    size_t length = strlen(name);
+    uint32_t i = packLowerBound(name, length);
+
+    if (i < state.pack.count && comparePackName(&state.pack.entries[i], name, length) == 0)
+        return &state.pack.entries[i];
+
+    return NULL;
+}
+
+VfsFile vfsLoad(const char *path)
+{
+    VfsFile file = {NULL, 0, false};
+    const char *name = packName(path);
+
+    if (name != NULL)
+    {
+        PackEntry *entry = findPackEntry(name);
+
+        if (entry != NULL)
+        {
+            file.data = state.pack.data + entry->offset;
+            file.size = entry->size;
+            file.mapped = true;
+        }
+
+        return file;
+    }
+
+    file.data = LoadFileData(path, &file.size);
+
+    return file;
+}
+
+void vfsUnload(VfsFile file)
+{
+    if (!file.mapped && file.data != NULL)
+        UnloadFileData(file.data);
+}
+
+bool vfsExists(const char *path)
+{
+    const char *name = packName(path);
+
+    if (name != NULL)
+        return findPackEntry(name) != NULL;
+
+    return FileExists(path);
+}
+
+bool vfsDirectoryExists(const char *path)
+{
+    const char *name = packName(path);
+
+    if (name == NULL)
+        return DirectoryExists(path);
+
+    if (name[0] == '\0')
+        return true;
+
+    sds prefix = sdscatprintf(sdsempty(), "%s/", name);
+    uint32_t i = packLowerBound(prefix, sdslen(prefix));
+
+    bool found = i < state.pack.count && state.pack.entries[i].nameLength >= sdslen(prefix) &&
+                 memcmp(state.pack.names + state.pack.entries[i].name, prefix, sdslen(prefix)) == 0;
+
+    sdsfree(prefix);
+
+    return found;
+}
+
+int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds the names of the entries directly inside a directory to files, leaving
+// out subdirectories unless directories is set.
+
+bool vfsDirectoryFiles(const char *path, vec_str_t *files, bool directories)
+{
+    const char *name = packName(path);
+
+    if (name == NULL)
+    {
+        if (!DirectoryExists(path))
+            return false;
+
+        int count = 0;
+        char **entries = GetDirectoryFiles(path, &count);
+
+        for (int i = 0; i < count; i++)
+        {
+            if (strcmp(entries[i], ".") == 0 || strcmp(entries[i], "..") == 0)
+                continue;
+
+            sds entry = sdscatprintf(sdsempty(), "%s/%s", path, entries[i]);
+
+            if (directories || !DirectoryExists(entry))
+                vec_push(files, sdsnew(entries[i]));
+
+            sdsfree(entry);
+        }
+
+        ClearDirectoryFiles();
+
+        return true;
+    }
+
+    if (!vfsDirectoryExists(path))
+        return false;
+
+    // Entries are sorted, so the files of a subdirectory follow each other.
+
+    sds prefix = name[0] != '\0' ? sdscatprintf(sdsempty(), "%s/", name) : sdsempty();
+    int first = files->length;
+
+    for (uint32_t i = packLowerBound(prefix, sdslen(prefix)); i < state.pack.count; i++)
+    {
+        PackEntry *entry = &state.pack.entries[i];
+        const char *entryName = state.pack.names + entry->name;
+
+        if (entry->nameLength < sdslen(prefix) || memcmp(entryName, prefix, sdslen(prefix)) != 0)
+            break;
+
+        const char *child = entryName + sdslen(prefix);
+        size_t length = entry->nameLength - sdslen(prefix);
+        const char *slash = memchr(child, '/', length);
+
+        if (slash == NULL)
+        {
+            vec_push(files, sdsnewlen(child, length));
+        }
+        else if (directories)
+        {
+            length = slash - child;
+
+            sds last = files->length > first ? files->data[files->length - 1] : NULL;
+
+            if (last == NULL || sdslen(last) != length || memcmp(last, child, length) != 0)
+                vec_push(files, sdsnewlen(child, length));
+        }
+    }
+
+    sdsfree(prefix);
+
+    return true;
+}
+
+// Returns a copy of a file, allocated like LoadFileData does.
+
+unsigned char *vfsRead(const char *path, unsigned int *size)
+{
+    VfsFile file = vfsLoad(path);
+
+    *size = file.size;
+
+    if (!file.mapped)
+        return file.data;
+
+    unsigned char *copy = MemAlloc(file.size > 0 ? file.size : 1);
+    memcpy(copy, file.data, file.size);
+
+    return copy;
+}
+
+// Maps a file copy-on-write, so scripts can change the mapping without
+// changing the file. Files in a pack are mapped from the pack itself.
+
+bool vfsMap(const char *path, unsigned char **data, size_t *size, void **mapping, size_t *mappingSize)
+{
+    const char *file = path;
+    uint64_t offset = 0;
+    const char *name = packName(path);
+
+    if (name != NULL)
+    {
+        PackEntry *entry = findPackEntry(name);
+
+        if (entry == NULL)
+            return false;
+
+        file = state.baseDir;
+        offset = entry->offset;
+        *size = entry->size;
+    }
+
+    int descriptor = open(file, O_RDONLY);
+
+    if (descriptor < 0)
+        return false;
+
+    struct stat info;
+
+    if (name == NULL)
+    {
+        if (fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            close(descriptor);
+            return false;
+        }
+
+        *size = info.st_size;
+    }
+
+    uint64_t start = offset - offset % sysconf(_SC_PAGESIZE);
+
+    *mappingSize = *size + (offset - start);
+    *mapping = NULL;
+    *data = NULL;
+
+    if (*mappingSize > 0)
+    {
+        *mapping = mmap(NULL, *mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, start);
+
+        if (*mapping == MAP_FAILED)
+        {
+            close(descriptor);
+            return false;
+        }
+
+        *data = (unsigned char *)*mapping + (offset - start);
+    }
+
+    close(descriptor);
+
+    return true;
+}
+
+Image vfsLoadImage(const char *path)
+{
+    Image image = {0};
+    VfsFile file = vfsLoad(path);
+
+    if (file.data != NULL)
+        image = LoadImageFromMemory(GetFileExtension(path), file.data, file.size);
+
+    vfsUnload(file);
+
+    return image;
+}
+
+Wave vfsLoadWave(const char *path)
+{
+    Wave wave = {0};
+    VfsFile file = vfsLoad(path);
+
+    if (file.data != NULL)
+        wave = LoadWaveFromMemory(GetFileExtension(path), file.data, file.size);
+
+    vfsUnload(file);
+
+    return wave;
+}
+
+Texture2D vfsLoadTexture(const char *path)
+{
+    Image image = vfsLoadImage(path);
+    Texture2D texture = LoadTextureFromImage(image);
+
+    UnloadImage(image);
+
+    return texture;
+}
+
+Sound vfsLoadSound(const char *path)
+{
+    Wave wave = vfsLoadWave(path);
+    Sound sound = LoadSoundFromWave(wave);
+
+    UnloadWave(wave);
+
+    return sound;
+}
+
+// Loads fonts the way LoadFont does: TrueType and OpenType fonts at 32 pixels
+// with the ASCII glyphs, images as XNA style fonts keyed on magenta. Bitmap
+// fonts read their page images by path, so they only load from the disk.
+
+Font vfsLoadFont(const char *path)
+{
+    Font font = {0};
+
+    if (IsFileExtension(path, ".ttf;.otf"))
+    {
+        VfsFile file = vfsLoad(path);
+
+        if (file.data != NULL)
+            font = LoadFontFromMemory(GetFileExtension(path), file.data, file.size, 32, NULL, 95);
+
+        vfsUnload(file);
+    }
+    else if (IsFileExtension(path, ".fnt"))
+    {
+        font = LoadFont(path);
+    }
+    else
+    {
+        Image image = vfsLoadImage(path);
+
+        if (image.data != NULL)
+            font = LoadFontFromImage(image, MAGENTA, 32);
+
+        UnloadImage(image);
+    }
+
+    if (font.texture.id == 0)
+        font = GetFontDefault();
+
+    return font;
+}
+
+// Creates a directory and all its missing parents.
+
+bool makeDirectories(const char *path)
+{
+    sds partial = sdsnew(path);
+
+    for (char *c = partial + 1; ; c++)
+    {
+        if (*c != '/' && *c != '\0')
+            continue;
+
+        char end = *c;
+        *c = '\0';
+
+        if (mkdir(partial, 0755) != 0 && errno != EEXIST)
+        {
+            sdsfree(partial);
+            return false;
+        }
+
+        *c = end;
+
+        if (end == '\0')
+            break;
+    }
+
+    sdsfree(partial);
+
+    return true;
+}
+
+// Syncs the directory holding path, so a rename in it survives a crash.
+
+void syncDirectory(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    sds directory = slash == NULL ? sdsnew(".") : slash == path ? sdsnew("/") : sdsnewlen(path, slash - path);
+    int descriptor = open(directory, O_RDONLY | O_DIRECTORY);
+
+    if (descriptor >= 0)
+    {
+        fsync(descriptor);
+        close(descriptor);
+    }
+
+    sdsfree(directory);
+}
+
+// Writes to a temporary file first, so a crash never leaves half a file. The
+// data reaches the disk before the rename, and the rename before returning.
+// The file worker writes too, so every write gets its own temporary file.
+
+bool writeFileAtomic(const char *path, const void *data, size_t size)
+{
+    static int writes = 0;
+
+    int write = __atomic_fetch_add(&writes, 1, __ATOMIC_RELAXED);
+    sds temporary = sdscatprintf(sdsempty(), "%s.%d.%d.tmp", path, (int)getpid(), write);
+    FILE *file = fopen(temporary, "wb");
+    bool written = false;
+
+    if (file != NULL)
+    {
+        written = fwrite(data, 1, size, file) == size && fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+        if (fclose(file) == 0 && written)
+            written = rename(temporary, path) == 0;
+        else
+            written = false;
+
+        if (written)
+            syncDirectory(path);
+        else
+            remove(temporary);
+    }
+
+    sdsfree(temporary);
+
+    return written;
+}
+
+// Writes a file atomically, creating the directories it goes in.
+
+bool vfsWrite(const char *path, const void *data, size_t size)
+{
+    if (packName(path) != NULL)
+        return false;
+
+    const char *slash = strrchr(path, '/');
+
+    if (slash != NULL && slash != path)
+    {
+        sds directory = sdsnewlen(path, slash - path);
+        bool created = makeDirectories(directory);
+
+        sdsfree(directory);
+
+        if (!created)
+            return false;
+    }
+
+    return writeFileAtomic(path, data, size);
+}
+
+// ASSET CACHE
+
+// Every load of a cached file returns the same handle and takes a reference.
+// Releasing a handle drops a reference and the resource is only unloaded with
+// the last one. state.cacheKeys maps "type:handle" back to the cache key.
+// Async loads in content mode hash the file on the loader thread instead, so a
+// hit gets its own handle that aliases the cached resource.
+
+const char *assetTypeName(AssetType type)
+{
+    switch (type)
+    {
+    case ASSET_IMAGE:
+        return "image";
+    case ASSET_SOUND:
+        return "sound";
+    case ASSET_FONT:
+        return "font";
+    }
+
+    return "asset";
+}
+
+// FNV-1a
+
+uint64_t hashBytes(const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+sds contentKey(AssetType type, const void *data, size_t length)
+{
+    return sdscatprintf(sdsempty(), "%s#%016llx", assetTypeName(type), (unsigned long long)hashBytes(data, length));
+}
+
+// Returns the cache key of a file, or NULL when caching is off or the file
+// can not be read.
+
+sds cacheKey(AssetType type, const char *path)
+{
+    if (state.cacheMode == CACHE_NONE)
+        return NULL;
+
+    sds key = sdsempty();
+
+    if (state.cacheMode == CACHE_PATH)
+        return sdscatprintf(key, "%s:%s", assetTypeName(type), path);
+
+    sdsfree(key);
+
+    VfsFile file = vfsLoad(path);
+
+    if (file.data == NULL)
+        return NULL;
+
+    key = contentKey(type, file.data, file.size);
+
+    vfsUnload(file);
+
+    return key;
+}
+
+sds cacheHandleKey(AssetType type, Handle handle)
+{
+    sds key = sdsempty();
+
+    return sdscatprintf(key, "%s:%llu", assetTypeName(type), (unsigned long long)handle);
+}
+
+bool cacheLookup(const char *key, Handle *handle)
+{
+    CacheEntry *entry = map_get(&state.cache, key);
+
+    if (entry == NULL)
+    {
+        state.cacheMisses++;
+        return false;
+    }
+
+    state.cacheHits++;
+    entry->references++;
+    *handle = entry->handle;
+
+    return true;
+}
+
+void cacheInsert(AssetType type, const char *key, Handle handle, int bytes)
+{
+    CacheEntry entry;
+    entry.handle = handle;
+    entry.references = 1;
+    entry.bytes = bytes;
+
+    map_set(&state.cache, key, entry);
+
+    CacheHandle cached = {sdsnew(key), type, handle};
+
+    sds handleKey = cacheHandleKey(type, handle);
+    map_set(&state.cacheKeys, handleKey, cached);
+    sdsfree(handleKey);
+}
+
+CacheEntry *cacheFind(AssetType type, Handle handle)
+{
+    sds handleKey = cacheHandleKey(type, handle);
+    CacheHandle *cached = map_get(&state.cacheKeys, handleKey);
+    sdsfree(handleKey);
+
+    if (cached == NULL)
+        return NULL;
+
+    return map_get(&state.cache, cached->key);
+}
+
+// Content-cached resources may be shared with aliases of other handles.
+
+bool cacheShared(AssetType type, Handle handle)
+{
+    sds handleKey = cacheHandleKey(type, handle);
+    CacheHandle *cached = map_get(&state.cacheKeys, handleKey);
+    sdsfree(handleKey);
+
+    return cached != NULL && strchr(cached->key, '#') != NULL;
+}
+
+void cacheForget(AssetType type, Handle handle)
+{
+    sds handleKey = cacheHandleKey(type, handle);
+    CacheHandle *cached = map_get(&state.cacheKeys, handleKey);
+
+    if (cached != NULL)
+    {
+        map_remove(&state.cache, cached->key);
+        sdsfree(cached->key);
+        map_remove(&state.cacheKeys, handleKey);
+    }
+
+    sdsfree(handleKey);
+}
+
+// Makes handle an alias of the resource cached under key.
+
+void cacheAlias(AssetType type, const char *key, Handle handle)
+{
+    CacheHandle cached = {sdsnew(key), type, handle};
+
+    sds handleKey = cacheHandleKey(type, handle);
+    map_set(&state.cacheKeys, handleKey, cached);
+    sdsfree(handleKey);
+}
+
+// Drops a reference. Returns RELEASE_UNLOAD when the resource should be
+// unloaded, because it was not cached or this was its last reference. An
+// alias always goes away: with RELEASE_REMOVE while the cached handle still
+// uses the resource, or with RELEASE_UNLOAD and *cached set to the cached
+// handle, which goes away too. RELEASE_KEEP leaves a shared handle alone.
+
+CacheRelease cacheRelease(AssetType type, Handle handle, Handle *cached)
+{
+    *cached = 0;
+
+    CacheEntry *entry = cacheFind(type, handle);
+
+    if (entry == NULL)
+        return RELEASE_UNLOAD;
+
+    Handle owner = entry->handle;
+    bool last = --entry->references == 0;
+
+    if (owner != handle)
+    {
+        sds handleKey = cacheHandleKey(type, handle);
+        sdsfree(map_get(&state.cacheKeys, handleKey)->key);
+        map_remove(&state.cacheKeys, handleKey);
+        sdsfree(handleKey);
+
+        if (!last)
+            return RELEASE_REMOVE;
+
+        *cached = owner;
+    }
+    else if (!last)
+    {
+        return RELEASE_KEEP;
+    }
+
+    cacheForget(type, owner);
+
+    return RELEASE_UNLOAD;
+}
+
+// Aliases share the resource of their cached handle, so they are removed
+// without unloading before everything left is released at exit.
+
+void removeCacheAliases()
+{
+    const char *handleKey;
+    map_iter_t iter = map_iter(&state.cacheKeys);
+
+    while ((handleKey = map_next(&state.cacheKeys, &iter)))
+    {
+        CacheHandle *cached = map_get(&state.cacheKeys, handleKey);
+        CacheEntry *entry = map_get(&state.cache, cached->key);
+
+        if (entry == NULL || entry->handle == cached->handle)
+            continue;
+
+        if (cached->type == ASSET_IMAGE)
+            pool_remove(&state.images, cached->handle);
+        else if (cached->type == ASSET_SOUND)
+            pool_remove(&state.sounds, cached->handle);
+    }
+}
+
+void freeCache()
+{
+    const char *handleKey;
+    map_iter_t iter = map_iter(&state.cacheKeys);
+
+    removeCacheAliases();
+
+    while ((handleKey = map_next(&state.cacheKeys, &iter)))
+        sdsfree(map_get(&state.cacheKeys, handleKey)->key);
+
+    map_deinit(&state.cacheKeys);
+    map_deinit(&state.cache);
+
+    map_init(&state.cacheKeys);
+    map_init(&state.cache);
+}
+
+int textureBytes(Texture2D texture)
+{
+    return GetPixelDataSize(texture.width, texture.height, texture.format);
+}
+
+int soundBytes(Sound sound)
+{
+    return sound.frameCount * sound.stream.channels * sound.stream.sampleSize / 8;
+}
+
+int fontBytes(Font font)
+{
+    return textureBytes(font.texture) + font.glyphCount * (sizeof(GlyphInfo) + sizeof(Rectangle));
+}
+
+void watchAsset(AssetType type, Handle handle, const char *path)
+{
+    if (state.watcher < 0)
+        return;
+
+    watched_asset_vec_t *assets = map_get(&state.watchedAssets, path);
+
+    if (assets == NULL)
+    {
+        watched_asset_vec_t empty;
+        vec_init(&empty);
+        map_set(&state.watchedAssets, path, empty);
+        assets = map_get(&state.watchedAssets, path);
+    }
+
+    WatchedAsset asset = {type, handle};
+    vec_push(assets, asset);
+}
+
+// ASSET LOADING
+
+// Only decoding happens on the workers. Uploads are limited to
+// state.uploadBudget bytes per frame, but at least one asset is uploaded every
+// frame so a large image cannot stall the queue. Completion callbacks are kept
+// in the heap stash under their job id and called after the upload.
+
+void *assetWorker(void *data)
+{
+    AssetLoader *loader = data;
+
+    while (true)
+    {
+        pthread_mutex_lock(&loader->lock);
+
+        while (loader->running && loader->queued.length == 0)
+            pthread_cond_wait(&loader->wake, &loader->lock);
+
+        if (!loader->running)
+        {
+            pthread_mutex_unlock(&loader->lock);
+            break;
+        }
+
+        AssetJob *job = loader->queued.data[0];
+        vec_splice(&loader->queued, 0, 1);
+
+        pthread_mutex_unlock(&loader->lock);
+
+        // The file is read once for both its content key and its decode.
+
+        VfsFile file = vfsLoad(job->path);
+
+        if (file.data != NULL)
+        {
+            if (job->keyed)
+                job->key = contentKey(job->type, file.data, file.size);
+
+            if (job->type == ASSET_IMAGE)
+                job->image = LoadImageFromMemory(GetFileExtension(job->path), file.data, file.size);
+            else
+                job->wave = LoadWaveFromMemory(GetFileExtension(job->path), file.data, file.size);
+        }
+
+        vfsUnload(file);
+
+        pthread_mutex_lock(&loader->lock);
+        vec_push(&loader->decoded, job);
+        pthread_mutex_unlock(&loader->lock);
+    }
+
+    return NULL;
+}
+
+void startAssetLoader()
+{
+    AssetLoader *loader = &state.loader;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 1 ? cores - 1 : 1;
+
+    if (workers > ASSET_WORKERS_MAX)
+        workers = ASSET_WORKERS_MAX;
+
+    loader->running = true;
+    loader->threadCount = 0;
+    vec_init(&loader->queued);
+    vec_init(&loader->decoded);
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->wake, NULL);
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&loader->threads[loader->threadCount], NULL, assetWorker, loader) == 0)
+            loader->threadCount++;
+    }
+
+    state.loaderStarted = true;
+}
+
+void freeAssetJob(AssetJob *job)
+{
+    if (job->type == ASSET_IMAGE)
+        UnloadImage(job->image);
+    else
+        UnloadWave(job->wave);
+
+    vec_deinit(&job->callbacks);
+    sdsfree(job->path);
+    sdsfree(job->key);
+    free(job);
+}
+
+void stopAssetLoader()
+{
+    AssetLoader *loader = &state.loader;
+
+    if (!state.loaderStarted)
+        return;
+
+    pthread_mutex_lock(&loader->lock);
+    loader->running = false;
+    pthread_cond_broadcast(&loader->wake);
+    pthread_mutex_unlock(&loader->lock);
+
+    for (int i = 0; i < loader->threadCount; i++)
+        pthread_join(loader->threads[i], NULL);
+
+    int i;
+    AssetJob *job;
+
+    vec_foreach(&state.loading, job, i) {
+        freeAssetJob(job);
+    }
+
+    vec_clear(&state.loading);
+
+    vec_deinit(&loader->queued);
+    vec_deinit(&loader->decoded);
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->wake);
+
+    state.loaderStarted = false;
+}
+
+AssetJob *findAssetJob(AssetType type, Handle handle)
+{
+    int i;
+    AssetJob *job;
+
+    vec_foreach(&state.loading, job, i) {
+        if (job->type == type && job->handle == handle && !job->cached)
+            return job;
+    }
+
+    return NULL;
+}
+
+bool isAssetLoading(AssetType type, Handle handle)
+{
+    return findAssetJob(type, handle) != NULL;
+}
+
+// Keeps the function at callbackIdx in the heap stash and returns its id.
+
+int stashCallback(duk_context *ctx, duk_idx_t callbackIdx)
+{
+    int id = state.nextCallbackId++;
+
+    duk_push_heap_stash(ctx);
+
+    if (!duk_get_prop_string(ctx, -1, "assetCallbacks"))
+    {
+        duk_pop(ctx);
+        duk_push_object(ctx);
+        duk_dup_top(ctx);
+        duk_put_prop_string(ctx, -3, "assetCallbacks");
+    }
+
+    duk_dup(ctx, callbackIdx);
+    duk_put_prop_index(ctx, -2, id);
+    duk_pop_2(ctx);
+
+    return id;
+}
+
+// Pushes the stash, the callbacks object and the callback stored under id,
+// which is removed from the stash.
+
+void pushStashedCallback(duk_context *ctx, int id)
+{
+    duk_push_heap_stash(ctx);
+    duk_get_prop_string(ctx, -1, "assetCallbacks");
+    duk_get_prop_index(ctx, -1, id);
+    duk_del_prop_index(ctx, -2, id);
+}
+
+// Stores the function at callbackIdx, if it is one, for job.
+
+void addAssetCallback(duk_context *ctx, AssetJob *job, duk_idx_t callbackIdx)
+{
+    if (!duk_is_function(ctx, callbackIdx))
+        return;
+
+    vec_push(&job->callbacks, stashCallback(ctx, callbackIdx));
+}
+
+// Queues a decode of path into the resource behind handle. When path is NULL
+// the handle came from the cache: its callback joins the job still loading
+// it, or is called at the next upload if it has finished.
+
+void queueAsset(duk_context *ctx, AssetType type, Handle handle, const char *path, duk_idx_t callbackIdx)
+{
+    if (!state.loaderStarted)
+        startAssetLoader();
+
+    if (state.loader.threadCount == 0)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not start asset loader.");
+        duk_throw(ctx);
+    }
+
+    AssetJob *pending = findAssetJob(type, handle);
+
+    if (path == NULL && pending != NULL)
+    {
+        addAssetCallback(ctx, pending, callbackIdx);
+        return;
+    }
+
+    if (path == NULL && !duk_is_function(ctx, callbackIdx))
+        return;
+
+    AssetJob *job = calloc(1, sizeof(AssetJob));
+
+    job->type = type;
+    job->handle = handle;
+    job->cached = path == NULL;
+    job->keyed = path != NULL && state.cacheMode == CACHE_CONTENT;
+    job->path = path != NULL ? sdsnew(path) : NULL;
+    vec_init(&job->callbacks);
+
+    addAssetCallback(ctx, job, callbackIdx);
+
+    vec_push(&state.loading, job);
+
+    pthread_mutex_lock(&state.loader.lock);
+
+    if (job->cached)
+    {
+        vec_push(&state.loader.decoded, job);
+    }
+    else
+    {
+        vec_push(&state.loader.queued, job);
+        pthread_cond_signal(&state.loader.wake);
+    }
+
+    pthread_mutex_unlock(&state.loader.lock);
+}
+
+int assetSize(AssetJob *job)
+{
+    if (job->type == ASSET_IMAGE)
+        return GetPixelDataSize(job->image.width, job->image.height, job->image.format);
+
+    return job->wave.frameCount * job->wave.channels * job->wave.sampleSize / 8;
+}
+
+// Uploads a decoded job. A failed decode releases the handle and passes the
+// error to the callback instead, and so does a handle that was released while
+// its job was in flight.
+
+void finishAsset(duk_context *ctx, AssetJob *job)
+{
+    const char *failure = NULL;
+    Handle cached;
+
+    if (job->cached)
+    {
+        // Nothing to upload.
+        bool alive = job->type == ASSET_IMAGE ? pool_get(&state.images, job->handle) != NULL : pool_get(&state.sounds, job->handle) != NULL;
+
+        if (!alive)
+            failure = "Released before the load finished.";
+    }
+    else if (job->type == ASSET_IMAGE)
+    {
+        TextureRegion *image = pool_get(&state.images, job->handle);
+
+        if (image == NULL)
+        {
+            failure = "Released before the load finished.";
+        }
+        else if (job->image.data == NULL)
+        {
+            failure = "Could not decode image.";
+            cacheForget(ASSET_IMAGE, job->handle);
+            pool_remove(&state.images, job->handle);
+        }
+        else if (job->key != NULL && cacheLookup(job->key, &cached))
+        {
+            *image = *(TextureRegion *)pool_get(&state.images, cached);
+            cacheAlias(ASSET_IMAGE, job->key, job->handle);
+        }
+        else if (job->key != NULL)
+        {
+            if (!state.headless)
+                *image = textureRegion(LoadTextureFromImage(job->image));
+
+            cacheInsert(ASSET_IMAGE, job->key, job->handle, textureBytes(image->texture));
+        }
+        else if (!state.headless)
+        {
+            *image = textureRegion(LoadTextureFromImage(job->image));
+
+            CacheEntry *entry = cacheFind(ASSET_IMAGE, job->handle);
+
+            if (entry != NULL)
+                entry->bytes = textureBytes(image->texture);
+        }
+    }
+    else
+    {
+        Sound *sound = pool_get(&state.sounds, job->handle);
+
+        if (sound == NULL)
+        {
+            failure = "Released before the load finished.";
+        }
+        else if (job->wave.data == NULL)
+        {
+            failure = "Could not decode sound.";
+            cacheForget(ASSET_SOUND, job->handle);
+            pool_remove(&state.sounds, job->handle);
+        }
+        else if (job->key != NULL && cacheLookup(job->key, &cached))
+        {
+            *sound = *(Sound *)pool_get(&state.sounds, cached);
+            cacheAlias(ASSET_SOUND, job->key, job->handle);
+        }
+        else if (job->key != NULL)
+        {
+            if (!state.headless)
+                *sound = LoadSoundFromWave(job->wave);
+
+            cacheInsert(ASSET_SOUND, job->key, job->handle, soundBytes(*sound));
+        }
+        else if (!state.headless)
+        {
+            *sound = LoadSoundFromWave(job->wave);
+
+            CacheEntry *entry = cacheFind(ASSET_SOUND, job->handle);
+
+            if (entry != NULL)
+                entry->bytes = soundBytes(*sound);
+        }
+    }
+
+    vec_remove(&state.loading, job);
+
+    int i;
+    int id;
+
+    // Once a callback threw the game stops, so the callbacks after it are
+    // dropped and the first error is the one shown.
+
+    vec_foreach(&job->callbacks, id, i) {
+        pushStashedCallback(ctx, id);
+
+        if (state.error)
+        {
+            duk_pop_3(ctx);
+            continue;
+        }
+
+        pushHandle(ctx, job->handle);
+
+        if (failure != NULL)
+            duk_push_string(ctx, failure);
+        else
+            duk_push_undefined(ctx);
+
+        if (duk_pcall(ctx, 2) != DUK_EXEC_SUCCESS)
+        {
+            error(ctx);
+            duk_pop(ctx);
+        }
+
+        duk_pop_3(ctx);
+    }
+
+    freeAssetJob(job);
+}
+
+void uploadAssets(duk_context *ctx)
+{
+    if (!state.loaderStarted)
+        return;
+
+    int uploaded = 0;
+
+    while (true)
+    {
+        AssetJob *job = NULL;
+
+        pthread_mutex_lock(&state.loader.lock);
+
+        if (state.loader.decoded.length > 0)
+        {
+            int size = assetSize(state.loader.decoded.data[0]);
+
+            if (uploaded == 0 || uploaded + size <= state.uploadBudget)
+            {
+                job = state.loader.decoded.data[0];
+                vec_splice(&state.loader.decoded, 0, 1);
+                uploaded += size;
+            }
+        }
+
+        pthread_mutex_unlock(&state.loader.lock);
+
+        if (job == NULL)
+            break;
+
+        finishAsset(ctx, job);
+    }
+}
+
+// AUDIO MODULE
+
+duk_ret_t audioNewSource(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    sds path = sdsempty();
+    path = sdscatprintf(path, "%s/%s", state.baseDir, filename);
+
+    if (!vfsExists(path))
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "File does not exist.");
+        duk_throw(ctx);
+    }
+
+    Handle soundId;
+    sds key = cacheKey(ASSET_SOUND, path);
+
+    if (key != NULL && cacheLookup(key, &soundId))
+    {
+        sdsfree(key);
+        sdsfree(path);
+        pushHandle(ctx, soundId);
+        return 1;
+    }
+
+    Sound sound = {0};
+
+    if (!state.headless)
+        sound = vfsLoadSound(path);
+
+    soundId = pool_add(&state.sounds, sound);
+    trackHandle(ctx, HANDLE_SOURCE, soundId);
+    watchAsset(ASSET_SOUND, soundId, path);
+
+    sdsfree(path);
+
+    if (key != NULL)
+    {
+        cacheInsert(ASSET_SOUND, key, soundId, soundBytes(sound));
+        sdsfree(key);
+    }
+
+    pushHandle(ctx, soundId);
+
+    return 1;
+}
+
+// REFACTORED
+
+duk_ret_t audioNewSourceAsync(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    sds path = sdsempty();
+    path = sdscatprintf(path, "%s/%s", state.baseDir, filename);
+
+    if (!vfsExists(path))
+    {
+        sdsfree(path);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "File does not exist.");
+        duk_throw(ctx);
+    }
+
+    // In content mode the worker computes the key while it reads the file.
+
+    Handle soundId;
+    sds key = state.cacheMode == CACHE_CONTENT ? NULL : cacheKey(ASSET_SOUND, path);
+
+    if (key != NULL && cacheLookup(key, &soundId))
+    {
+        queueAsset(ctx, ASSET_SOUND, soundId, NULL, 1);
+    }
+    else
+    {
+        Sound sound = {0};
+
+        soundId = pool_add(&state.sounds, sound);
+        trackHandle(ctx, HANDLE_SOURCE, soundId);
+        watchAsset(ASSET_SOUND, soundId, path);
+
+        if (key != NULL)
+            cacheInsert(ASSET_SOUND, key, soundId, 0);
+
+        queueAsset(ctx, ASSET_SOUND, soundId, path, 1);
+    }
+
+    sdsfree(key);
+    sdsfree(path);
+
+    pushHandle(ctx, soundId);
+
+    return 1;
+}
+
+duk_ret_t audioIsLoaded(duk_context *ctx)
+{
+    requireSound(ctx, 0);
+
+    bool loaded = !isAssetLoading(ASSET_SOUND, requireHandle(ctx, 0));
+
+    duk_push_boolean(ctx, loaded);
+
+    return 1;
+}
+
+bool releaseSource(Handle soundId)
+{
+    Sound *sound = pool_get(&state.sounds, soundId);
+
+    if (sound == NULL)
+        return false;
+
+    Handle cached;
+    CacheRelease release = cacheRelease(ASSET_SOUND, soundId, &cached);
+
+    if (release == RELEASE_KEEP)
+        return true;
+
+    if (release == RELEASE_UNLOAD && sound->stream.buffer != NULL)
+        UnloadSound(*sound);
+
+    pool_remove(&state.sounds, soundId);
+
+    if (cached != 0)
+        pool_remove(&state.sounds, cached);
+
+    return true;
+}
+
+duk_ret_t audioReleaseSource(duk_context *ctx)
+{
+    if (!releaseSource(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t audioSetMasterVolume(duk_context *ctx)
+{
+    float volume = duk_require_number(ctx, 0);
+
+    SetMasterVolume(volume);
+
+    return 0;
+}
+
+duk_ret_t audioPlay(duk_context *ctx)
+{
+    Sound sound = *requireSound(ctx, 0);
+
+    PlaySound(sound);
+
+    return 0;
+}
+
+duk_ret_t audioStop(duk_context *ctx)
+{
+    Sound sound = *requireSound(ctx, 0);
+
+    StopSound(sound);
+
+    return 0;
+}
+
+duk_ret_t audioPause(duk_context *ctx)
+{
+    Sound sound = *requireSound(ctx, 0);
+
+    PauseSound(sound);
+
+    return 0;
+}
+
+duk_ret_t audioResume(duk_context *ctx)
+{
+    Sound sound = *requireSound(ctx, 0);
+
+    ResumeSound(sound);
+
+    return 0;
+}
+
+duk_ret_t audioIsPlaying(duk_context *ctx)
+{
+    Sound sound = *requireSound(ctx, 0);
+
+    bool playing = IsSoundPlaying(sound);
+
+    duk_push_boolean(ctx, playing);
+
+    return 1;
+}
+
+duk_ret_t audioSetVolume(duk_context *ctx)
+{
+    float volume = duk_require_number(ctx, 1);
+
+    Sound sound = *requireSound(ctx, 0);
+
+    SetSoundVolume(sound, volume);
+
+    return 0;
+}
+
+duk_ret_t audioSetPitch(duk_context *ctx)
+{
+    float pitch = duk_require_number(ctx, 1);
+
+    Sound sound = *requireSound(ctx, 0);
+
+    SetSoundPitch(sound, pitch);
+
+    return 0;
+}
+
+void registerAudioFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "audio");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioNewSource, 1);
+    duk_put_prop_string(ctx, -2, "newSource");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioNewSourceAsync, 2);
+    duk_put_prop_string(ctx, -2, "newSourceAsync");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioIsLoaded, 1);
+    duk_put_prop_string(ctx, -2, "isLoaded");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioReleaseSource, 1);
+    duk_put_prop_string(ctx, -2, "releaseSource");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioSetMasterVolume, 1);
+    duk_put_prop_string(ctx, -2, "setMasterVolume");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioPlay, 1);
+    duk_put_prop_string(ctx, -2, "play");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioStop, 1);
+    duk_put_prop_string(ctx, -2, "stop");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioPause, 1);
+    duk_put_prop_string(ctx, -2, "pause");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioResume, 1);
+    duk_put_prop_string(ctx, -2, "resume");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioIsPlaying, 1);
+    duk_put_prop_string(ctx, -2, "isPlaying");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioSetVolume, 2);
+    duk_put_prop_string(ctx, -2, "setVolume");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "audio");
+    duk_push_c_function(ctx, audioSetPitch, 2);
+    duk_put_prop_string(ctx, -2, "setPitch");
+    duk_pop_2(ctx);
+}
+
+// CAMERA MODULE
+
+duk_ret_t cameraAttach(duk_context *ctx)
+{
+    BeginMode2D(state.camera);
+
+    return 0;
+}
+
+duk_ret_t cameraDetach(duk_context *ctx)
+{
+    EndMode2D();
+
+    return 0;
+}
+
+duk_ret_t cameraLookAt(duk_context *ctx)
+{
+    int x = duk_require_number(ctx, 0);
+    int y = duk_require_number(ctx, 1);
+
+    state.camera.target = (Vector2){x, y};
+
+    return 0;
+}
+
+duk_ret_t cameraZoom(duk_context *ctx)
+{
+    float zoom = duk_require_number(ctx, 0);
+
+    state.camera.zoom = zoom;
+
+    return 0;
+}
+
+duk_ret_t cameraRotate(duk_context *ctx)
+{
+    float rotation = duk_require_number(ctx, 0);
+
+    state.camera.rotation = rotation;
+
+    return 0;
+}
+
+duk_ret_t cameraToWorldX(duk_context *ctx)
+{
+    int x = duk_require_number(ctx, 0);
+
+    int transformed = x + state.camera.target.x;
+
+    duk_push_number(ctx, transformed);
+
+    return 1;
+}
+
+duk_ret_t cameraToWorldY(duk_context *ctx)
+{
+    int y = duk_require_number(ctx, 0);
+
+    int transformed = y + state.camera.target.y;
+
+    duk_push_number(ctx, transformed);
+
+    return 1;
+}
+
+duk_ret_t cameraGetX(duk_context *ctx)
+{
+    int x = state.camera.target.x;
+
+    duk_push_number(ctx, x);
+
+    return 1;
+}
+
+duk_ret_t cameraGetY(duk_context *ctx)
+{
+    int y = state.camera.target.y;
+
+    duk_push_number(ctx, y);
+
+    return 1;
+}
+
+duk_ret_t cameraGetZoom(duk_context *ctx)
+{
+    float zoom = state.camera.zoom;
+
+    duk_push_number(ctx, zoom);
+
+    return 1;
+}
+
+duk_ret_t cameraGetRotation(duk_context *ctx)
+{
+    float rotation = state.camera.rotation;
+
+    duk_push_number(ctx, rotation);
+
+    return 1;
+}
+
+void registerCameraFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "camera");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraAttach, 0);
+    duk_put_prop_string(ctx, -2, "attach");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraDetach, 0);
+    duk_put_prop_string(ctx, -2, "detach");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraLookAt, 2);
+    duk_put_prop_string(ctx, -2, "lookAt");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraZoom, 1);
+    duk_put_prop_string(ctx, -2, "zoom");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraRotate, 1);
+    duk_put_prop_string(ctx, -2, "rotate");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraToWorldX, 1);
+    duk_put_prop_string(ctx, -2, "toWorldX");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraToWorldY, 1);
+    duk_put_prop_string(ctx, -2, "toWorldY");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraGetX, 0);
+    duk_put_prop_string(ctx, -2, "getX");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraGetY, 0);
+    duk_put_prop_string(ctx, -2, "getY");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraGetZoom, 0);
+    duk_put_prop_string(ctx, -2, "getZoom");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "camera");
+    duk_push_c_function(ctx, cameraGetRotation, 0);
+    duk_put_prop_string(ctx, -2, "getRotation");
+    duk_pop_2(ctx);
+}
+
+// FILESYSTEM MODULE
+
+// Paths are relative to the game directory, without trailing slashes.
+
+sds requireFilePath(duk_context *ctx, duk_idx_t idx)
+{
+    const char *file = duk_require_string(ctx, idx);
+
+    sds path = sdscatprintf(sdsempty(), "%s/%s", state.baseDir, file);
+
+    while (sdslen(path) > strlen(state.baseDir) && path[sdslen(path) - 1] == '/')
+        sdsrange(path, 0, -2);
+
+    return path;
+}
+
+// Copies the string or buffer at idx.
+
+sds requireFileData(duk_context *ctx, duk_idx_t idx)
+{
+    const void *data;
+    duk_size_t length;
+
+    if (duk_is_buffer_data(ctx, idx))
+    {
+        data = duk_get_buffer_data(ctx, idx, &length);
+    }
+    else
+    {
+        data = duk_require_lstring(ctx, idx, &length);
+    }
+
+    return sdsnewlen(data, length);
+}
+
+// File contents are handed to javascript as ArrayBuffers backed directly by
+// the memory they were read or mapped into, which the finalizer releases.
+
+duk_ret_t fileBufferFinalizer(duk_context *ctx)
+{
+    duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("memory"));
+    void *memory = duk_get_pointer(ctx, -1);
+
+    duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("mapping"));
+    size_t mapping = duk_get_uint(ctx, -1);
+
+    if (memory != NULL && mapping > 0)
+        munmap(memory, mapping);
+    else if (memory != NULL)
+        UnloadFileData(memory);
+
+    return 0;
+}
+
+void pushFileBuffer(duk_context *ctx, unsigned char *data, size_t size, void *mapping, size_t mappingSize)
+{
+    duk_push_external_buffer(ctx);
+    duk_config_buffer(ctx, -1, data, size);
+    duk_push_buffer_object(ctx, -1, 0, size, DUK_BUFOBJ_ARRAYBUFFER);
+    duk_remove(ctx, -2);
+
+    duk_push_pointer(ctx, mapping != NULL ? mapping : data);
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("memory"));
+
+    duk_push_uint(ctx, mappingSize);
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("mapping"));
+
+    duk_push_c_function(ctx, fileBufferFinalizer, 1);
+    duk_set_finalizer(ctx, -2);
+}
+
+void runFileJob(FileJob *job)
+{
+    if (job->type == FILE_READ)
+    {
+        job->data = vfsRead(job->path, &job->size);
+        job->failed = job->data == NULL && !vfsExists(job->path);
+    }
+    else
+    {
+        job->failed = !vfsWrite(job->path, job->input, sdslen(job->input));
+    }
+}
+
+// Stopping the worker still runs the jobs left in the queue, so writes made
+// just before closing are not lost.
+
+void *fileWorker(void *data)
+{
+    FileWorker *worker = data;
+
+    while (true)
+    {
+        pthread_mutex_lock(&worker->lock);
+
+        while (worker->running && worker->queued.length == 0)
+            pthread_cond_wait(&worker->wake, &worker->lock);
+
+        if (worker->queued.length == 0)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            break;
+        }
+
+        FileJob *job = worker->queued.data[0];
+        vec_splice(&worker->queued, 0, 1);
+
+        pthread_mutex_unlock(&worker->lock);
+
+        runFileJob(job);
+
+        pthread_mutex_lock(&worker->lock);
+        vec_push(&worker->finished, job);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    return NULL;
+}
+
+void freeFileJob(FileJob *job)
+{
+    if (job->data != NULL)
+        UnloadFileData(job->data);
+
+    sdsfree(job->path);
+    sdsfree(job->input);
+    free(job);
+}
+
+void stopFileWorker()
+{
+    FileWorker *worker = &state.fileWorker;
+
+    if (!state.fileWorkerStarted)
+        return;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->running = false;
+    pthread_cond_broadcast(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+
+    int i;
+    FileJob *job;
+
+    vec_foreach(&worker->finished, job, i) {
+        freeFileJob(job);
+    }
+
+    vec_deinit(&worker->queued);
+    vec_deinit(&worker->finished);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->wake);
+
+    state.fileWorkerStarted = false;
+}
+
+void queueFileJob(duk_context *ctx, FileJobType type, sds path, sds input, duk_idx_t callbackIdx)
+{
+    FileWorker *worker = &state.fileWorker;
+
+    if (!state.fileWorkerStarted)
+    {
+        worker->running = true;
+        vec_init(&worker->queued);
+        vec_init(&worker->finished);
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->wake, NULL);
+
+        if (pthread_create(&worker->thread, NULL, fileWorker, worker) != 0)
+        {
+            vec_deinit(&worker->queued);
+            vec_deinit(&worker->finished);
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->wake);
+
+            sdsfree(path);
+            sdsfree(input);
+            duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not start file worker.");
+            duk_throw(ctx);
+        }
+
+        state.fileWorkerStarted = true;
+    }
+
+    FileJob *job = calloc(1, sizeof(FileJob));
+
+    job->type = type;
+    job->path = path;
+    job->input = input;
+    job->callback = duk_is_function(ctx, callbackIdx) ? stashCallback(ctx, callbackIdx) : -1;
+
+    pthread_mutex_lock(&worker->lock);
+    vec_push(&worker->queued, job);
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Called at the start of a frame. Reads pass their data and writes nothing to
+// the callback, followed by the error if the job failed.
+
+void finishFileJobs(duk_context *ctx)
+{
+    if (!state.fileWorkerStarted)
+        return;
+
+    file_job_vec_t finished;
+
+    pthread_mutex_lock(&state.fileWorker.lock);
+    finished = state.fileWorker.finished;
+    vec_init(&state.fileWorker.finished);
+    pthread_mutex_unlock(&state.fileWorker.lock);
+
+    int i;
+    FileJob *job;
+
+    // Like asset callbacks, the ones after a callback that threw are dropped.
+
+    vec_foreach(&finished, job, i) {
+        if (job->callback >= 0 && state.error)
+        {
+            pushStashedCallback(ctx, job->callback);
+            duk_pop_3(ctx);
+        }
+        else if (job->callback >= 0)
+        {
+            pushStashedCallback(ctx, job->callback);
+
+            if (job->type == FILE_READ && !job->failed)
+            {
+                pushFileBuffer(ctx, job->data, job->size, NULL, 0);
+                job->data = NULL;
+            }
+            else
+            {
+                duk_push_undefined(ctx);
+            }
+
+            if (!job->failed)
+                duk_push_undefined(ctx);
+            else if (job->type == FILE_READ)
+                duk_push_string(ctx, "Could not read file.");
+            else
+                duk_push_string(ctx, "Could not write file.");
+
+            if (duk_pcall(ctx, 2) != DUK_EXEC_SUCCESS)
+            {
+                error(ctx);
+                duk_pop(ctx);
+            }
+
+            duk_pop_3(ctx);
+        }
+
+        freeFileJob(job);
+    }
+
+    vec_deinit(&finished);
+}
+
+duk_ret_t filesystemExists(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    duk_push_boolean(ctx, vfsExists(path) || vfsDirectoryExists(path));
+
+    sdsfree(path);
+
+    return 1;
+}
+
+duk_ret_t filesystemIsDirectory(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    duk_push_boolean(ctx, vfsDirectoryExists(path));
+
+    sdsfree(path);
+
+    return 1;
+}
+
+duk_ret_t filesystemList(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    vec_str_t files;
+    vec_init(&files);
+
+    bool found = vfsDirectoryFiles(path, &files, true);
+
+    sdsfree(path);
+
+    if (!found)
+    {
+        vec_deinit(&files);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Directory does not exist.");
+        duk_throw(ctx);
+    }
+
+    qsort(files.data, files.length, sizeof(char *), compareNames);
+
+    duk_push_array(ctx);
+
+    int i;
+    sds file;
+
+    vec_foreach(&files, file, i) {
+        duk_push_string(ctx, file);
+        duk_put_prop_index(ctx, -2, i);
+        sdsfree(file);
+    }
+
+    vec_deinit(&files);
+
+    return 1;
+}
+
+duk_ret_t filesystemRead(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    unsigned int size = 0;
+    unsigned char *data = vfsRead(path, &size);
+
+    if (data == NULL && !vfsExists(path))
+    {
+        sdsfree(path);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not read file.");
+        duk_throw(ctx);
+    }
+
+    sdsfree(path);
+
+    pushFileBuffer(ctx, data, size, NULL, 0);
+
+    return 1;
+}
+
+duk_ret_t filesystemReadText(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    VfsFile file = vfsLoad(path);
+
+    if (file.data == NULL && !vfsExists(path))
+    {
+        sdsfree(path);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not read file.");
+        duk_throw(ctx);
+    }
+
+    sdsfree(path);
+
+    duk_push_lstring(ctx, (const char *)file.data, file.size);
+
+    vfsUnload(file);
+
+    return 1;
+}
+
+duk_ret_t filesystemWrite(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+    sds data = requireFileData(ctx, 1);
+
+    bool written = vfsWrite(path, data, sdslen(data));
+
+    sdsfree(path);
+    sdsfree(data);
+
+    if (!written)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not write file.");
+        duk_throw(ctx);
+    }
+
+    return 0;
+}
+
+duk_ret_t filesystemMap(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    unsigned char *data;
+    size_t size;
+    void *mapping;
+    size_t mappingSize;
+
+    bool mapped = vfsMap(path, &data, &size, &mapping, &mappingSize);
+
+    sdsfree(path);
+
+    if (!mapped)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not map file.");
+        duk_throw(ctx);
+    }
+
+    pushFileBuffer(ctx, data, size, mapping, mappingSize);
+
+    return 1;
+}
+
+duk_ret_t filesystemReadAsync(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+
+    queueFileJob(ctx, FILE_READ, path, NULL, 1);
+
+    return 0;
+}
+
+duk_ret_t filesystemWriteAsync(duk_context *ctx)
+{
+    sds path = requireFilePath(ctx, 0);
+    sds data = requireFileData(ctx, 1);
+
+    if (packName(path) != NULL)
+    {
+        sdsfree(path);
+        sdsfree(data);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not write file.");
+        duk_throw(ctx);
+    }
+
+    queueFileJob(ctx, FILE_WRITE, path, data, 2);
+
+    return 0;
+}
+
+void registerFilesystemFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "filesystem");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemExists, 1);
+    duk_put_prop_string(ctx, -2, "exists");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemIsDirectory, 1);
+    duk_put_prop_string(ctx, -2, "isDirectory");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemList, 1);
+    duk_put_prop_string(ctx, -2, "list");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemRead, 1);
+    duk_put_prop_string(ctx, -2, "read");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemReadText, 1);
+    duk_put_prop_string(ctx, -2, "readText");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemWrite, 2);
+    duk_put_prop_string(ctx, -2, "write");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemMap, 1);
+    duk_put_prop_string(ctx, -2, "map");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemReadAsync, 2);
+    duk_put_prop_string(ctx, -2, "readAsync");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "filesystem");
+    duk_push_c_function(ctx, filesystemWriteAsync, 3);
+    duk_put_prop_string(ctx, -2, "writeAsync");
+    duk_pop_2(ctx);
+}
+
+duk_ret_t graphicsCircle(duk_context *ctx)
+{
+    const char *mode = duk_require_string(ctx, 0);
+    int x = duk_require_number(ctx, 1);
+    int y = duk_require_number(ctx, 2);
+    float radius = duk_require_number(ctx, 3);
+
+    if (strcmp("line", mode) == 0)
+    {
+        DrawCircleLines(x, y, radius, state.currentColor);
+    }
+    else if (strcmp("fill", mode) == 0)
+    {
+        DrawCircle(x, y, radius, state.currentColor);
+    }
+
+    return 0;
+}
+
+duk_ret_t graphicsDraw(duk_context *ctx)
+{
+    TextureRegion image = *requireImage(ctx, 0);
+    int x = duk_require_number(ctx, 1);
+    int y = duk_require_number(ctx, 2);
+    float rotation = duk_require_number(ctx, 3);
+    float scale = duk_require_number(ctx, 4);
+
+    Rectangle dest = {x, y, image.source.width * scale, image.source.height * scale};
+
+    DrawTexturePro(image.texture, image.source, dest, (Vector2){0, 0}, rotation, state.currentColor);
+
+    return 0;
+}
+
+duk_ret_t graphicsNewSpriteBatch(duk_context *ctx)
+{
+    Handle imageId = requireHandle(ctx, 0);
+    int capacity = duk_require_int(ctx, 1);
+
+    requireImage(ctx, 0);
+
+    if (capacity <= 0 || capacity > SPRITE_BATCH_CAPACITY_MAX)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Capacity must be positive and at most %d.", SPRITE_BATCH_CAPACITY_MAX);
+        duk_throw(ctx);
+    }
+
+    SpriteBatch batch;
+    batch.image = imageId;
+    batch.instances = malloc(sizeof(float) * SPRITE_BATCH_STRIDE * (size_t)capacity);
+
+    if (batch.instances == NULL)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not allocate sprite batch.");
+        duk_throw(ctx);
+    }
+
+    batch.count = 0;
+    batch.capacity = capacity;
+
+    Handle batchId = pool_add(&state.batches, batch);
+    trackHandle(ctx, HANDLE_SPRITE_BATCH, batchId);
+
+    pushHandle(ctx, batchId);
+
+    return 1;
+}
+
+duk_ret_t graphicsSetSpriteBatch(duk_context *ctx)
+{
+    SpriteBatch *batch = requireSpriteBatch(ctx, 0);
+
+    if (!isTypedArray(ctx, 1, "Float32Array"))
+    {
+        duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Sprite data must be a Float32Array.");
+        duk_throw(ctx);
+    }
+
+    duk_size_t size;
+    float *data = duk_get_buffer_data(ctx, 1, &size);
+
+    int available = size / (sizeof(float) * SPRITE_BATCH_STRIDE);
+    int count = duk_get_int_default(ctx, 2, available);
+
+    if (count < 0 || count > available || count > batch->capacity)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Sprite count exceeds data length or batch capacity.");
+        duk_throw(ctx);
+    }
+
+    memcpy(batch->instances, data, sizeof(float) * SPRITE_BATCH_STRIDE * count);
+    batch->count = count;
+
+    return 0;
+}
+
+// Converting a float outside 0-255 or NaN to unsigned char is undefined, so
+// color components are clamped first. NaN becomes 0.
+
+unsigned char colorByte(float value)
+{
+    if (!(value > 0))
+        return 0;
+
+    if (value > 255)
+        return 255;
+
+    return (unsigned char)value;
+}
+
+duk_ret_t graphicsDrawSpriteBatch(duk_context *ctx)
+{
+    SpriteBatch batch = *requireSpriteBatch(ctx, 0);
+
+    TextureRegion *image = pool_get(&state.images, batch.image);
+
+    if (image == NULL)
+        throwInvalidHandle(ctx);
+
+    float textureWidth = image->texture.width;
+    float textureHeight = image->texture.height;
+    Rectangle region = image->source;
+
+    for (int start = 0; start < batch.count; start += SPRITE_BATCH_CHUNK)
+    {
+        int end = start + SPRITE_BATCH_CHUNK < batch.count ? start + SPRITE_BATCH_CHUNK : batch.count;
+
+        rlCheckRenderBatchLimit(4 * (end - start));
+
+        rlSetTexture(image->texture.id);
+        rlBegin(RL_QUADS);
+        rlNormal3f(0.0f, 0.0f, 1.0f);
+
+        for (int i = start; i < end; i++)
+        {
+            float *sprite = &batch.instances[i * SPRITE_BATCH_STRIDE];
+
+            float x = sprite[0];
+            float y = sprite[1];
+            float angle = sprite[2] * DEG2RAD;
+            float scale = sprite[3];
+            float sourceX = sprite[4];
+            float sourceY = sprite[5];
+            float sourceWidth = sprite[6];
+            float sourceHeight = sprite[7];
+
+            if (sourceWidth == 0 || sourceHeight == 0)
+            {
+                sourceX = 0;
+                sourceY = 0;
+                sourceWidth = region.width;
+                sourceHeight = region.height;
+            }
+
+            sourceX += region.x;
+            sourceY += region.y;
+
+            // A negative size mirrors the same rectangle, like DrawTexturePro.
+            float u0 = sourceX / textureWidth;
+            float v0 = sourceY / textureHeight;
+            float u1 = (sourceX + fabsf(sourceWidth)) / textureWidth;
+            float v1 = (sourceY + fabsf(sourceHeight)) / textureHeight;
+
+            if (sourceWidth < 0)
+            {
+                float u = u0;
+                u0 = u1;
+                u1 = u;
+            }
+
+            if (sourceHeight < 0)
+            {
+                float v = v0;
+                v0 = v1;
+                v1 = v;
+            }
+
+            float width = fabsf(sourceWidth) * scale;
+            float height = fabsf(sourceHeight) * scale;
+
+            float cosAngle = cosf(angle);
+            float sinAngle = sinf(angle);
+
+            // Rotate around the top left corner, like DrawTextureEx.
+            Vector2 topLeft = {x, y};
+            Vector2 topRight = {x + width * cosAngle, y + width * sinAngle};
+            Vector2 bottomLeft = {x - height * sinAngle, y + height * cosAngle};
+            Vector2 bottomRight = {topRight.x - height * sinAngle, topRight.y + height * cosAngle};
+
+            rlColor4ub(colorByte(sprite[8]), colorByte(sprite[9]), colorByte(sprite[10]), colorByte(sprite[11]));
+
+            rlTexCoord2f(u0, v0);
+            rlVertex2f(topLeft.x, topLeft.y);
+
+            rlTexCoord2f(u0, v1);
+            rlVertex2f(bottomLeft.x, bottomLeft.y);
+
+            rlTexCoord2f(u1, v1);
+            rlVertex2f(bottomRight.x, bottomRight.y);
+
+            rlTexCoord2f(u1, v0);
+            rlVertex2f(topRight.x, topRight.y);
+        }
+
+        rlEnd();
+        rlSetTexture(0);
+    }
+
+    return 0;
+}
+
+duk_ret_t graphicsEllipse(duk_context *ctx)
+{
+    const char *mode = duk_require_string(ctx, 0);
+    int x = duk_require_number(ctx, 1);
+    int y = duk_require_number(ctx, 2);
+    float radiusX = duk_require_number(ctx, 3);
+    float radiusY = duk_require_number(ctx, 4);
+
+    if (strcmp("line", mode) == 0)
+    {
+        DrawEllipseLines(x, y, radiusX, radiusY, state.currentColor);
+    }
+    else if (strcmp("fill", mode) == 0)
+    {
+        DrawEllipse(x, y, radiusX, radiusY, state.currentColor);
+    }
+
+    return 0;
+}
+
+duk_ret_t graphicsLine(duk_context *ctx)
+{
+    int x1 = duk_require_number(ctx, 0);
+    int y1 = duk_require_number(ctx, 1);
+    int x2 = duk_require_number(ctx, 2);
+    int y2 = duk_require_number(ctx, 3);
+
+    DrawLine(x1, y1, x2, y2, state.currentColor);
+
+    return 0;
+}
+
+duk_ret_t graphicsPoint(duk_context *ctx)
+{
+    int x = duk_require_number(ctx, 0);
+    int y = duk_require_number(ctx, 1);
+
+    DrawPixel(x, y, state.currentColor);
+
+    return 0;
+}
+
+duk_ret_t graphicsPrint(duk_context *ctx)
+{
+    const char *text = duk_require_string(ctx, 0);
+    int x = duk_require_number(ctx, 1);
+    int y = duk_require_number(ctx, 2);
+    int size = duk_require_number(ctx, 3);
+
+    DrawTextEx(state.currentFont, text, (Vector2){x, y}, size, 2, state.currentColor);
+
+    return 0;
+}
+
+duk_ret_t graphicsRectangle(duk_context *ctx)
+{
+    const char *mode = duk_require_string(ctx, 0);
+    int x = duk_require_number(ctx, 1);
+    int y = duk_require_number(ctx, 2);
+    int width = duk_require_number(ctx, 3);
+    int height = duk_require_number(ctx, 4);
+
+    if (strcmp("line", mode) == 0)
+    {
+        DrawRectangleLines(x, y, width, height, state.currentColor);
+    }
+    else if (strcmp("fill", mode) == 0)
+    {
+        DrawRectangle(x, y, width, height, state.currentColor);
+    }
+
+    return 0;
+}
+
+duk_ret_t graphicsTriangle(duk_context *ctx)
+{
+    const char *mode = duk_require_string(ctx, 0);
+    int x1 = duk_require_number(ctx, 1);
+    int y1 = duk_require_number(ctx, 2);
+    int x2 = duk_require_number(ctx, 3);
+    int y2 = duk_require_number(ctx, 4);
+    int x3 = duk_require_number(ctx, 5);
+    int y3 = duk_require_number(ctx, 6);
+
+    if (strcmp("line", mode) == 0)
+    {
+        DrawTriangleLines((Vector2){x1, y1}, (Vector2){x2, y2}, (Vector2){x3, y3}, state.currentColor);
+    }
+    else if (strcmp("fill", mode) == 0)
+    {
+        DrawTriangle((Vector2){x1, y1}, (Vector2){x2, y2}, (Vector2){x3, y3}, state.currentColor);
+    }
+
+    return 0;
+}
+
+duk_ret_t graphicsNewImage(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    char path[1000];
+    strcpy(path, state.baseDir);
+    strcat(path, "/");
+    strcat(path, filename);
+
+    Handle imageId;
+    sds key = cacheKey(ASSET_IMAGE, path);
+
+    if (key != NULL && cacheLookup(key, &imageId))
+    {
+        sdsfree(key);
+        pushHandle(ctx, imageId);
+        return 1;
+    }
+
+    TextureRegion image = textureRegion((Texture2D){0});
+
+    if (!state.headless)
+        image = textureRegion(vfsLoadTexture(path));
+
+    imageId = pool_add(&state.images, image);
+    trackHandle(ctx, HANDLE_IMAGE, imageId);
+    watchAsset(ASSET_IMAGE, imageId, path);
+
+    if (key != NULL)
+    {
+        cacheInsert(ASSET_IMAGE, key, imageId, textureBytes(image.texture));
+        sdsfree(key);
+    }
+
+    pushHandle(ctx, imageId);
+
+    return 1;
+}
+
+duk_ret_t graphicsNewImageAsync(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    sds path = sdsempty();
+    path = sdscatprintf(path, "%s/%s", state.baseDir, filename);
+
+    if (!vfsExists(path))
+    {
+        sdsfree(path);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "File does not exist.");
+        duk_throw(ctx);
+    }
+
+    // In content mode the worker computes the key while it reads the file.
+
+    Handle imageId;
+    sds key = state.cacheMode == CACHE_CONTENT ? NULL : cacheKey(ASSET_IMAGE, path);
+
+    if (key != NULL && cacheLookup(key, &imageId))
+    {
+        queueAsset(ctx, ASSET_IMAGE, imageId, NULL, 1);
+    }
+    else
+    {
+        TextureRegion image = textureRegion((Texture2D){0});
+
+        imageId = pool_add(&state.images, image);
+        trackHandle(ctx, HANDLE_IMAGE, imageId);
+        watchAsset(ASSET_IMAGE, imageId, path);
+
+        if (key != NULL)
+            cacheInsert(ASSET_IMAGE, key, imageId, 0);
+
+        queueAsset(ctx, ASSET_IMAGE, imageId, path, 1);
+    }
+
+    sdsfree(key);
+    sdsfree(path);
+
+    pushHandle(ctx, imageId);
+
+    return 1;
+}
+
+duk_ret_t graphicsIsLoaded(duk_context *ctx)
+{
+    requireImage(ctx, 0);
+
+    bool loaded = !isAssetLoading(ASSET_IMAGE, requireHandle(ctx, 0));
+
+    duk_push_boolean(ctx, loaded);
+
+    return 1;
+}
+
+int compareAtlasEntries(const void *a, const void *b)
+{
+    const AtlasEntry *entryA = a;
+    const AtlasEntry *entryB = b;
+
+    if (entryA->image.height != entryB->image.height)
+        return entryB->image.height - entryA->image.height;
+
+    return strcmp(entryA->name, entryB->name);
+}
+
+// Assigns a page and rectangle to every entry and returns the used height of
+// each page, or false if an image is larger than a page.
+
+bool packAtlas(atlas_vec_t *entries, int size, vec_int_t *heights)
+{
+    qsort(entries->data, entries->length, sizeof(AtlasEntry), compareAtlasEntries);
+
+    int page = 0;
+    int x = 0;
+    int y = 0;
+    int shelfHeight = 0;
+
+    vec_push(heights, 0);
+
+    int i;
+    AtlasEntry *entry;
+
+    vec_foreach_ptr(entries, entry, i) {
+        int width = entry->image.width;
+        int height = entry->image.height;
+
+        if (width > size || height > size)
+            return false;
+
+        if (x + width > size)
+        {
+            y += shelfHeight;
+            x = 0;
+            shelfHeight = 0;
+        }
+
+        if (y + height > size)
+        {
+            page++;
+            vec_push(heights, 0);
+            x = 0;
+            y = 0;
+            shelfHeight = 0;
+        }
+
+        entry->page = page;
+        entry->rect = (Rectangle){x, y, width, height};
+
+        x += width + ATLAS_PADDING;
+
+        if (height + ATLAS_PADDING > shelfHeight)
+            shelfHeight = height + ATLAS_PADDING;
+
+        if (y + height > heights->data[page])
+            heights->data[page] = y + height;
+    }
+
+    return true;
+}
+
+void freeAtlasEntries(atlas_vec_t *entries)
+{
+    int i;
+    AtlasEntry *entry;
+
+    vec_foreach_ptr(entries, entry, i) {
+        sdsfree(entry->name);
+        UnloadImage(entry->image);
+    }
+
+    vec_deinit(entries);
+}
+
+// Adds an entry for name, loaded from the game directory. Returns false if the
+// file can not be decoded.
+
+bool addAtlasEntry(atlas_vec_t *entries, const char *name)
+{
+    sds path = sdsempty();
+    path = sdscatprintf(path, "%s/%s", state.baseDir, name);
+
+    AtlasEntry entry;
+    entry.name = sdsnew(name);
+    entry.image = vfsLoadImage(path);
+
+    sdsfree(path);
+
+    if (entry.image.data == NULL)
+    {
+        sdsfree(entry.name);
+        return false;
+    }
+
+    vec_push(entries, entry);
+
+    return true;
+}
+
+// Takes an array of files or a directory, relative to the game directory, and
+// an optional page size. Returns {pages, images}: the handles of the whole
+// pages and an object mapping every file to its sub-image handle. Draws of
+// sub-images from the same page share a texture, so raylib batches them.
+
+duk_ret_t graphicsNewAtlas(duk_context *ctx)
+{
+    int size = duk_get_int_default(ctx, 1, ATLAS_SIZE);
+
+    if (size <= 0)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Atlas size must be positive.");
+        duk_throw(ctx);
+    }
+
+    atlas_vec_t entries;
+    vec_init(&entries);
+
+    bool loaded = true;
+
+    if (duk_is_array(ctx, 0))
+    {
+        int length = duk_get_length(ctx, 0);
+
+        for (int i = 0; i < length && loaded; i++)
+        {
+            duk_get_prop_index(ctx, 0, i);
+            const char *name = duk_safe_to_string(ctx, -1);
+            loaded = addAtlasEntry(&entries, name);
+            duk_pop(ctx);
+        }
+    }
+    else
+    {
+        const char *directory = duk_require_string(ctx, 0);
+
+        sds path = sdsempty();
+        path = sdscatprintf(path, "%s/%s", state.baseDir, directory);
+
+        vec_str_t files;
+        vec_init(&files);
+
+        if (!vfsDirectoryFiles(path, &files, false))
+        {
+            sdsfree(path);
+            vec_deinit(&files);
+            duk_push_error_object(ctx, DUK_ERR_ERROR, "Directory does not exist.");
+            duk_throw(ctx);
+        }
+
+        sdsfree(path);
+
+        qsort(files.data, files.length, sizeof(char *), compareNames);
+
+        for (int i = 0; i < files.length && loaded; i++)
+        {
+            if (!IsFileExtension(files.data[i], ".png;.bmp;.tga;.jpg;.jpeg;.gif;.qoi;.psd;.hdr"))
+                continue;
+
+            sds name = sdsempty();
+            name = sdscatprintf(name, "%s/%s", directory, files.data[i]);
+            loaded = addAtlasEntry(&entries, name);
+            sdsfree(name);
+        }
+
+        for (int i = 0; i < files.length; i++)
+            sdsfree(files.data[i]);
+
+        vec_deinit(&files);
+
+        ClearDirectoryFiles();
+    }
+
+    if (!loaded)
+    {
+        freeAtlasEntries(&entries);
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not load atlas image.");
+        duk_throw(ctx);
+    }
+
+    vec_int_t heights;
+    vec_init(&heights);
+
+    if (!packAtlas(&entries, size, &heights))
+    {
+        vec_deinit(&heights);
+        freeAtlasEntries(&entries);
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Image is larger than the atlas size.");
+        duk_throw(ctx);
+    }
+
+    duk_idx_t atlas = duk_push_object(ctx);
+    duk_idx_t pages = duk_push_array(ctx);
+    duk_idx_t images = duk_push_object(ctx);
+
+    for (int page = 0; page < heights.length; page++)
+    {
+        TextureRegion pageRegion = textureRegion((Texture2D){0});
+
+        int i;
+        AtlasEntry *entry;
+
+        if (!state.headless)
+        {
+            Image pageImage = GenImageColor(size, heights.data[page] > 0 ? heights.data[page] : 1, BLANK);
+
+            vec_foreach_ptr(&entries, entry, i) {
+                if (entry->page != page)
+                    continue;
+
+                Rectangle source = {0, 0, entry->image.width, entry->image.height};
+                ImageDraw(&pageImage, entry->image, source, entry->rect, WHITE);
+            }
+
+            pageRegion = textureRegion(LoadTextureFromImage(pageImage));
+
+            UnloadImage(pageImage);
+        }
+
+        Handle pageId = pool_add(&state.images, pageRegion);
+        trackHandle(ctx, HANDLE_IMAGE, pageId);
+
+        pushHandle(ctx, pageId);
+        duk_put_prop_index(ctx, pages, page);
+
+        vec_foreach_ptr(&entries, entry, i) {
+            if (entry->page != page)
+                continue;
+
+            TextureRegion region;
+            region.texture = pageRegion.texture;
+            region.source = entry->rect;
+            region.page = pageId;
+
+            Handle imageId = pool_add(&state.images, region);
+            trackHandle(ctx, HANDLE_IMAGE, imageId);
+
+            pushHandle(ctx, imageId);
+            duk_put_prop_string(ctx, images, entry->name);
+        }
+    }
+
+    duk_put_prop_string(ctx, atlas, "images");
+    duk_put_prop_string(ctx, atlas, "pages");
+
+    vec_deinit(&heights);
+    freeAtlasEntries(&entries);
+
+    return 1;
+}
+
+// Returns the rectangle of its texture an image covers, which for an atlas
+// sub-image is where it was packed on its page.
+
+duk_ret_t graphicsGetViewport(duk_context *ctx)
+{
+    TextureRegion image = *requireImage(ctx, 0);
+
+    duk_idx_t viewport = duk_push_array(ctx);
+
+    duk_push_number(ctx, image.source.x);
+    duk_put_prop_index(ctx, viewport, 0);
+    duk_push_number(ctx, image.source.y);
+    duk_put_prop_index(ctx, viewport, 1);
+    duk_push_number(ctx, image.source.width);
+    duk_put_prop_index(ctx, viewport, 2);
+    duk_push_number(ctx, image.source.height);
+    duk_put_prop_index(ctx, viewport, 3);
+
+    return 1;
+}
+
+duk_ret_t graphicsNewFont(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    char path[1000];
+    strcpy(path, state.baseDir);
+    strcat(path, "/");
+    strcat(path, filename);
+
+    if (packName(path) != NULL && IsFileExtension(path, ".fnt"))
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Bitmap fonts (.fnt) cannot be loaded from a pack, use a TrueType font or a font image.");
+        duk_throw(ctx);
+    }
+
+    Handle fontId;
+    sds key = cacheKey(ASSET_FONT, path);
+
+    if (key != NULL && cacheLookup(key, &fontId))
+    {
+        sdsfree(key);
+        pushHandle(ctx, fontId);
+        return 1;
+    }
+
+    Font font = {0};
+
+    if (!state.headless)
+        font = vfsLoadFont(path);
+
+    fontId = pool_add(&state.fonts, font);
+    trackHandle(ctx, HANDLE_FONT, fontId);
+
+    if (key != NULL)
+    {
+        cacheInsert(ASSET_FONT, key, fontId, fontBytes(font));
+        sdsfree(key);
+    }
+
+    pushHandle(ctx, fontId);
+
+    return 1;
+}
+
+// Releasing drops the caller's reference. The resource is unloaded once no
+// cached reference is left, and its handle becomes invalid. Release functions
+// return false for an invalid handle. Releasing an atlas page frees the
+// texture its sub-images draw from, so their handles become invalid too.
+
+bool releaseImage(Handle imageId)
+{
+    TextureRegion *image = pool_get(&state.images, imageId);
+
+    if (image == NULL)
+        return false;
+
+    Handle cached;
+    CacheRelease release = cacheRelease(ASSET_IMAGE, imageId, &cached);
+
+    if (release == RELEASE_KEEP)
+        return true;
+
+    if (release == RELEASE_UNLOAD && image->page == 0 && image->texture.id != 0)
+        UnloadTexture(image->texture);
+
+    pool_remove(&state.images, imageId);
+
+    if (cached != 0)
+        pool_remove(&state.images, cached);
+
+    int i;
+    pool_foreach(&state.images, i) {
+        if (state.images.items.data[i].page == imageId)
+            pool_remove(&state.images, pool_handle(&state.images, i));
+    }
+
+    return true;
+}
+
+bool releaseFont(Handle fontId)
+{
+    Font *font = pool_get(&state.fonts, fontId);
+
+    if (font == NULL)
+        return false;
+
+    // Fonts load synchronously, so they never have aliases.
+
+    Handle cached;
+
+    if (cacheRelease(ASSET_FONT, fontId, &cached) == RELEASE_KEEP)
+        return true;
+
+    if (font->texture.id != 0)
+    {
+        if (state.currentFont.texture.id == font->texture.id)
+            state.currentFont = GetFontDefault();
+
+        UnloadFont(*font);
+    }
+
+    pool_remove(&state.fonts, fontId);
+
+    return true;
+}
+
+bool releaseSpriteBatch(Handle batchId)
+{
+    SpriteBatch *batch = pool_get(&state.batches, batchId);
+
+    if (batch == NULL)
+        return false;
+
+    free(batch->instances);
+
+    pool_remove(&state.batches, batchId);
+
+    return true;
+}
+
+duk_ret_t graphicsReleaseImage(duk_context *ctx)
+{
+    if (!releaseImage(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t graphicsReleaseFont(duk_context *ctx)
+{
+    if (!releaseFont(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t graphicsReleaseSpriteBatch(duk_context *ctx)
+{
+    if (!releaseSpriteBatch(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t graphicsCaptureScreenshot(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    TakeScreenshot(filename);
+
+    return 0;
+}
+
+duk_ret_t graphicsSetBackgroundColor(duk_context *ctx)
+{
+    int r = duk_require_number(ctx, 0);
+    int g = duk_require_number(ctx, 1);
+    int b = duk_require_number(ctx, 2);
+    int a = duk_require_number(ctx, 3);
+
+    Color color;
+    color.r = r;
+    color.g = g;
+    color.b = b;
+    color.a = a;
+
+    state.currentBackgroundColor = color;
+
+    return 0;
+}
+
+duk_ret_t graphicsSetColor(duk_context *ctx)
+{
+    int r = duk_require_number(ctx, 0);
+    int g = duk_require_number(ctx, 1);
+    int b = duk_require_number(ctx, 2);
+    int a = duk_require_number(ctx, 3);
+
+    Color color;
+    color.r = r;
+    color.g = g;
+    color.b = b;
+    color.a = a;
+
+    state.currentColor = color;
+
+    return 0;
+}
+
+duk_ret_t graphicsSetFont(duk_context *ctx)
+{
+    Font font = *requireFont(ctx, 0);
+
+    state.currentFont = font;
+
+    return 0;
+}
+
+void registerGraphicsFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "graphics");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsCircle, 4);
+    duk_put_prop_string(ctx, -2, "circle");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsDraw, 5);
+    duk_put_prop_string(ctx, -2, "draw");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsNewSpriteBatch, 2);
+    duk_put_prop_string(ctx, -2, "newSpriteBatch");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsSetSpriteBatch, 3);
+    duk_put_prop_string(ctx, -2, "setSpriteBatch");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsDrawSpriteBatch, 1);
+    duk_put_prop_string(ctx, -2, "drawSpriteBatch");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsReleaseSpriteBatch, 1);
+    duk_put_prop_string(ctx, -2, "releaseSpriteBatch");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsEllipse, 5);
+    duk_put_prop_string(ctx, -2, "ellipse");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsLine, 4);
+    duk_put_prop_string(ctx, -2, "line");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsPoint, 2);
+    duk_put_prop_string(ctx, -2, "point");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsPrint, 4);
+    duk_put_prop_string(ctx, -2, "print");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsRectangle, 5);
+    duk_put_prop_string(ctx, -2, "rectangle");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsTriangle, 7);
+    duk_put_prop_string(ctx, -2, "triangle");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsNewImage, 1);
+    duk_put_prop_string(ctx, -2, "newImage");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsNewImageAsync, 2);
+    duk_put_prop_string(ctx, -2, "newImageAsync");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsIsLoaded, 1);
+    duk_put_prop_string(ctx, -2, "isLoaded");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsNewAtlas, 2);
+    duk_put_prop_string(ctx, -2, "newAtlas");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsGetViewport, 1);
+    duk_put_prop_string(ctx, -2, "getViewport");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsNewFont, 1);
+    duk_put_prop_string(ctx, -2, "newFont");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsReleaseImage, 1);
+    duk_put_prop_string(ctx, -2, "releaseImage");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsReleaseFont, 1);
+    duk_put_prop_string(ctx, -2, "releaseFont");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsCaptureScreenshot, 1);
+    duk_put_prop_string(ctx, -2, "captureScreenshot");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsSetBackgroundColor, 4);
+    duk_put_prop_string(ctx, -2, "setBackgroundColor");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsSetColor, 4);
+    duk_put_prop_string(ctx, -2, "setColor");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "graphics");
+    duk_push_c_function(ctx, graphicsSetFont, 1);
+    duk_put_prop_string(ctx, -2, "setFont");
+    duk_pop_2(ctx);
+}
+
+duk_ret_t keyboardIsDown(duk_context *ctx)
+{
+    const char *key = duk_require_string(ctx, 0);
+
+    bool down = IsKeyDown(*map_get(&state.keys, key));
+
+    duk_push_boolean(ctx, down);
+
+    return 1;
+}
+
+duk_ret_t keyboardIsPressed(duk_context *ctx)
+{
+    const char *key = duk_require_string(ctx, 0);
+
+    bool pressed = IsKeyPressed(*map_get(&state.keys, key));
+
+    duk_push_boolean(ctx, pressed);
+
+    return 1;
+}
+
+duk_ret_t keyboardIsReleased(duk_context *ctx)
+{
+    const char *key = duk_require_string(ctx, 0);
+
+    bool released = IsKeyReleased(*map_get(&state.keys, key));
+
+    duk_push_boolean(ctx, released);
+
+    return 1;
+}
+
+void registerKeyboardFunctions(duk_context *ctx)
+{
+    map_set(&state.keys, "a", KEY_A);
+    map_set(&state.keys, "b", KEY_B);
+    map_set(&state.keys, "c", KEY_C);
+    map_set(&state.keys, "d", KEY_D);
+    map_set(&state.keys, "e", KEY_E);
+    map_set(&state.keys, "f", KEY_F);
+    map_set(&state.keys, "g", KEY_G);
+    map_set(&state.keys, "h", KEY_H);
+    map_set(&state.keys, "i", KEY_I);
+    map_set(&state.keys, "j", KEY_J);
+    map_set(&state.keys, "k", KEY_K);
+    map_set(&state.keys, "l", KEY_L);
+    map_set(&state.keys, "m", KEY_M);
+    map_set(&state.keys, "n", KEY_N);
+    map_set(&state.keys, "o", KEY_O);
+    map_set(&state.keys, "p", KEY_P);
+    map_set(&state.keys, "q", KEY_Q);
+    map_set(&state.keys, "r", KEY_R);
+    map_set(&state.keys, "s", KEY_S);
+    map_set(&state.keys, "t", KEY_T);
+    map_set(&state.keys, "u", KEY_U);
+    map_set(&state.keys, "v", KEY_V);
+    map_set(&state.keys, "w", KEY_W);
+    map_set(&state.keys, "x", KEY_X);
+    map_set(&state.keys, "y", KEY_Y);
+    map_set(&state.keys, "z", KEY_Z);
+    map_set(&state.keys, "0", KEY_ZERO);
+    map_set(&state.keys, "1", KEY_ONE);
+    map_set(&state.keys, "2", KEY_TWO);
+    map_set(&state.keys, "3", KEY_THREE);
+    map_set(&state.keys, "4", KEY_FOUR);
+    map_set(&state.keys, "5", KEY_FIVE);
+    map_set(&state.keys, "6", KEY_SIX);
+    map_set(&state.keys, "7", KEY_SEVEN);
+    map_set(&state.keys, "8", KEY_EIGHT);
+    map_set(&state.keys, "9", KEY_NINE);
+    map_set(&state.keys, "space", KEY_SPACE);
+    map_set(&state.keys, "up", KEY_UP);
+    map_set(&state.keys, "down", KEY_DOWN);
+    map_set(&state.keys, "left", KEY_LEFT);
+    map_set(&state.keys, "right", KEY_RIGHT);
+    map_set(&state.keys, "home", KEY_HOME);
+    map_set(&state.keys, "end", KEY_END);
+    map_set(&state.keys, "pageup", KEY_PAGE_UP);
+    map_set(&state.keys, "pagedown", KEY_PAGE_DOWN);
+    map_set(&state.keys, "insert", KEY_INSERT);
+    map_set(&state.keys, "backspace", KEY_BACKSPACE);
+    map_set(&state.keys, "tab", KEY_TAB);
+    map_set(&state.keys, "return", KEY_ENTER);
+    map_set(&state.keys, "delete", KEY_DELETE);
+    map_set(&state.keys, "f1", KEY_F1);
+    map_set(&state.keys, "f2", KEY_F2);
+    map_set(&state.keys, "f3", KEY_F3);
+    map_set(&state.keys, "f4", KEY_F4);
+    map_set(&state.keys, "f5", KEY_F5);
+    map_set(&state.keys, "f6", KEY_F6);
+    map_set(&state.keys, "f7", KEY_F7);
+    map_set(&state.keys, "f8", KEY_F8);
+    map_set(&state.keys, "f9", KEY_F9);
+    map_set(&state.keys, "f10", KEY_F10);
+    map_set(&state.keys, "f11", KEY_F11);
+    map_set(&state.keys, "f12", KEY_F12);
+    map_set(&state.keys, "numlock", KEY_NUM_LOCK);
+    map_set(&state.keys, "capslock", KEY_CAPS_LOCK);
+    map_set(&state.keys, "scolllock", KEY_SCROLL_LOCK);
+    map_set(&state.keys, "rshift", KEY_RIGHT_SHIFT);
+    map_set(&state.keys, "lshift", KEY_LEFT_SHIFT);
+    map_set(&state.keys, "rctrl", KEY_RIGHT_CONTROL);
+    map_set(&state.keys, "lctrl", KEY_LEFT_CONTROL);
+    map_set(&state.keys, "ralt", KEY_RIGHT_ALT);
+    map_set(&state.keys, "lalt", KEY_LEFT_ALT);
+    map_set(&state.keys, "lsuper", KEY_LEFT_SUPER);
+    map_set(&state.keys, "rsuper", KEY_RIGHT_SUPER);
+    map_set(&state.keys, "escape", KEY_ESCAPE);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "keyboard");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "keyboard");
+    duk_push_c_function(ctx, keyboardIsDown, 1);
+    duk_put_prop_string(ctx, -2, "isDown");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "keyboard");
+    duk_push_c_function(ctx, keyboardIsPressed, 1);
+    duk_put_prop_string(ctx, -2, "isPressed");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "keyboard");
+    duk_push_c_function(ctx, keyboardIsReleased, 1);
+    duk_put_prop_string(ctx, -2, "isReleased");
+    duk_pop_2(ctx);
+}
+
+duk_ret_t mathRandom(duk_context *ctx)
+{
+    int min = duk_require_number(ctx, 0);
+    int max = duk_require_number(ctx, 1);
+
+    int random = GetRandomValue(min, max);
+
+    duk_push_number(ctx, random);
+
+    return 1;
+}
+
+duk_ret_t mathSetRandomSeed(duk_context *ctx)
+{
+    int seed = duk_require_number(ctx, 0);
+
+    SetRandomSeed(seed);
+
+    return 0;
+}
+
+void registerMathFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "math");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "math");
+    duk_push_c_function(ctx, mathRandom, 2);
+    duk_put_prop_string(ctx, -2, "random");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "math");
+    duk_push_c_function(ctx, mathSetRandomSeed, 1);
+    duk_put_prop_string(ctx, -2, "setRandomSeed");
+    duk_pop_2(ctx);
+}
+
+duk_ret_t mouseGetX(duk_context *ctx)
+{
+    int x = GetMouseX();
+
+    duk_push_number(ctx, x);
+
+    return 1;
+}
+
+duk_ret_t mouseGetY(duk_context *ctx)
+{
+    int y = GetMouseY();
+
+    duk_push_number(ctx, y);
+
+    return 1;
+}
+
+duk_ret_t mouseIsDown(duk_context *ctx)
+{
+    int button = duk_require_number(ctx, 0);
+
+    bool down = IsMouseButtonDown(button);
+
+    duk_push_boolean(ctx, down);
+
+    return 1;
+}
+
+duk_ret_t mouseIsPressed(duk_context *ctx)
+{
+    int button = duk_require_number(ctx, 0);
+
+    bool pressed = IsMouseButtonPressed(button);
+
+    duk_push_boolean(ctx, pressed);
+
+    return 1;
+}
+
+duk_ret_t mouseIsReleased(duk_context *ctx)
+{
+    int button = duk_require_number(ctx, 0);
+
+    bool released = IsMouseButtonReleased(button);
+
+    duk_push_boolean(ctx, released);
+
+    return 1;
+}
+
+duk_ret_t mouseGetWheelMove(duk_context *ctx)
+{
+    float wheelMove = GetMouseWheelMove();
+
+    duk_push_number(ctx, wheelMove);
+
+    return 1;
+}
+
+duk_ret_t mouseSetGrabbed(duk_context *ctx)
+{
+    bool grab = duk_require_boolean(ctx, 0);
+
+    if (grab)
+    {
+        DisableCursor();
+        state.grabbed = true;
+    }
+    else
+    {
+        EnableCursor();
+        state.grabbed = false;
+    }
+
+    return 0;
+}
+
+duk_ret_t mouseIsGrabbed(duk_context *ctx)
+{
+    bool grabbed = state.grabbed;
+
+    duk_push_boolean(ctx, grabbed);
+
+    return 1;
+}
+
+duk_ret_t mouseSetVisible(duk_context *ctx)
+{
+    bool visible = duk_require_boolean(ctx, 0);
+
+    if (visible)
+    {
+        ShowCursor();
+    }
+    else
+    {
+        HideCursor();
+    }
+
+    return 0;
+}
+
+duk_ret_t mouseIsVisible(duk_context *ctx)
+{
+    bool visible = !IsCursorHidden();
+
+    duk_push_boolean(ctx, visible);
+
+    return 1;
+}
+
+void registerMouseFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "mouse");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseGetX, 0);
+    duk_put_prop_string(ctx, -2, "getX");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseGetY, 0);
+    duk_put_prop_string(ctx, -2, "getY");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseIsDown, 1);
+    duk_put_prop_string(ctx, -2, "isDown");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseIsPressed, 1);
+    duk_put_prop_string(ctx, -2, "isPressed");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseIsReleased, 1);
+    duk_put_prop_string(ctx, -2, "isReleased");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseGetWheelMove, 0);
+    duk_put_prop_string(ctx, -2, "getWheelMove");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseSetGrabbed, 1);
+    duk_put_prop_string(ctx, -2, "setGrabbed");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseIsGrabbed, 0);
+    duk_put_prop_string(ctx, -2, "isGrabbed");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseSetVisible, 1);
+    duk_put_prop_string(ctx, -2, "setVisible");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "mouse");
+    duk_push_c_function(ctx, mouseIsVisible, 0);
+    duk_put_prop_string(ctx, -2, "isVisible");
+    duk_pop_2(ctx);
+}
+
+#define NETWORK_CHANNELS 2
+
+int requireChannelCount(duk_context *ctx, duk_idx_t idx)
+{
+    int channels = duk_get_int_default(ctx, idx, NETWORK_CHANNELS);
+
+    if (channels < 1 || channels > ENET_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Invalid channel count.");
+        duk_throw(ctx);
+    }
+
+    return channels;
+}
+
+duk_ret_t networkNewServer(duk_context *ctx)
+{
+    const char *address = duk_require_string(ctx, 0);
+    int port = duk_require_number(ctx, 1);
+    int channels = requireChannelCount(ctx, 2);
+
+    ENetAddress enetAddress;
+    enet_address_set_host(&enetAddress, address);
+    enetAddress.port = port;
+
+    ENetHost *server = enet_host_create(&enetAddress, 32, channels, 0, 0);
+
+    if (server == NULL)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not create server.");
+        duk_throw(ctx);
+    }
+
+    Host host;
+    host.host = server;
+    host.thread = NULL;
+    vec_init(&host.pending);
+
+    Handle hostId = pool_add(&state.hosts, host);
+    trackHandle(ctx, HANDLE_HOST, hostId);
+
+    pushHandle(ctx, hostId);
+
+    return 1;
+}
+
+duk_ret_t networkNewClient(duk_context *ctx)
+{
+    int channels = requireChannelCount(ctx, 0);
+
+    ENetHost *client = enet_host_create(NULL, 1, channels, 0, 0);
+
+    if (client == NULL)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not create client.");
+        duk_throw(ctx);
+    }
+
+    Host host;
+    host.host = client;
+    host.thread = NULL;
+    vec_init(&host.pending);
+
+    Handle hostId = pool_add(&state.hosts, host);
+    trackHandle(ctx, HANDLE_HOST, hostId);
+
+    pushHandle(ctx, hostId);
+
+    return 1;
+}
+
+// Received packets are handed to javascript as ArrayBuffers backed directly by
+// the packet data. The packet is destroyed by the buffer's finalizer once the
+// script drops the last reference to it.
+
+duk_ret_t packetFinalizer(duk_context *ctx)
+{
+    duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("packet"));
+    ENetPacket *packet = duk_get_pointer(ctx, -1);
+
+    if (packet != NULL)
+        enet_packet_destroy(packet);
+
+    return 0;
+}
+
+void pushPacket(duk_context *ctx, ENetPacket *packet)
+{
+    duk_push_external_buffer(ctx);
+    duk_config_buffer(ctx, -1, packet->data, packet->dataLength);
+    duk_push_buffer_object(ctx, -1, 0, packet->dataLength, DUK_BUFOBJ_ARRAYBUFFER);
+    duk_remove(ctx, -2);
+
+    duk_push_pointer(ctx, packet);
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("packet"));
+
+    duk_push_c_function(ctx, packetFinalizer, 1);
+    duk_set_finalizer(ctx, -2);
+}
+
+// Every peer gets one handle for its whole connection, stored as its pool
+// index plus one in peer->data. The handle is released after the peer's
+// disconnect event has been delivered. Only the main thread touches
+// peer->data, and events are consumed in order, so a peer that is reused by
+// a background thread gets a fresh handle.
+
+Handle peerHandle(duk_context *ctx, Handle hostId, ENetPeer *peer, enet_uint32 connectID)
+{
+    if (peer->data == NULL)
+    {
+        Peer entry;
+        entry.peer = peer;
+        entry.connectID = connectID;
+        entry.host = hostId;
+
+        Handle peerId = pool_add(&state.peers, entry);
+        trackHandle(ctx, HANDLE_PEER, peerId);
+        peer->data = (void *)(uintptr_t)(handleIndex(peerId) + 1);
+        return peerId;
+    }
+
+    return pool_handle(&state.peers, (uintptr_t)peer->data - 1);
+}
+
+void releasePeer(ENetPeer *peer)
+{
+    if (peer->data == NULL)
+        return;
+
+    pool_remove(&state.peers, pool_handle(&state.peers, (uintptr_t)peer->data - 1));
+    peer->data = NULL;
+}
+
+void pushEvent(duk_context *ctx, Handle hostId, NetworkEvent *networkEvent)
+{
+    ENetEvent *event = &networkEvent->event;
+
+    duk_idx_t obj = duk_push_object(ctx);
+
+    switch (event->type)
+    {
+    case ENET_EVENT_TYPE_CONNECT:
+        duk_push_string(ctx, "connect");
+        break;
+    case ENET_EVENT_TYPE_DISCONNECT:
+        duk_push_string(ctx, "disconnect");
+        break;
+    case ENET_EVENT_TYPE_RECEIVE:
+        duk_push_string(ctx, "receive");
+        break;
+    case ENET_EVENT_TYPE_NONE:
+        duk_push_string(ctx, "none");
+        break;
+    }
+
+    duk_put_prop_string(ctx, obj, "type");
+
+    if (event->type == ENET_EVENT_TYPE_NONE)
+        return;
+
+    pushHandle(ctx, peerHandle(ctx, hostId, event->peer, networkEvent->connectID));
+    duk_put_prop_string(ctx, obj, "peer");
+
+    if (event->type == ENET_EVENT_TYPE_RECEIVE)
+    {
+        pushPacket(ctx, event->packet);
+        duk_put_prop_string(ctx, obj, "data");
+        duk_push_number(ctx, event->channelID);
+        duk_put_prop_string(ctx, obj, "channel");
+    }
+
+    if (event->type == ENET_EVENT_TYPE_DISCONNECT)
+        releasePeer(event->peer);
+}
+
+// Returns the next event of a host, from its background queue when it has a
+// thread, otherwise by servicing it directly. Only the first direct read waits
+// for the timeout, later ones drain events that are already queued. Events
+// left over from a stopped thread come first.
+
+bool nextEvent(Host *host, NetworkEvent *networkEvent, int timeout, bool first)
+{
+    if (host->pending.length > 0)
+    {
+        *networkEvent = host->pending.data[0];
+        vec_splice(&host->pending, 0, 1);
+        return true;
+    }
+
+    if (host->thread != NULL)
+        return ring_pop(&host->thread->events, networkEvent);
+
+    int result;
+
+    if (first)
+        result = enet_host_service(host->host, &networkEvent->event, timeout);
+    else
+        result = enet_host_check_events(host->host, &networkEvent->event);
+
+    if (result <= 0)
+        return false;
+
+    networkEvent->connectID = networkEvent->event.peer->connectID;
+
+    return true;
+}
+
+duk_ret_t networkService(duk_context *ctx)
+{
+    Handle hostId = requireHandle(ctx, 0);
+    Host *host = requireHost(ctx, 0);
+    int timeout = duk_require_number(ctx, 1);
+
+    NetworkEvent event;
+
+    if (!nextEvent(host, &event, timeout, true))
+        event.event.type = ENET_EVENT_TYPE_NONE;
+
+    pushEvent(ctx, hostId, &event);
+
+    return 1;
+}
+
+duk_ret_t networkPoll(duk_context *ctx)
+{
+    Handle hostId = requireHandle(ctx, 0);
+    Host *host = requireHost(ctx, 0);
+    int maxEvents = duk_get_int_default(ctx, 1, 1024);
+    int timeout = duk_get_int_default(ctx, 2, 0);
+
+    duk_idx_t events = duk_push_array(ctx);
+
+    NetworkEvent event;
+    int count = 0;
+
+    while (count < maxEvents && nextEvent(host, &event, timeout, count == 0))
+    {
+        pushEvent(ctx, hostId, &event);
+        duk_put_prop_index(ctx, events, count++);
+    }
+
+    return 1;
+}
+
+duk_ret_t networkSend(duk_context *ctx)
+{
+    Peer peer = *requirePeer(ctx, 0);
+    const char *method = duk_get_string(ctx, 2);
+    int channel = duk_get_int_default(ctx, 3, 0);
+
+    Host *host = pool_get(&state.hosts, peer.host);
+
+    if (host == NULL)
+        throwInvalidHandle(ctx);
+
+    const void *data;
+    duk_size_t length;
+
+    if (duk_is_buffer_data(ctx, 1))
+    {
+        data = duk_get_buffer_data(ctx, 1, &length);
+    }
+    else
+    {
+        data = duk_require_lstring(ctx, 1, &length);
+    }
+
+    if (method == NULL)
+    {
+        method = "reliable";
+    }
+
+    ENetPacketFlag enetMethod;
+
+    if (strcmp(method, "reliable") == 0)
+    {
+        enetMethod = ENET_PACKET_FLAG_RELIABLE;
+    }
+    else if (strcmp(method, "unreliable") == 0)
+    {
+        enetMethod = ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT;
+    }
+    else if (strcmp(method, "unsequenced") == 0)
+    {
+        enetMethod = ENET_PACKET_FLAG_UNSEQUENCED;
+    }
+    else
+    {
+        enetMethod = ENET_PACKET_FLAG_RELIABLE;
+    }
+
+    if (channel < 0 || (size_t)channel >= host->host->channelLimit)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Invalid channel.");
+        duk_throw(ctx);
+    }
+
+    ENetPacket *packet = enet_packet_create(data, length, enetMethod);
+    bool sent;
+
+    if (host->thread != NULL)
+    {
+        NetworkCommand command;
+        command.peer = peer.peer;
+        command.connectID = peer.connectID;
+        command.channel = channel;
+        command.packet = packet;
+
+        // A full queue means the network thread is behind, the packet is
+        // dropped instead of stalling the frame until it catches up.
+
+        sent = ring_push(&host->thread->commands, command);
+    }
+    else
+    {
+        sent = enet_peer_send(peer.peer, channel, packet) == 0;
+    }
+
+    if (!sent)
+        enet_packet_destroy(packet);
+
+    duk_push_boolean(ctx, sent);
+
+    return 1;
+}
+
+duk_ret_t networkConnect(duk_context *ctx)
+{
+    Handle hostId = requireHandle(ctx, 0);
+    Host *host = requireHost(ctx, 0);
+    const char *address = duk_require_string(ctx, 1);
+    int port = duk_require_number(ctx, 2);
+
+    ENetAddress enetAddress;
+
+    enet_address_set_host(&enetAddress, address);
+    enetAddress.port = port;
+
+    if (host->thread != NULL)
+        pthread_mutex_lock(&host->thread->lock);
+
+    ENetPeer *peer = enet_host_connect(host->host, &enetAddress, host->host->channelLimit, 0);
+    enet_uint32 connectID = peer != NULL ? peer->connectID : 0;
+
+    if (host->thread != NULL)
+        pthread_mutex_unlock(&host->thread->lock);
+
+    if (peer == NULL)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not connect to server.");
+        duk_throw(ctx);
+    }
+
+    Handle peerId = peerHandle(ctx, hostId, peer, connectID);
+
+    pushHandle(ctx, peerId);
+
+    return 1;
+}
+
+// BACKGROUND NETWORKING
+
+#define NETWORK_THREAD_TIMEOUT 1
+
+void runNetworkCommands(NetworkThread *thread)
+{
+    NetworkCommand command;
+
+    while (ring_pop(&thread->commands, &command))
+    {
+        bool sent = false;
+
+        if (__atomic_load_n(&thread->running, __ATOMIC_ACQUIRE) && command.peer->connectID == command.connectID)
+            sent = enet_peer_send(command.peer, command.channel, command.packet) == 0;
+
+        if (!sent)
+            enet_packet_destroy(command.packet);
+    }
+}
+
+void *networkThread(void *data)
+{
+    NetworkThread *thread = data;
+
+    struct timespec wait = {0, 1000000};
+
+    // An event that does not fit in the full queue is held until it does.
+
+    while (__atomic_load_n(&thread->running, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&thread->lock);
+
+        runNetworkCommands(thread);
+
+        if (!thread->holding)
+            thread->holding = enet_host_service(thread->host, &thread->held.event, NETWORK_THREAD_TIMEOUT) > 0;
+
+        while (thread->holding)
+        {
+            thread->held.connectID = thread->held.event.peer->connectID;
+
+            if (!ring_push(&thread->events, thread->held))
+                break;
+
+            thread->holding = enet_host_check_events(thread->host, &thread->held.event) > 0;
+        }
+
+        pthread_mutex_unlock(&thread->lock);
+
+        // The main thread is not consuming events, wait instead of spinning.
+        if (thread->holding)
+            nanosleep(&wait, NULL);
+    }
+
+    return NULL;
+}
+
+bool startNetworkThread(Host *host)
+{
+    NetworkThread *thread = malloc(sizeof(NetworkThread));
+
+    thread->host = host->host;
+    thread->running = true;
+    thread->holding = false;
+    ring_init(&thread->events);
+    ring_init(&thread->commands);
+    pthread_mutex_init(&thread->lock, NULL);
+
+    if (pthread_create(&thread->thread, NULL, networkThread, thread) != 0)
+    {
+        pthread_mutex_destroy(&thread->lock);
+        free(thread);
+        return false;
+    }
+
+    host->thread = thread;
+
+    return true;
+}
+
+// Stopping moves the host back to the main thread: queued packets are still
+// sent, and events that were not polled yet move to the host's pending queue.
+
+void stopNetworkThread(Host *host)
+{
+    NetworkThread *thread = host->thread;
+
+    __atomic_store_n(&thread->running, false, __ATOMIC_RELEASE);
+    pthread_join(thread->thread, NULL);
+
+    NetworkCommand command;
+
+    while (ring_pop(&thread->commands, &command))
+    {
+        if (command.peer->connectID != command.connectID || enet_peer_send(command.peer, command.channel, command.packet) != 0)
+            enet_packet_destroy(command.packet);
+    }
+
+    NetworkEvent event;
+
+    while (ring_pop(&thread->events, &event))
+        vec_push(&host->pending, event);
+
+    if (thread->holding)
+        vec_push(&host->pending, thread->held);
+
+    pthread_mutex_destroy(&thread->lock);
+    free(thread);
+
+    host->thread = NULL;
+}
+
+duk_ret_t networkSetBackground(duk_context *ctx)
+{
+    Host *host = requireHost(ctx, 0);
+    bool background = duk_require_boolean(ctx, 1);
+
+    if (background && host->thread == NULL)
+    {
+        if (!startNetworkThread(host))
+        {
+            duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not start network thread.");
+            duk_throw(ctx);
+        }
+    }
+    else if (!background && host->thread != NULL)
+    {
+        stopNetworkThread(host);
+    }
+
+    return 0;
+}
+
+// Releasing a peer disconnects it immediately. Releasing a host destroys it
+// along with all of its peers' handles.
+
+bool releasePeerHandle(Handle peerId)
+{
+    Peer *peer = pool_get(&state.peers, peerId);
+
+    if (peer == NULL)
+        return false;
+
+    Host *host = pool_get(&state.hosts, peer->host);
+    bool connected = false;
+
+    // The network thread reconnects peers while it holds the lock, so
+    // connectID is only read under it.
+
+    if (host != NULL)
+    {
+        if (host->thread != NULL)
+            pthread_mutex_lock(&host->thread->lock);
+
+        connected = peer->peer->connectID == peer->connectID;
+
+        if (connected)
+            enet_peer_disconnect_now(peer->peer, 0);
+
+        if (host->thread != NULL)
+            pthread_mutex_unlock(&host->thread->lock);
+    }
+
+    if (connected)
+    {
+        releasePeer(peer->peer);
+    }
+    else
+    {
+        pool_remove(&state.peers, peerId);
+    }
+
+    return true;
+}
+
+bool releaseHost(Handle hostId)
+{
+    Host *host = pool_get(&state.hosts, hostId);
+
+    if (host == NULL)
+        return false;
+
+    if (host->thread != NULL)
+        stopNetworkThread(host);
+
+    int i;
+    NetworkEvent event;
+
+    vec_foreach(&host->pending, event, i) {
+        if (event.event.type == ENET_EVENT_TYPE_RECEIVE)
+            enet_packet_destroy(event.event.packet);
+    }
+
+    vec_deinit(&host->pending);
+
+    pool_foreach(&state.peers, i) {
+        Peer *peer = &state.peers.items.data[i];
+
+        if (peer->host == hostId)
+        {
+            if (peer->peer->connectID == peer->connectID)
+                peer->peer->data = NULL;
+
+            pool_remove(&state.peers, pool_handle(&state.peers, i));
+        }
+    }
+
+    enet_host_destroy(host->host);
+
+    pool_remove(&state.hosts, hostId);
+
+    return true;
+}
+
+duk_ret_t networkReleasePeer(duk_context *ctx)
+{
+    if (!releasePeerHandle(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t networkReleaseHost(duk_context *ctx)
+{
+    if (!releaseHost(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t networkIsBackground(duk_context *ctx)
+{
+    Host *host = requireHost(ctx, 0);
+
+    bool background = host->thread != NULL;
+
+    duk_push_boolean(ctx, background);
+
+    return 1;
+}
+
+void registerNetworkFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "network");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkNewServer, 3);
+    duk_put_prop_string(ctx, -2, "newServer");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkNewClient, 1);
+    duk_put_prop_string(ctx, -2, "newClient");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkService, 2);
+    duk_put_prop_string(ctx, -2, "service");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkPoll, 3);
+    duk_put_prop_string(ctx, -2, "poll");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkSend, 4);
+    duk_put_prop_string(ctx, -2, "send");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkConnect, 3);
+    duk_put_prop_string(ctx, -2, "connect");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkReleasePeer, 1);
+    duk_put_prop_string(ctx, -2, "releasePeer");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkReleaseHost, 1);
+    duk_put_prop_string(ctx, -2, "releaseHost");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkSetBackground, 2);
+    duk_put_prop_string(ctx, -2, "setBackground");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "network");
+    duk_push_c_function(ctx, networkIsBackground, 1);
+    duk_put_prop_string(ctx, -2, "isBackground");
+    duk_pop_2(ctx);
+}
+
+void noGame()
+{
+    SetTraceLogLevel(LOG_NONE);
+    InitWindow(800, 600, "TURTLE 0.1");
+    SetTargetFPS(60);
+    SetExitKey(KEY_NULL);
+
+    char *text = "NO GAME";
+    int width = MeasureText(text, 50);
+
+    while (!WindowShouldClose())
+    {
+        BeginDrawing();
+
+        ClearBackground(BLACK);
+
+        DrawText(text, 400 - width / 2, 300 - 50 / 2, 50, WHITE);
+
+        EndDrawing();
+    }
+
+    CloseWindow();
+}
+
+// Physics runs at a fixed timestep. Frame time is accumulated and consumed in
+// whole steps, at most physicsMaxSubsteps per frame, so a hitch drops time
+// instead of spiralling. The pose before the last step is kept to interpolate
+// rendering between the last two steps. A timestep of zero steps once per
+// frame with the frame time. Collisions are kept until a frame steps again,
+// so frames that run no step still see the last ones.
+
+void resetInterpolation(Collider *collider)
+{
+    collider->previousPosition = cpBodyGetPosition(collider->body);
+    collider->previousAngle = cpBodyGetAngle(collider->body);
+}
+
+void stepSpace(cpFloat dt)
+{
+    double start = monotonicTime();
+
+    if (state.physicsThreads > 1)
+        cpHastySpaceStep(state.space, dt);
+    else
+        cpSpaceStep(state.space, dt);
+
+    profileZone(ZONE_STEP, start);
+}
+
+void clearCollisions()
+{
+    vec_clear(&state.collisions);
+
+    if (state.collisionTableSize > 0)
+        memset(state.collisionTable, -1, sizeof(int) * state.collisionTableSize);
+}
+
+void stepPhysics(double dt)
+{
+    if (state.physicsStep <= 0)
+    {
+        clearCollisions();
+        stepSpace(dt);
+        state.physicsAccumulator = 0;
+        return;
+    }
+
+    state.physicsAccumulator += dt;
+
+    int steps = state.physicsAccumulator / state.physicsStep;
+
+    if (steps > state.physicsMaxSubsteps)
+    {
+        steps = state.physicsMaxSubsteps;
+        state.physicsAccumulator = fmod(state.physicsAccumulator, state.physicsStep) + steps * state.physicsStep;
+    }
+
+    if (steps > 0)
+        clearCollisions();
+
+    for (int step = 0; step < steps; step++)
+    {
+        if (step == steps - 1)
+        {
+            int i;
+            pool_foreach(&state.colliders, i) {
+                resetInterpolation(&state.colliders.items.data[i]);
+            }
+        }
+
+        stepSpace(state.physicsStep);
+        state.physicsAccumulator -= state.physicsStep;
+    }
+}
+
+double physicsInterpolation()
+{
+    if (state.physicsStep <= 0)
+        return 1;
+
+    return state.physicsAccumulator / state.physicsStep;
+}
+
+duk_ret_t physicsSetTimestep(duk_context *ctx)
+{
+    double step = duk_require_number(ctx, 0);
+    int maxSubsteps = duk_get_int_default(ctx, 1, state.physicsMaxSubsteps);
+
+    if (step < 0 || maxSubsteps < 1)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Invalid timestep or substep count.");
+        duk_throw(ctx);
+    }
+
+    state.physicsStep = step;
+    state.physicsMaxSubsteps = maxSubsteps;
+    state.physicsAccumulator = 0;
+
+    return 0;
+}
+
+duk_ret_t physicsGetTimestep(duk_context *ctx)
+{
+    double step = state.physicsStep;
+
+    duk_push_number(ctx, step);
+
+    return 1;
+}
+
+duk_ret_t physicsGetInterpolation(duk_context *ctx)
+{
+    double alpha = physicsInterpolation();
+
+    duk_push_number(ctx, alpha);
+
+    return 1;
+}
+
+duk_ret_t physicsNewCircleCollider(duk_context *ctx)
+{
+    int x = duk_require_number(ctx, 0);
+    int y = duk_require_number(ctx, 1);
+    int radius = duk_require_number(ctx, 2);
+
+    cpFloat mass = 1;
+    cpFloat moment = cpMomentForCircle(mass, 0, radius, cpvzero);
+
+    cpBody *body = cpSpaceAddBody(state.space, cpBodyNew(mass, moment));
+    cpBodySetPosition(body, cpv(x, y));
+
+    cpShape *shape = cpSpaceAddShape(state.space, cpCircleShapeNew(body, radius, cpvzero));
+
+    Collider collider;
+    collider.body = body;
+    collider.shape = shape;
+    collider.class = "none";
+    collider.previousPosition = cpv(x, y);
+    collider.previousAngle = 0;
+
+    Handle colliderId = pool_add(&state.colliders, collider);
+    trackHandle(ctx, HANDLE_COLLIDER, colliderId);
+
+    cpBodySetUserData(body, (cpDataPointer)(uintptr_t)handleIndex(colliderId));
+
+    pushHandle(ctx, colliderId);
+
+    return 1;
+}
+
+duk_ret_t physicsNewRectangleCollider(duk_context *ctx)
+{
+    int x = duk_require_number(ctx, 0);
+    int y = duk_require_number(ctx, 1);
+    int width = duk_require_number(ctx, 2);
+    int height = duk_require_number(ctx, 3);
+
+    cpFloat mass = 1;
+    cpFloat moment = cpMomentForBox(mass, width, height);
+
+    cpBody *body = cpSpaceAddBody(state.space, cpBodyNew(mass, moment));
+    cpBodySetPosition(body, cpv(x, y));
+
+    cpShape *shape = cpSpaceAddShape(state.space, cpBoxShapeNew(body, width, height, 0));
+
+    Collider collider;
+    collider.body = body;
+    collider.shape = shape;
+    collider.previousPosition = cpv(x, y);
+    collider.previousAngle = 0;
+
+    Handle colliderId = pool_add(&state.colliders, collider);
+    trackHandle(ctx, HANDLE_COLLIDER, colliderId);
+
+    cpBodySetUserData(body, (cpDataPointer)(uintptr_t)handleIndex(colliderId));
+
+    pushHandle(ctx, colliderId);
+
+    return 1;
+}
+
+bool releaseCollider(Handle colliderId)
+{
+    Collider *collider = pool_get(&state.colliders, colliderId);
+
+    if (collider == NULL)
+        return false;
+
+    cpSpaceRemoveShape(state.space, collider->shape);
+    cpSpaceRemoveBody(state.space, collider->body);
+    cpShapeFree(collider->shape);
+    cpBodyFree(collider->body);
+
+    pool_remove(&state.colliders, colliderId);
+
+    return true;
+}
+
+duk_ret_t physicsReleaseCollider(duk_context *ctx)
+{
+    if (!releaseCollider(requireHandle(ctx, 0)))
+        throwInvalidHandle(ctx);
+
+    return 0;
+}
+
+duk_ret_t physicsGetX(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    cpVect pos = cpBodyGetPosition(collider.body);
+
+    duk_push_number(ctx, pos.x);
+
+    return 1;
+}
+
+duk_ret_t physicsGetY(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    cpVect pos = cpBodyGetPosition(collider.body);
+
+    duk_push_number(ctx, pos.y);
+
+    return 1;
+}
+
+duk_ret_t physicsGetType(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    cpBodyType type = cpBodyGetType(collider.body);
+
+    switch (type)
+    {
+    case CP_BODY_TYPE_STATIC:
+        duk_push_string(ctx, "static");
+        break;
+    case CP_BODY_TYPE_DYNAMIC:
+        duk_push_string(ctx, "dynamic");
+        break;
+    case CP_BODY_TYPE_KINEMATIC:
+        duk_push_string(ctx, "kinematic");
+        break;
+    }
+
+    return 1;
+}
+
+duk_ret_t physicsGetMass(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    cpFloat mass = cpBodyGetMass(collider.body);
+
+    duk_push_number(ctx, mass);
+
+    return 1;
+}
+
+duk_ret_t physicsGetFriction(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    cpFloat friction = cpShapeGetFriction(collider.shape);
+
+    duk_push_number(ctx, friction);
+
+    return 1;
+}
+
+duk_ret_t physicsSetType(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    const char *type = duk_require_string(ctx, 1);
+
+    if (strcmp("static", type) == 0)
+    {
+        cpBodySetType(collider.body, CP_BODY_TYPE_STATIC);
+    }
+    else if (strcmp("dynamic", type) == 0)
+    {
+        cpBodySetType(collider.body, CP_BODY_TYPE_DYNAMIC);
+    }
+    else if (strcmp("kinematic", type) == 0)
+    {
+        cpBodySetType(collider.body, CP_BODY_TYPE_KINEMATIC);
+    }
+
+    return 0;
+}
+
+duk_ret_t physicsSetX(duk_context *ctx)
+{
+    Collider *collider = requireCollider(ctx, 0);
+
+    int x = duk_require_number(ctx, 1);
+
+    cpVect pos = cpBodyGetPosition(collider->body);
+
+    cpBodySetPosition(collider->body, cpv(x, pos.y));
+
+    resetInterpolation(collider);
+
+    return 0;
+}
+
+duk_ret_t physicsSetY(duk_context *ctx)
+{
+    Collider *collider = requireCollider(ctx, 0);
+
+    int y = duk_require_number(ctx, 1);
+
+    cpVect pos = cpBodyGetPosition(collider->body);
+
+    cpBodySetPosition(collider->body, cpv(pos.x, y));
+
+    resetInterpolation(collider);
+
+    return 0;
+}
+
+duk_ret_t physicsSetMass(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    float mass = duk_require_number(ctx, 1);
+
+    cpBodySetMass(collider.body, mass);
+
+    return 0;
+}
+
+duk_ret_t physicsSetFriction(duk_context *ctx)
+{
+    Collider collider = *requireCollider(ctx, 0);
+
+    float friction = duk_require_number(ctx, 1);
+
+    cpShapeSetFriction(collider.shape, friction);
+
+    return 0;
+}
+
+float *requireTransforms(duk_context *ctx, duk_idx_t idx, int count)
+{
+    if (!isTypedArray(ctx, idx, "Float32Array"))
+    {
+        duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Transform buffers must be a Float32Array.");
+        duk_throw(ctx);
+    }
+
+    duk_size_t size;
+    float *transforms = duk_get_buffer_data(ctx, idx, &size);
+
+    if (size < sizeof(float) * TRANSFORM_STRIDE * count)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Transform buffer is too small.");
+        duk_throw(ctx);
+    }
+
+    return transforms;
+}
+
+duk_ret_t physicsReadTransforms(duk_context *ctx)
+{
+    HandleList colliders = requireHandleList(ctx, 0);
+    float *transforms = requireTransforms(ctx, 1, colliders.length);
+    bool interpolate = duk_get_boolean_default(ctx, 2, false);
+
+    double alpha = interpolate ? physicsInterpolation() : 1;
+
+    for (int i = 0; i < colliders.length; i++)
+    {
+        Collider *collider = pool_get(&state.colliders, handleListGet(ctx, &colliders, i));
+
+        if (collider == NULL)
+            throwInvalidHandle(ctx);
+
+        cpVect pos = cpvlerp(collider->previousPosition, cpBodyGetPosition(collider->body), alpha);
+        cpFloat angle = cpflerp(collider->previousAngle, cpBodyGetAngle(collider->body), alpha);
+        cpVect vel = cpBodyGetVelocity(collider->body);
+
+        float *transform = &transforms[i * TRANSFORM_STRIDE];
+        transform[0] = pos.x;
+        transform[1] = pos.y;
+        transform[2] = angle * RAD2DEG;
+        transform[3] = vel.x;
+        transform[4] = vel.y;
+    }
+
+    duk_push_int(ctx, colliders.length);
+
+    return 1;
+}
+
+duk_ret_t physicsWriteTransforms(duk_context *ctx)
+{
+    HandleList colliders = requireHandleList(ctx, 0);
+    float *transforms = requireTransforms(ctx, 1, colliders.length);
+
+    for (int i = 0; i < colliders.length; i++)
+    {
+        Collider *collider = pool_get(&state.colliders, handleListGet(ctx, &colliders, i));
+
+        if (collider == NULL)
+            throwInvalidHandle(ctx);
+
+        float *transform = &transforms[i * TRANSFORM_STRIDE];
+
+        cpBodySetPosition(collider->body, cpv(transform[0], transform[1]));
+        cpBodySetAngle(collider->body, transform[2] * DEG2RAD);
+        cpBodySetVelocity(collider->body, cpv(transform[3], transform[4]));
+
+        resetInterpolation(collider);
+    }
+
+    return 0;
+}
+
+// Collisions of the current frame are kept in state.collisions, with an open
+// addressing table of indices into it so pairs are deduplicated and looked up
+// in constant time. Pairs are stored with idA < idB.
+
+uint64_t collisionHash(Handle a, Handle b)
+{
+    uint64_t hash = a * 0x9E3779B97F4A7C15ull ^ b;
+    hash ^= hash >> 31;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 29;
+
+    return hash;
+}
+
+int findCollisionSlot(Handle a, Handle b)
+{
+    int mask = state.collisionTableSize - 1;
+    int slot = collisionHash(a, b) & mask;
+
+    while (state.collisionTable[slot] >= 0)
+    {
+        Collision collision = state.collisions.data[state.collisionTable[slot]];
+
+        if (collision.idA == a && collision.idB == b)
+            break;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void growCollisionTable()
+{
+    state.collisionTableSize = state.collisionTableSize == 0 ? 64 : state.collisionTableSize * 2;
+    state.collisionTable = realloc(state.collisionTable, sizeof(int) * state.collisionTableSize);
+    memset(state.collisionTable, -1, sizeof(int) * state.collisionTableSize);
+
+    int i; Collision val;
+    vec_foreach(&state.collisions, val, i) {
+        state.collisionTable[findCollisionSlot(val.idA, val.idB)] = i;
+    }
+}
+
+void addCollision(Handle a, Handle b)
+{
+    Collision collision;
+    collision.idA = a < b ? a : b;
+    collision.idB = a < b ? b : a;
+
+    if ((state.collisions.length + 1) * 2 > state.collisionTableSize)
+        growCollisionTable();
+
+    int slot = findCollisionSlot(collision.idA, collision.idB);
+
+    if (state.collisionTable[slot] >= 0)
+        return;
+
+    state.collisionTable[slot] = state.collisions.length;
+
+    vec_push(&state.collisions, collision);
+}
+
+bool hasCollision(Handle a, Handle b)
+{
+    if (state.collisionTableSize == 0)
+        return false;
+
+    return state.collisionTable[findCollisionSlot(a < b ? a : b, a < b ? b : a)] >= 0;
+}
+
+duk_ret_t physicsIsColliding(duk_context *ctx)
+{
+    Handle colliderIdA = requireHandle(ctx, 0);
+    Handle colliderIdB = requireHandle(ctx, 1);
+
+    bool colliding = hasCollision(colliderIdA, colliderIdB);
+
+    duk_push_boolean(ctx, colliding);
+
+    return 1;
+}
+
+duk_ret_t physicsGetContacts(duk_context *ctx)
+{
+    Handle colliderId = requireHandle(ctx, 0);
+
+    int count = 0;
+
+    int i; Collision val;
+    vec_foreach(&state.collisions, val, i) {
+        if (val.idA == colliderId || val.idB == colliderId)
+            count++;
+    }
+
+    double *contacts = pushHandleArray(ctx, count);
+
+    count = 0;
+
+    vec_foreach(&state.collisions, val, i) {
+        if (val.idA == colliderId)
+            contacts[count++] = val.idB;
+        else if (val.idB == colliderId)
+            contacts[count++] = val.idA;
+    }
+
+    return 1;
+}
+
+duk_ret_t physicsGetCollisions(duk_context *ctx)
+{
+    double *pairs = pushHandleArray(ctx, state.collisions.length * 2);
+
+    int i; Collision val;
+    vec_foreach(&state.collisions, val, i) {
+        pairs[i * 2] = val.idA;
+        pairs[i * 2 + 1] = val.idB;
+    }
+
+    return 1;
+}
+
+Handle colliderHandle(cpBody *body)
+{
+    return pool_handle(&state.colliders, (uintptr_t)cpBodyGetUserData(body));
+}
+
+void collision(cpArbiter *arb, cpSpace *space, cpDataPointer data)
+{
+    cpBody *a;
+    cpBody *b;
+
+    cpArbiterGetBodies(arb, &a, &b);
+
+    addCollision(colliderHandle(a), colliderHandle(b));
+}
+
+// A single threaded space uses cpSpace, more threads use chipmunk's hasty
+// space, whose solver runs on worker threads. Shapes are indexed by a bounding
+// box tree unless a spatial hash cell size is set. Changing either moves every
+// collider and the space settings over to a newly created space.
+
+cpSpace *createSpace(int threads)
+{
+    cpSpace *space;
+
+    if (threads > 1)
+    {
+        space = cpHastySpaceNew();
+        cpHastySpaceSetThreads(space, threads);
+    }
+    else
+    {
+        space = cpSpaceNew();
+    }
+
+    if (state.spatialHashCellSize > 0)
+        cpSpaceUseSpatialHash(space, state.spatialHashCellSize, state.spatialHashCount);
+
+    cpCollisionHandler *handler = cpSpaceAddCollisionHandler(space, 0, 0);
+    handler->postSolveFunc = (cpCollisionPostSolveFunc)collision;
+
+    return space;
+}
+
+void freeSpace(cpSpace *space, int threads)
+{
+    if (threads > 1)
+        cpHastySpaceFree(space);
+    else
+        cpSpaceFree(space);
+}
+
+void replaceSpace(int threads)
+{
+    cpSpace *space = createSpace(threads);
+
+    cpSpaceSetGravity(space, cpSpaceGetGravity(state.space));
+    cpSpaceSetIterations(space, cpSpaceGetIterations(state.space));
+    cpSpaceSetDamping(space, cpSpaceGetDamping(state.space));
+    cpSpaceSetIdleSpeedThreshold(space, cpSpaceGetIdleSpeedThreshold(state.space));
+    cpSpaceSetSleepTimeThreshold(space, cpSpaceGetSleepTimeThreshold(state.space));
+    cpSpaceSetCollisionSlop(space, cpSpaceGetCollisionSlop(state.space));
+    cpSpaceSetCollisionBias(space, cpSpaceGetCollisionBias(state.space));
+    cpSpaceSetCollisionPersistence(space, cpSpaceGetCollisionPersistence(state.space));
+
+    int i;
+    pool_foreach(&state.colliders, i) {
+        Collider collider = state.colliders.items.data[i];
+
+        cpSpaceRemoveShape(state.space, collider.shape);
+        cpSpaceRemoveBody(state.space, collider.body);
+
+        cpSpaceAddBody(space, collider.body);
+        cpSpaceAddShape(space, collider.shape);
+    }
+
+    freeSpace(state.space, state.physicsThreads);
+
+    state.space = space;
+    state.physicsThreads = threads;
+}
+
+duk_ret_t physicsSetThreads(duk_context *ctx)
+{
+    int threads = duk_require_int(ctx, 0);
+
+    if (threads < 1)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Thread count must be at least 1.");
+        duk_throw(ctx);
+    }
+
+    replaceSpace(threads);
+
+    return 0;
+}
+
+duk_ret_t physicsGetThreads(duk_context *ctx)
+{
+    int threads = 1;
+
+    if (state.physicsThreads > 1)
+        threads = cpHastySpaceGetThreads(state.space);
+
+    duk_push_number(ctx, threads);
+
+    return 1;
+}
+
+duk_ret_t physicsSetIterations(duk_context *ctx)
+{
+    int iterations = duk_require_int(ctx, 0);
+
+    if (iterations < 1)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Iteration count must be at least 1.");
+        duk_throw(ctx);
+    }
+
+    cpSpaceSetIterations(state.space, iterations);
+
+    return 0;
+}
+
+duk_ret_t physicsGetIterations(duk_context *ctx)
+{
+    int iterations = cpSpaceGetIterations(state.space);
+
+    duk_push_number(ctx, iterations);
+
+    return 1;
+}
+
+duk_ret_t physicsSetSpatialIndex(duk_context *ctx)
+{
+    const char *index = duk_require_string(ctx, 0);
+
+    if (strcmp("bbtree", index) == 0)
+    {
+        state.spatialHashCellSize = 0;
+    }
+    else if (strcmp("hash", index) == 0)
+    {
+        double cellSize = duk_require_number(ctx, 1);
+        int count = duk_get_int_default(ctx, 2, 1000);
+
+        if (cellSize <= 0 || count < 1)
+        {
+            duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Invalid spatial hash cell size or count.");
+            duk_throw(ctx);
+        }
+
+        state.spatialHashCellSize = cellSize;
+        state.spatialHashCount = count;
+    }
+    else
+    {
+        duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Spatial index must be \"bbtree\" or \"hash\".");
+        duk_throw(ctx);
+    }
+
+    replaceSpace(state.physicsThreads);
+
+    return 0;
+}
+
+// Queries go through the space's spatial index and return the matching
+// colliders as a Float64Array of handles.
+
+void pushQueryResults(duk_context *ctx)
+{
+    double *colliders = pushHandleArray(ctx, state.queryResults.length);
+
+    memcpy(colliders, state.queryResults.data, sizeof(double) * state.queryResults.length);
+}
+
+void pointQueryResult(cpShape *shape, cpVect point, cpFloat distance, cpVect gradient, void *data)
+{
+    vec_push(&state.queryResults, colliderHandle(cpShapeGetBody(shape)));
+}
+
+void shapeQueryResult(cpShape *shape, cpContactPointSet *points, void *data)
+{
+    vec_push(&state.queryResults, colliderHandle(cpShapeGetBody(shape)));
+}
+
+void segmentQueryResult(cpShape *shape, cpVect point, cpVect normal, cpFloat alpha, void *data)
+{
+    RaycastHit hit;
+    hit.collider = colliderHandle(cpShapeGetBody(shape));
+    hit.point = point;
+    hit.normal = normal;
+    hit.alpha = alpha;
+
+    vec_push(&state.raycastHits, hit);
+}
+
+int compareRaycastHits(const void *a, const void *b)
+{
+    const RaycastHit *hitA = a;
+    const RaycastHit *hitB = b;
+
+    return (hitA->alpha > hitB->alpha) - (hitA->alpha < hitB->alpha);
+}
+
+duk_ret_t physicsQueryPoint(duk_context *ctx)
+{
+    float x = duk_require_number(ctx, 0);
+    float y = duk_require_number(ctx, 1);
+
+    vec_clear(&state.queryResults);
+
+    cpSpacePointQuery(state.space, cpv(x, y), 0, CP_SHAPE_FILTER_ALL, pointQueryResult, NULL);
+
+    pushQueryResults(ctx);
+
+    return 1;
+}
+
+duk_ret_t physicsQueryRect(duk_context *ctx)
+{
+    float x = duk_require_number(ctx, 0);
+    float y = duk_require_number(ctx, 1);
+    float width = duk_require_number(ctx, 2);
+    float height = duk_require_number(ctx, 3);
+
+    vec_clear(&state.queryResults);
+
+    // The bounding box query only compares bounding boxes, so the rectangle
+    // is collided against the candidates as a box shape instead.
+
+    cpShape *box = cpBoxShapeNew2(cpSpaceGetStaticBody(state.space), cpBBNew(x, y, x + width, y + height), 0);
+    cpSpaceShapeQuery(state.space, box, shapeQueryResult, NULL);
+    cpShapeFree(box);
+
+    pushQueryResults(ctx);
+
+    return 1;
+}
+
+duk_ret_t physicsQueryCircle(duk_context *ctx)
+{
+    float x = duk_require_number(ctx, 0);
+    float y = duk_require_number(ctx, 1);
+    float radius = duk_require_number(ctx, 2);
+
+    vec_clear(&state.queryResults);
+
+    cpSpacePointQuery(state.space, cpv(x, y), radius, CP_SHAPE_FILTER_ALL, pointQueryResult, NULL);
+
+    pushQueryResults(ctx);
+
+    return 1;
+}
+
+duk_ret_t physicsRaycast(duk_context *ctx)
+{
+    float x1 = duk_require_number(ctx, 0);
+    float y1 = duk_require_number(ctx, 1);
+    float x2 = duk_require_number(ctx, 2);
+    float y2 = duk_require_number(ctx, 3);
+    float radius = duk_get_number_default(ctx, 4, 0);
+
+    vec_clear(&state.raycastHits);
+
+    cpSpaceSegmentQuery(state.space, cpv(x1, y1), cpv(x2, y2), radius, CP_SHAPE_FILTER_ALL, segmentQueryResult, NULL);
+
+    vec_sort(&state.raycastHits, compareRaycastHits);
+
+    double *hits = pushHandleArray(ctx, state.raycastHits.length * RAYCAST_STRIDE);
+
+    int i; RaycastHit val;
+    vec_foreach(&state.raycastHits, val, i) {
+        double *hit = &hits[i * RAYCAST_STRIDE];
+        hit[0] = val.collider;
+        hit[1] = val.point.x;
+        hit[2] = val.point.y;
+        hit[3] = val.normal.x;
+        hit[4] = val.normal.y;
+        hit[5] = val.alpha;
+    }
+
+    return 1;
+}
+
+void registerPhysicsFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "physics");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsNewCircleCollider, 3);
+    duk_put_prop_string(ctx, -2, "newCircleCollider");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsNewRectangleCollider, 4);
+    duk_put_prop_string(ctx, -2, "newRectangleCollider");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsReleaseCollider, 1);
+    duk_put_prop_string(ctx, -2, "releaseCollider");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetX, 1);
+    duk_put_prop_string(ctx, -2, "getX");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetY, 1);
+    duk_put_prop_string(ctx, -2, "getY");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetType, 1);
+    duk_put_prop_string(ctx, -2, "getType");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetType, 2);
+    duk_put_prop_string(ctx, -2, "setType");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetX, 2);
+    duk_put_prop_string(ctx, -2, "setX");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetY, 2);
+    duk_put_prop_string(ctx, -2, "setY");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetMass, 1);
+    duk_put_prop_string(ctx, -2, "getMass");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetMass, 2);
+    duk_put_prop_string(ctx, -2, "setMass");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetFriction, 1);
+    duk_put_prop_string(ctx, -2, "getFriction");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetFriction, 2);
+    duk_put_prop_string(ctx, -2, "setFriction");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsIsColliding, 2);
+    duk_put_prop_string(ctx, -2, "isColliding");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetTimestep, 2);
+    duk_put_prop_string(ctx, -2, "setTimestep");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetTimestep, 0);
+    duk_put_prop_string(ctx, -2, "getTimestep");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetInterpolation, 0);
+    duk_put_prop_string(ctx, -2, "getInterpolation");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetThreads, 1);
+    duk_put_prop_string(ctx, -2, "setThreads");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetThreads, 0);
+    duk_put_prop_string(ctx, -2, "getThreads");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetIterations, 1);
+    duk_put_prop_string(ctx, -2, "setIterations");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetIterations, 0);
+    duk_put_prop_string(ctx, -2, "getIterations");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsSetSpatialIndex, 3);
+    duk_put_prop_string(ctx, -2, "setSpatialIndex");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsQueryPoint, 2);
+    duk_put_prop_string(ctx, -2, "queryPoint");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsQueryRect, 4);
+    duk_put_prop_string(ctx, -2, "queryRect");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsQueryCircle, 3);
+    duk_put_prop_string(ctx, -2, "queryCircle");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsRaycast, 5);
+    duk_put_prop_string(ctx, -2, "raycast");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetContacts, 1);
+    duk_put_prop_string(ctx, -2, "getContacts");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsGetCollisions, 0);
+    duk_put_prop_string(ctx, -2, "getCollisions");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsReadTransforms, 3);
+    duk_put_prop_string(ctx, -2, "readTransforms");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "physics");
+    duk_push_c_function(ctx, physicsWriteTransforms, 2);
+    duk_put_prop_string(ctx, -2, "writeTransforms");
+    duk_pop_2(ctx);
+}
+
+duk_ret_t profilerSetEnabled(duk_context *ctx)
+{
+    bool enabled = duk_require_boolean(ctx, 0);
+
+    if (enabled && state.zoneEvents == NULL)
+        state.zoneEvents = malloc(sizeof(ZoneEvent) * ZONE_EVENTS);
+
+    state.profiling = enabled;
+    updateTrampolines(ctx);
+
+    return 0;
+}
+
+duk_ret_t profilerIsEnabled(duk_context *ctx)
+{
+    duk_push_boolean(ctx, state.profiling);
+
+    return 1;
+}
+
+duk_ret_t profilerGetZone(duk_context *ctx)
+{
+    const char *name = duk_require_string(ctx, 0);
+
+    duk_push_int(ctx, internZone(name));
+
+    return 1;
+}
+
+// Zones can be named or given the id of an interned name, which skips the
+// lookup of the name.
+
+duk_ret_t profilerBegin(duk_context *ctx)
+{
+    int zone;
+
+    if (duk_is_number(ctx, 0))
+    {
+        zone = duk_get_int(ctx, 0);
+
+        if (zone < 0 || zone >= state.zoneNames.length)
+        {
+            duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Invalid profiler zone.");
+            duk_throw(ctx);
+        }
+    }
+    else
+    {
+        zone = internZone(duk_require_string(ctx, 0));
+    }
+
+    if (state.openZoneCount == ZONE_DEPTH)
+    {
+        duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "Too many nested profiler zones.");
+        duk_throw(ctx);
+    }
+
+    ZoneEvent *open = &state.openZones[state.openZoneCount++];
+    open->zone = zone;
+    open->start = monotonicTime();
+
+    return 0;
+}
+
+duk_ret_t profilerEnd(duk_context *ctx)
+{
+    if (state.openZoneCount == 0)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "No profiler zone to end.");
+        duk_throw(ctx);
+    }
+
+    state.openZoneCount--;
+    profileZone(state.openZones[state.openZoneCount].zone, state.openZones[state.openZoneCount].start);
+
+    return 0;
+}
+
+duk_ret_t profilerSetNativeStats(duk_context *ctx)
+{
+    bool enabled = duk_require_boolean(ctx, 0);
+
+    if (enabled && !state.nativeStats)
+        resetNativeStats();
+
+    state.nativeStats = enabled;
+    updateTrampolines(ctx);
+
+    return 0;
+}
+
+duk_ret_t profilerIsNativeStats(duk_context *ctx)
+{
+    duk_push_boolean(ctx, state.nativeStats);
+
+    return 1;
+}
+
+duk_ret_t profilerResetNativeStats(duk_context *ctx)
+{
+    resetNativeStats();
+
+    return 0;
+}
+
+// Returns the natives that were called, the most expensive first, with times
+// in milliseconds.
+
+duk_ret_t profilerGetNativeStats(duk_context *ctx)
+{
+    int *order = malloc(sizeof(int) * (state.natives.length + 1));
+    int count = 0;
+
+    for (int i = 0; i < state.natives.length; i++)
+    {
+        if (state.natives.data[i].calls > 0)
+            order[count++] = i;
+    }
+
+    qsort(order, count, sizeof(int), compareNativeTimes);
+
+    duk_push_array(ctx);
+
+    for (int i = 0; i < count; i++)
+    {
+        Native *native = &state.natives.data[order[i]];
+
+        duk_push_object(ctx);
+
+        duk_push_string(ctx, native->name);
+        duk_put_prop_string(ctx, -2, "name");
+
+        duk_push_int(ctx, native->calls);
+        duk_put_prop_string(ctx, -2, "calls");
+
+        duk_push_number(ctx, native->time * 1000);
+        duk_put_prop_string(ctx, -2, "time");
+
+        duk_push_number(ctx, native->time * 1000 / native->calls);
+        duk_put_prop_string(ctx, -2, "timePerCall");
+
+        duk_push_number(ctx, state.nativeStatFrames > 0 ? (double)native->calls / state.nativeStatFrames : native->calls);
+        duk_put_prop_string(ctx, -2, "callsPerFrame");
+
+        duk_push_int(ctx, native->lastFrameCalls);
+        duk_put_prop_string(ctx, -2, "lastFrameCalls");
+
+        duk_push_int(ctx, native->handleLookups);
+        duk_put_prop_string(ctx, -2, "handleLookups");
+
+        duk_push_int(ctx, native->stringArguments);
+        duk_put_prop_string(ctx, -2, "stringArguments");
+
+        duk_put_prop_index(ctx, -2, i);
+    }
+
+    free(order);
+
+    return 1;
+}
+
+duk_ret_t profilerClear(duk_context *ctx)
+{
+    state.zoneHead = 0;
+    state.zoneCount = 0;
+
+    return 0;
+}
+
+duk_ret_t profilerGetTrace(duk_context *ctx)
+{
+    sds trace = traceJson();
+
+    duk_push_lstring(ctx, trace, sdslen(trace));
+
+    sdsfree(trace);
+
+    return 1;
+}
+
+duk_ret_t profilerSaveTrace(duk_context *ctx)
+{
+    const char *filename = duk_require_string(ctx, 0);
+
+    sds path = sdsempty();
+    path = sdscatprintf(path, "%s/%s", state.baseDir, filename);
+
+    sds trace = traceJson();
+
+    bool saved = SaveFileText(path, trace);
+
+    sdsfree(trace);
+    sdsfree(path);
+
+    if (!saved)
+    {
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not save trace.");
+        duk_throw(ctx);
+    }
+
+    return 0;
+}
+
+void registerProfilerFunctions(duk_context *ctx)
+{
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsDraw, 5);
-    duk_put_prop_string(ctx, -2, "draw");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "profiler");
+    duk_pop(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerSetEnabled, 1);
+    duk_put_prop_string(ctx, -2, "setEnabled");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerIsEnabled, 0);
+    duk_put_prop_string(ctx, -2, "isEnabled");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerGetZone, 1);
+    duk_put_prop_string(ctx, -2, "getZone");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerBegin, 1);
+    duk_put_prop_string(ctx, -2, "begin");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerEnd, 0);
+    duk_put_prop_string(ctx, -2, "end");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerClear, 0);
+    duk_put_prop_string(ctx, -2, "clear");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerGetTrace, 0);
+    duk_put_prop_string(ctx, -2, "getTrace");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerSaveTrace, 1);
+    duk_put_prop_string(ctx, -2, "saveTrace");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerSetNativeStats, 1);
+    duk_put_prop_string(ctx, -2, "setNativeStats");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerIsNativeStats, 0);
+    duk_put_prop_string(ctx, -2, "isNativeStats");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerResetNativeStats, 0);
+    duk_put_prop_string(ctx, -2, "resetNativeStats");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "profiler");
+    duk_push_c_function(ctx, profilerGetNativeStats, 0);
+    duk_put_prop_string(ctx, -2, "getNativeStats");
+    duk_pop_2(ctx);
+}
+
+// LIFETIMES
+
+bool releaseHandle(HandleType type, Handle handle)
+{
+    switch (type)
+    {
+    case HANDLE_IMAGE:
+        return releaseImage(handle);
+    case HANDLE_FONT:
+        return releaseFont(handle);
+    case HANDLE_SOURCE:
+        return releaseSource(handle);
+    case HANDLE_COLLIDER:
+        return releaseCollider(handle);
+    case HANDLE_SPRITE_BATCH:
+        return releaseSpriteBatch(handle);
+    case HANDLE_HOST:
+        return releaseHost(handle);
+    case HANDLE_PEER:
+        return releasePeerHandle(handle);
+    case HANDLE_TYPES:
+        break;
+    }
+
+    return false;
+}
+
+slot_vec_t *handleSlots(HandleType type)
+{
+    switch (type)
+    {
+    case HANDLE_IMAGE:
+        return &state.images.slots;
+    case HANDLE_FONT:
+        return &state.fonts.slots;
+    case HANDLE_SOURCE:
+        return &state.sounds.slots;
+    case HANDLE_COLLIDER:
+        return &state.colliders.slots;
+    case HANDLE_SPRITE_BATCH:
+        return &state.batches.slots;
+    case HANDLE_HOST:
+        return &state.hosts.slots;
+    case HANDLE_PEER:
+        return &state.peers.slots;
+    case HANDLE_TYPES:
+        break;
+    }
+
+    return NULL;
+}
+
+// Prints the handles still alive, grouped by type and creation site.
+
+void reportLeaks()
+{
+    int *counts = calloc(state.siteNames.length + 1, sizeof(int));
+
+    for (int type = 0; type < HANDLE_TYPES; type++)
+    {
+        slot_vec_t *slots = handleSlots(type);
+        vec_int_t *sites = &state.handleSites[type];
+
+        memset(counts, 0, sizeof(int) * (state.siteNames.length + 1));
+
+        for (int i = 0; i < slots->length; i++)
+        {
+            if (!slots->data[i].alive)
+                continue;
+
+            int site = i < sites->length ? sites->data[i] : -1;
+
+            counts[site + 1]++;
+        }
+
+        for (int site = -1; site < state.siteNames.length; site++)
+        {
+            if (counts[site + 1] == 0)
+                continue;
+
+            fprintf(stderr, "Leaked %d %s handle%s created at %s\n", counts[site + 1], handleTypeNames[type],
+                counts[site + 1] == 1 ? "" : "s", site >= 0 ? state.siteNames.data[site] : "unknown");
+        }
+    }
+
+    free(counts);
+}
+
+// Releases every handle that is still alive, peers before their hosts.
+
+void releaseAll()
+{
+    for (int type = HANDLE_TYPES - 1; type >= 0; type--)
+    {
+        slot_vec_t *slots = handleSlots(type);
+
+        for (int i = 0; i < slots->length; i++)
+        {
+            if (slots->data[i].alive)
+                releaseHandle(type, poolHandle_(slots, i));
+        }
+    }
+}
+
+// Objects passed to releaseWith get a finalizer that releases the handles
+// tied to them, stored as [type, handle] pairs in a hidden array.
+
+duk_ret_t releaseFinalizer(duk_context *ctx)
+{
+    if (!duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("releases")))
+        return 0;
+
+    int length = duk_get_length(ctx, -1);
+
+    for (int i = 0; i + 1 < length; i += 2)
+    {
+        duk_get_prop_index(ctx, -1, i);
+        duk_get_prop_index(ctx, -2, i + 1);
+
+        HandleType type = duk_get_int(ctx, -2);
+        Handle handle = requireHandle(ctx, -1);
+
+        releaseHandle(type, handle);
+
+        duk_pop_2(ctx);
+    }
+
+    return 0;
+}
+
+duk_ret_t systemReleaseWith(duk_context *ctx)
+{
+    duk_require_object(ctx, 0);
+    const char *typeName = duk_require_string(ctx, 1);
+    Handle handle = requireHandle(ctx, 2);
+
+    int type = 0;
+
+    while (type < HANDLE_TYPES && strcmp(handleTypeNames[type], typeName) != 0)
+        type++;
+
+    if (type == HANDLE_TYPES)
+    {
+        duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Invalid handle type.");
+        duk_throw(ctx);
+    }
+
+    if (!duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("releases")))
+    {
+        duk_pop(ctx);
+        duk_push_array(ctx);
+        duk_dup_top(ctx);
+        duk_put_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("releases"));
+
+        duk_push_c_function(ctx, releaseFinalizer, 1);
+        duk_set_finalizer(ctx, 0);
+    }
+
+    int length = duk_get_length(ctx, -1);
+
+    duk_push_int(ctx, type);
+    duk_put_prop_index(ctx, -2, length);
+    pushHandle(ctx, handle);
+    duk_put_prop_index(ctx, -2, length + 1);
+
+    return 0;
+}
+
+duk_ret_t systemGetClipboardText(duk_context *ctx)
+{
+    const char *text = GetClipboardText();
+
+    duk_push_string(ctx, text);
+
+    return 1;
+}
+
+duk_ret_t systemGetOS(duk_context *ctx)
+{
+    char *os;
+
+    #ifdef _WIN32
+        os = "Windows";
+    #elif _WIN64
+        os = "Windows";
+    #elif __APPLE__ || __MACH__
+        os = "OS X";
+    #elif __linux__
+        os = "Linux";
+    #elif __FreeBSD__
+        os = "FreeBSD";
+    #else
+        os = "Other";
+    #endif
+
+    duk_push_string(ctx, os);
+
+    return 1;
+}
+
+duk_ret_t systemIsHeadless(duk_context *ctx)
+{
+    bool headless = state.headless;
+
+    duk_push_boolean(ctx, headless);
+
+    return 1;
+}
+
+duk_ret_t systemSetUploadBudget(duk_context *ctx)
+{
+    int bytes = duk_require_int(ctx, 0);
+
+    state.uploadBudget = bytes;
+
+    return 0;
+}
+
+duk_ret_t systemGetUploadBudget(duk_context *ctx)
+{
+    int bytes = state.uploadBudget;
+
+    duk_push_int(ctx, bytes);
+
+    return 1;
+}
+
+duk_ret_t systemSetCacheMode(duk_context *ctx)
+{
+    const char *mode = duk_require_string(ctx, 0);
+
+    if (strcmp(mode, "none") == 0)
+    {
+        state.cacheMode = CACHE_NONE;
+    }
+    else if (strcmp(mode, "path") == 0)
+    {
+        state.cacheMode = CACHE_PATH;
+    }
+    else if (strcmp(mode, "content") == 0)
+    {
+        state.cacheMode = CACHE_CONTENT;
+    }
+    else
+    {
+        duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Invalid cache mode.");
+        duk_throw(ctx);
+    }
+
+    return 0;
+}
+
+duk_ret_t systemGetCacheStats(duk_context *ctx)
+{
+    int entries = 0;
+    double bytes = 0;
+
+    const char *key;
+    map_iter_t iter = map_iter(&state.cache);
+
+    while ((key = map_next(&state.cache, &iter)))
+    {
+        entries++;
+        bytes += map_get(&state.cache, key)->bytes;
+    }
+
+    duk_idx_t stats = duk_push_object(ctx);
+
+    duk_push_int(ctx, state.cacheHits);
+    duk_put_prop_string(ctx, stats, "hits");
+    duk_push_int(ctx, state.cacheMisses);
+    duk_put_prop_string(ctx, stats, "misses");
+    duk_push_int(ctx, entries);
+    duk_put_prop_string(ctx, stats, "entries");
+    duk_push_number(ctx, bytes);
+    duk_put_prop_string(ctx, stats, "bytes");
+
+    return 1;
+}
+
+void pushGCStats(duk_context *ctx)
+{
+    duk_idx_t stats = duk_push_object(ctx);
+
+    duk_push_string(ctx, state.gcMode == GC_FRAME ? "frame" : "manual");
+    duk_put_prop_string(ctx, stats, "mode");
+    duk_push_number(ctx, state.gcThreshold);
+    duk_put_prop_string(ctx, stats, "threshold");
+    duk_push_boolean(ctx, state.gcCompact);
+    duk_put_prop_string(ctx, stats, "compact");
+    duk_push_number(ctx, state.heapSize);
+    duk_put_prop_string(ctx, stats, "heapSize");
+    duk_push_number(ctx, state.heapAllocated);
+    duk_put_prop_string(ctx, stats, "allocated");
+    duk_push_int(ctx, state.gcCollections);
+    duk_put_prop_string(ctx, stats, "collections");
+    duk_push_number(ctx, state.gcLastTime * 1000);
+    duk_put_prop_string(ctx, stats, "lastTime");
+    duk_push_number(ctx, state.gcTotalTime * 1000);
+    duk_put_prop_string(ctx, stats, "totalTime");
+}
+
+// Without options the heap is collected right away. Options change when the
+// engine collects: "frame" mode collects at the end of the frame once
+// threshold bytes were allocated, "manual" mode only when asked to.
+
+duk_ret_t systemGc(duk_context *ctx)
+{
+    if (duk_is_undefined(ctx, 0))
+    {
+        collectGarbage(ctx, 0);
+        pushGCStats(ctx);
+
+        return 1;
+    }
+
+    duk_require_object(ctx, 0);
+
+    if (duk_get_prop_string(ctx, 0, "mode"))
+    {
+        const char *mode = duk_require_string(ctx, -1);
+
+        if (strcmp(mode, "frame") == 0)
+        {
+            state.gcMode = GC_FRAME;
+        }
+        else if (strcmp(mode, "manual") == 0)
+        {
+            state.gcMode = GC_MANUAL;
+        }
+        else
+        {
+            duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Invalid GC mode.");
+            duk_throw(ctx);
+        }
+    }
+
     duk_pop(ctx);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsEllipse, 5);
-    duk_put_prop_string(ctx, -2, "ellipse");
+    if (duk_get_prop_string(ctx, 0, "threshold"))
+    {
+        double threshold = duk_require_number(ctx, -1);
+
+        if (threshold < 0)
+        {
+            duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "GC threshold can't be negative.");
+            duk_throw(ctx);
+        }
+
+        state.gcThreshold = threshold;
+    }
+
     duk_pop(ctx);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsLine, 4);
-    duk_put_prop_string(ctx, -2, "line");
+    if (duk_get_prop_string(ctx, 0, "compact"))
+        state.gcCompact = duk_require_boolean(ctx, -1);
+
     duk_pop(ctx);
 
+    pushGCStats(ctx);
+
+    return 1;
+}
+
+duk_ret_t systemGetGCStats(duk_context *ctx)
+{
+    pushGCStats(ctx);
+
+    return 1;
+}
+
+// Fragmentation is the share of the memory reserved for the heap that holds
+// no live data, free pool blocks and block headers included.
+
+duk_ret_t systemGetMemoryStats(duk_context *ctx)
+{
+    size_t reserved = heapReserved();
+
+    duk_idx_t stats = duk_push_object(ctx);
+
+    duk_push_number(ctx, state.heapSize);
+    duk_put_prop_string(ctx, stats, "heapSize");
+    duk_push_number(ctx, state.heapPeak);
+    duk_put_prop_string(ctx, stats, "peak");
+    duk_push_number(ctx, reserved);
+    duk_put_prop_string(ctx, stats, "reserved");
+    duk_push_number(ctx, reserved > 0 ? 1 - (double)state.heapSize / reserved : 0);
+    duk_put_prop_string(ctx, stats, "fragmentation");
+    duk_push_int(ctx, state.heapSlabs.length);
+    duk_put_prop_string(ctx, stats, "slabs");
+
+    duk_push_array(ctx);
+
+    for (int i = 0; i < HEAP_CLASSES; i++)
+    {
+        HeapClass *heapClass = &state.heapClasses[i];
+
+        duk_push_object(ctx);
+
+        duk_push_int(ctx, heapClass->size);
+        duk_put_prop_string(ctx, -2, "size");
+        duk_push_int(ctx, heapClass->used);
+        duk_put_prop_string(ctx, -2, "blocks");
+        duk_push_int(ctx, heapClass->blocks - heapClass->used);
+        duk_put_prop_string(ctx, -2, "freeBlocks");
+        duk_push_number(ctx, heapClass->bytes);
+        duk_put_prop_string(ctx, -2, "bytes");
+
+        duk_put_prop_index(ctx, -2, i);
+    }
+
+    duk_put_prop_string(ctx, stats, "classes");
+
+    duk_push_object(ctx);
+
+    duk_push_int(ctx, state.largeBlocks);
+    duk_put_prop_string(ctx, -2, "blocks");
+    duk_push_number(ctx, state.largeBytes);
+    duk_put_prop_string(ctx, -2, "bytes");
+
+    duk_put_prop_string(ctx, stats, "large");
+
+    return 1;
+}
+
+duk_ret_t systemOpenURL(duk_context *ctx)
+{
+    const char *url = duk_require_string(ctx, 0);
+
+    OpenURL(url);
+
+    return 0;
+}
+
+duk_ret_t systemSetClipboardText(duk_context *ctx)
+{
+    const char *text = duk_require_string(ctx, 0);
+
+    SetClipboardText(text);
+
+    return 0;
+}
+
+void registerSystemFunctions(duk_context *ctx)
+{
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsPoint, 2);
-    duk_put_prop_string(ctx, -2, "point");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "system");
     duk_pop(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsPrint, 4);
-    duk_put_prop_string(ctx, -2, "print");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGetClipboardText, 0);
+    duk_put_prop_string(ctx, -2, "getClipboardText");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsRectangle, 5);
-    duk_put_prop_string(ctx, -2, "rectangle");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGetOS, 0);
+    duk_put_prop_string(ctx, -2, "getOS");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsTriangle, 7);
-    duk_put_prop_string(ctx, -2, "triangle");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemOpenURL, 1);
+    duk_put_prop_string(ctx, -2, "openURL");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsNewImage, 1);
-    duk_put_prop_string(ctx, -2, "newImage");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemSetClipboardText, 1);
+    duk_put_prop_string(ctx, -2, "setClipboardText");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemIsHeadless, 0);
+    duk_put_prop_string(ctx, -2, "isHeadless");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemSetUploadBudget, 1);
+    duk_put_prop_string(ctx, -2, "setUploadBudget");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGetUploadBudget, 0);
+    duk_put_prop_string(ctx, -2, "getUploadBudget");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemSetCacheMode, 1);
+    duk_put_prop_string(ctx, -2, "setCacheMode");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGetCacheStats, 0);
+    duk_put_prop_string(ctx, -2, "getCacheStats");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemReleaseWith, 3);
+    duk_put_prop_string(ctx, -2, "releaseWith");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGc, 1);
+    duk_put_prop_string(ctx, -2, "gc");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGetGCStats, 0);
+    duk_put_prop_string(ctx, -2, "getGCStats");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "system");
+    duk_push_c_function(ctx, systemGetMemoryStats, 0);
+    duk_put_prop_string(ctx, -2, "getMemoryStats");
+    duk_pop_2(ctx);
+}
+
+duk_ret_t timerGetDelta(duk_context *ctx)
+{
+    float delta = frameTime();
+
+    duk_push_number(ctx, delta);
+
+    return 1;
+}
+
+duk_ret_t timerGetFPS(duk_context *ctx)
+{
+    int fps;
+
+    if (state.headless)
+        fps = state.headlessDelta > 0 ? (int)round(1 / state.headlessDelta) : 0;
+    else
+        fps = GetFPS();
+
+    duk_push_number(ctx, fps);
+
+    return 1;
+}
+
+duk_ret_t timerGetTime(duk_context *ctx)
+{
+    double time = currentTime();
+
+    duk_push_number(ctx, time);
+
+    return 1;
+}
+
+// Returns the last count frames, oldest first, with every phase in
+// milliseconds.
+
+duk_ret_t timerGetProfile(duk_context *ctx)
+{
+    int count = state.profileCount;
+
+    if (!duk_is_undefined(ctx, 0))
+    {
+        count = duk_require_int(ctx, 0);
+
+        if (count < 0)
+            count = 0;
+
+        if (count > state.profileCount)
+            count = state.profileCount;
+    }
+
+    duk_push_array(ctx);
+
+    for (int i = 0; i < count; i++)
+    {
+        FrameProfile *frame = profileFrame(state.profileCount - count + i);
+
+        duk_push_object(ctx);
+
+        duk_push_number(ctx, frame->frame * 1000);
+        duk_put_prop_string(ctx, -2, "frame");
+
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            duk_push_number(ctx, frame->phases[phase] * 1000);
+            duk_put_prop_string(ctx, -2, phaseNames[phase]);
+        }
+
+        duk_push_int(ctx, frame->nativeCalls);
+        duk_put_prop_string(ctx, -2, "nativeCalls");
+
+        duk_put_prop_index(ctx, -2, i);
+    }
+
+    return 1;
+}
+
+duk_ret_t timerSetProfileOverlay(duk_context *ctx)
+{
+    state.profileOverlay = duk_require_boolean(ctx, 0);
+
+    return 0;
+}
+
+duk_ret_t timerIsProfileOverlay(duk_context *ctx)
+{
+    duk_push_boolean(ctx, state.profileOverlay);
+
+    return 1;
+}
+
+void registerTimerFunctions(duk_context *ctx)
+{
+    duk_get_global_string(ctx, "turtle");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "timer");
     duk_pop(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsNewFont, 1);
-    duk_put_prop_string(ctx, -2, "newFont");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "timer");
+    duk_push_c_function(ctx, timerGetDelta, 0);
+    duk_put_prop_string(ctx, -2, "getDelta");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "timer");
+    duk_push_c_function(ctx, timerGetFPS, 0);
+    duk_put_prop_string(ctx, -2, "getFPS");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsCaptureScreenshot, 1);
-    duk_put_prop_string(ctx, -2, "captureScreenshot");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "timer");
+    duk_push_c_function(ctx, timerGetTime, 0);
+    duk_put_prop_string(ctx, -2, "getTime");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsSetBackgroundColor, 4);
-    duk_put_prop_string(ctx, -2, "setBackgroundColor");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "timer");
+    duk_push_c_function(ctx, timerGetProfile, 1);
+    duk_put_prop_string(ctx, -2, "getProfile");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsSetColor, 4);
-    duk_put_prop_string(ctx, -2, "setColor");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "timer");
+    duk_push_c_function(ctx, timerSetProfileOverlay, 1);
+    duk_put_prop_string(ctx, -2, "setProfileOverlay");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "graphics");
-    duk_push_c_function(ctx, graphicsSetFont, 1);
-    duk_put_prop_string(ctx, -2, "setFont");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "timer");
+    duk_push_c_function(ctx, timerIsProfileOverlay, 0);
+    duk_put_prop_string(ctx, -2, "isProfileOverlay");
+    duk_pop_2(ctx);
 }
 
-duk_ret_t keyboardIsDown(duk_context *ctx)
+duk_ret_t windowClose(duk_context *ctx)
 {
-    const char *key = duk_require_string(ctx, 0);
+    state.close = 1;
 
-    bool down = IsKeyDown(*map_get(&state.keys, key));
+    return 0;
+}
 
-    duk_push_boolean(ctx, down);
+duk_ret_t windowGetDisplayWidth(duk_context *ctx)
+{
+    int displayWidth = GetMonitorWidth(GetCurrentMonitor());
+
+    duk_push_number(ctx, displayWidth);
 
     return 1;
 }
 
-duk_ret_t keyboardIsPressed(duk_context *ctx)
+duk_ret_t windowGetDisplayHeight(duk_context *ctx)
 {
-    const char *key = duk_require_string(ctx, 0);
+    int displayHeight = GetMonitorHeight(GetCurrentMonitor());
 
-    bool pressed = IsKeyPressed(*map_get(&state.keys, key));
+    duk_push_number(ctx, displayHeight);
 
-    duk_push_boolean(ctx, pressed);
+    return 1;
+}
+
+duk_ret_t windowGetWidth(duk_context *ctx)
+{
+    int width = GetScreenWidth();
+
+    duk_push_number(ctx, width);
 
     return 1;
 }
 
-duk_ret_t keyboardIsReleased(duk_context *ctx)
+duk_ret_t windowGetHeight(duk_context *ctx)
 {
-    const char *key = duk_require_string(ctx, 0);
+    int height = GetScreenHeight();
 
-    bool released = IsKeyReleased(*map_get(&state.keys, key));
+    duk_push_number(ctx, height);
 
-    duk_push_boolean(ctx, released);
+    return 1;
+}
+
+duk_ret_t windowGetDisplayName(duk_context *ctx)
+{
+    const char *displayName = GetMonitorName(GetCurrentMonitor());
+
+    duk_push_string(ctx, displayName);
 
     return 1;
 }
 
-void registerKeyboardFunctions(duk_context *ctx)
+duk_ret_t windowGetFullscreen(duk_context *ctx)
 {
-    map_set(&state.keys, "a", KEY_A);
-    map_set(&state.keys, "b", KEY_B);
-    map_set(&state.keys, "c", KEY_C);
-    map_set(&state.keys, "d", KEY_D);
-    map_set(&state.keys, "e", KEY_E);
-    map_set(&state.keys, "f", KEY_F);
-    map_set(&state.keys, "g", KEY_G);
-    map_set(&state.keys, "h", KEY_H);
-    map_set(&state.keys, "i", KEY_I);
-    map_set(&state.keys, "j", KEY_J);
-    map_set(&state.keys, "k", KEY_K);
-    map_set(&state.keys, "l", KEY_L);
-    map_set(&state.keys, "m", KEY_M);
-    map_set(&state.keys, "n", KEY_N);
-    map_set(&state.keys, "o", KEY_O);
-    map_set(&state.keys, "p", KEY_P);
-    map_set(&state.keys, "q", KEY_Q);
-    map_set(&state.keys, "r", KEY_R);
-    map_set(&state.keys, "s", KEY_S);
-    map_set(&state.keys, "t", KEY_T);
-    map_set(&state.keys, "u", KEY_U);
-    map_set(&state.keys, "v", KEY_V);
-    map_set(&state.keys, "w", KEY_W);
-    map_set(&state.keys, "x", KEY_X);
-    map_set(&state.keys, "y", KEY_Y);
-    map_set(&state.keys, "z", KEY_Z);
-    map_set(&state.keys, "0", KEY_ZERO);
-    map_set(&state.keys, "1", KEY_ONE);
-    map_set(&state.keys, "2", KEY_TWO);
-    map_set(&state.keys, "3", KEY_THREE);
-    map_set(&state.keys, "4", KEY_FOUR);
-    map_set(&state.keys, "5", KEY_FIVE);
-    map_set(&state.keys, "6", KEY_SIX);
-    map_set(&state.keys, "7", KEY_SEVEN);
-    map_set(&state.keys, "8", KEY_EIGHT);
-    map_set(&state.keys, "9", KEY_NINE);
-    map_set(&state.keys, "space", KEY_SPACE);
-    map_set(&state.keys, "up", KEY_UP);
-    map_set(&state.keys, "down", KEY_DOWN);
-    map_set(&state.keys, "left", KEY_LEFT);
-    map_set(&state.keys, "right", KEY_RIGHT);
-    map_set(&state.keys, "home", KEY_HOME);
-    map_set(&state.keys, "end", KEY_END);
-    map_set(&state.keys, "pageup", KEY_PAGE_UP);
-    map_set(&state.keys, "pagedown", KEY_PAGE_DOWN);
-    map_set(&state.keys, "insert", KEY_INSERT);
-    map_set(&state.keys, "backspace", KEY_BACKSPACE);
-    map_set(&state.keys, "tab", KEY_TAB);
-    map_set(&state.keys, "return", KEY_ENTER);
-    map_set(&state.keys, "delete", KEY_DELETE);
-    map_set(&state.keys, "f1", KEY_F1);
-    map_set(&state.keys, "f2", KEY_F2);
-    map_set(&state.keys, "f3", KEY_F3);
-    map_set(&state.keys, "f4", KEY_F4);
-    map_set(&state.keys, "f5", KEY_F5);
-    map_set(&state.keys, "f6", KEY_F6);
-    map_set(&state.keys, "f7", KEY_F7);
-    map_set(&state.keys, "f8", KEY_F8);
-    map_set(&state.keys, "f9", KEY_F9);
-    map_set(&state.keys, "f10", KEY_F10);
-    map_set(&state.keys, "f11", KEY_F11);
-    map_set(&state.keys, "f12", KEY_F12);
-    map_set(&state.keys, "numlock", KEY_NUM_LOCK);
-    map_set(&state.keys, "capslock", KEY_CAPS_LOCK);
-    map_set(&state.keys, "scolllock", KEY_SCROLL_LOCK);
-    map_set(&state.keys, "rshift", KEY_RIGHT_SHIFT);
-    map_set(&state.keys, "lshift", KEY_LEFT_SHIFT);
-    map_set(&state.keys, "rctrl", KEY_RIGHT_CONTROL);
-    map_set(&state.keys, "lctrl", KEY_LEFT_CONTROL);
-    map_set(&state.keys, "ralt", KEY_RIGHT_ALT);
-    map_set(&state.keys, "lalt", KEY_LEFT_ALT);
-    map_set(&state.keys, "lsuper", KEY_LEFT_SUPER);
-    map_set(&state.keys, "rsuper", KEY_RIGHT_SUPER);
-    map_set(&state.keys, "escape", KEY_ESCAPE);
+    bool fullscreen = IsWindowFullscreen();
 
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "keyboard");
+    duk_push_boolean(ctx, fullscreen);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "keyboard");
-    duk_push_c_function(ctx, keyboardIsDown, 1);
-    duk_put_prop_string(ctx, -2, "isDown");
-    duk_pop(ctx);
+    return 1;
+}
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "keyboard");
-    duk_push_c_function(ctx, keyboardIsPressed, 1);
-    duk_put_prop_string(ctx, -2, "isPressed");
-    duk_pop(ctx);
+duk_ret_t windowGetX(duk_context *ctx)
+{
+    Vector2 position = GetWindowPosition();
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "keyboard");
-    duk_push_c_function(ctx, keyboardIsReleased, 1);
-    duk_put_prop_string(ctx, -2, "isReleased");
-    duk_pop(ctx);
+    duk_push_number(ctx, position.x);
+
+    return 1;
 }
 
-duk_ret_t mathRandom(duk_context *ctx)
+duk_ret_t windowGetY(duk_context *ctx)
 {
-    int min = duk_require_number(ctx, 0);
-    int max = duk_require_number(ctx, 1);
+    Vector2 position = GetWindowPosition();
 
-    int random = GetRandomValue(min, max);
+    duk_push_number(ctx, position.y);
 
-    duk_push_number(ctx, random);
+    return 1;
+}
+
+duk_ret_t windowGetTitle(duk_context *ctx)
+{
+    char *title = state.title;
+
+    duk_push_string(ctx, title);
 
     return 1;
 }
 
-duk_ret_t mathSetRandomSeed(duk_context *ctx)
+duk_ret_t windowGetVSync(duk_context *ctx)
 {
-    int seed = duk_require_number(ctx, 0);
+    bool vSync = state.vSync;
 
-    SetRandomSeed(seed);
+    duk_push_boolean(ctx, vSync);
 
-    return 0;
+    return 1;
 }
 
-void registerMathFunctions(duk_context *ctx)
+duk_ret_t windowHasFocus(duk_context *ctx)
 {
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "math");
+    bool focus = IsWindowFocused();
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "math");
-    duk_push_c_function(ctx, mathRandom, 2);
-    duk_put_prop_string(ctx, -2, "random");
-    duk_pop(ctx);
+    duk_push_boolean(ctx, focus);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "math");
-    duk_push_c_function(ctx, mathSetRandomSeed, 1);
-    duk_put_prop_string(ctx, -2, "setRandomSeed");
-    duk_pop(ctx);
+    return 1;
 }
 
-duk_ret_t mouseGetX(duk_context *ctx)
+duk_ret_t windowIsVisible(duk_context *ctx)
 {
-    int x = GetMouseX();
+    bool visible = !IsWindowHidden();
 
-    duk_push_number(ctx, x);
+    duk_push_boolean(ctx, visible);
 
     return 1;
 }
 
-duk_ret_t mouseGetY(duk_context *ctx)
+duk_ret_t windowIsMaximized(duk_context *ctx)
 {
-    int y = GetMouseY();
+    bool maximized = IsWindowMaximized();
 
-    duk_push_number(ctx, y);
+    duk_push_boolean(ctx, maximized);
 
     return 1;
 }
 
-duk_ret_t mouseIsDown(duk_context *ctx)
+duk_ret_t windowIsMinimized(duk_context *ctx)
 {
-    int button = duk_require_number(ctx, 0);
+    bool minimized = IsWindowMinimized();
 
-    bool down = IsMouseButtonDown(button);
+    duk_push_boolean(ctx, minimized);
 
-    duk_push_boolean(ctx, down);
+    return 1;
+}
+
+duk_ret_t windowMaximize(duk_context *ctx)
+{
+    MaximizeWindow();
+
+    return 0;
+}
+
+duk_ret_t windowMinimize(duk_context *ctx)
+{
+    MinimizeWindow();
+
+    return 0;
+}
+
+duk_ret_t windowRestore(duk_context *ctx)
+{
+    RestoreWindow();
 
-    return 1;
+    return 0;
 }
 
-duk_ret_t mouseIsPressed(duk_context *ctx)
+duk_ret_t windowSetFullscreen(duk_context *ctx)
 {
-    int button = duk_require_number(ctx, 0);
+    bool fullscreen = duk_require_boolean(ctx, 0);
 
-    bool pressed = IsMouseButtonPressed(button);
+    bool isFullscreen = IsWindowFullscreen();
 
-    duk_push_boolean(ctx, pressed);
+    if (fullscreen && !isFullscreen)
+    {
+        ToggleFullscreen();
+    }
+    else if (!fullscreen && isFullscreen)
+    {
+        ToggleFullscreen();
+    }
 
-    return 1;
+    return 0;
 }
 
-duk_ret_t mouseIsReleased(duk_context *ctx)
+duk_ret_t windowSetPosition(duk_context *ctx)
 {
-    int button = duk_require_number(ctx, 0);
-
-    bool released = IsMouseButtonReleased(button);
+    int x = duk_require_number(ctx, 0);
+    int y = duk_require_number(ctx, 1);
 
-    duk_push_boolean(ctx, released);
+    SetWindowPosition(x, y);
 
-    return 1;
+    return 0;
 }
 
-duk_ret_t mouseGetWheelMove(duk_context *ctx)
+duk_ret_t windowSetTitle(duk_context *ctx)
 {
-    float wheelMove = GetMouseWheelMove();
+    const char *title = duk_require_string(ctx, 0);
 
-    duk_push_number(ctx, wheelMove);
+    SetWindowTitle(title);
 
-    return 1;
+    return 0;
 }
 
-duk_ret_t mouseSetGrabbed(duk_context *ctx)
+duk_ret_t windowSetVSync(duk_context *ctx)
 {
-    bool grab = duk_require_boolean(ctx, 0);
+    bool vSync = duk_require_boolean(ctx, 0);
 
-    if (grab)
+    if (vSync)
     {
-        DisableCursor();
-        state.grabbed = true;
+        SetTargetFPS(GetMonitorRefreshRate(GetCurrentMonitor()));
+        state.vSync = true;
     }
     else
     {
-        EnableCursor();
-        state.grabbed = false;
+        SetTargetFPS(0);
+        state.vSync = false;
     }
 
     return 0;
 }
 
-duk_ret_t mouseIsGrabbed(duk_context *ctx)
-{
-    bool grabbed = state.grabbed;
-
-    duk_push_boolean(ctx, grabbed);
-
-    return 1;
-}
-
-duk_ret_t mouseSetVisible(duk_context *ctx)
+duk_ret_t windowSetResizable(duk_context *ctx)
 {
-    bool visible = duk_require_boolean(ctx, 0);
+    bool resizable = duk_require_boolean(ctx, 0);
 
-    if (visible)
+    if (resizable)
     {
-        ShowCursor();
+        SetWindowState(FLAG_WINDOW_RESIZABLE);
     }
     else
     {
-        HideCursor();
+        ClearWindowState(FLAG_WINDOW_RESIZABLE);
     }
 
     return 0;
 }
 
-duk_ret_t mouseIsVisible(duk_context *ctx)
+duk_ret_t windowIsResized(duk_context *ctx)
 {
-    bool visible = !IsCursorHidden();
+    bool resized = IsWindowResized();
 
-    duk_push_boolean(ctx, visible);
+    duk_push_boolean(ctx, resized);
 
     return 1;
 }
 
-void registerMouseFunctions(duk_context *ctx)
+duk_ret_t windowSetMinSize(duk_context *ctx)
+{
+    int width = duk_require_number(ctx, 0);
+    int height = duk_require_number(ctx, 1);
+
+    SetWindowMinSize(width, height);
+
+    return 0;
+}
+
+void registerWindowFunctions(duk_context *ctx)
 {
     duk_get_global_string(ctx, "turtle");
     duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "mouse");
+    duk_put_prop_string(ctx, -2, "window");
+    duk_pop(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseGetX, 0);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowClose, 0);
+    duk_put_prop_string(ctx, -2, "close");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetDisplayWidth, 0);
+    duk_put_prop_string(ctx, -2, "getDisplayWidth");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetDisplayHeight, 0);
+    duk_put_prop_string(ctx, -2, "getDisplayHeight");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetWidth, 0);
+    duk_put_prop_string(ctx, -2, "getWidth");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetHeight, 0);
+    duk_put_prop_string(ctx, -2, "getHeight");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetDisplayName, 0);
+    duk_put_prop_string(ctx, -2, "getDisplayName");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetFullscreen, 0);
+    duk_put_prop_string(ctx, -2, "getFullscreen");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetX, 0);
     duk_put_prop_string(ctx, -2, "getX");
-    duk_pop(ctx);
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseGetY, 0);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetY, 0);
     duk_put_prop_string(ctx, -2, "getY");
-    duk_pop(ctx);
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseIsDown, 1);
-    duk_put_prop_string(ctx, -2, "isDown");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetTitle, 0);
+    duk_put_prop_string(ctx, -2, "getTitle");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseIsPressed, 1);
-    duk_put_prop_string(ctx, -2, "isPressed");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowGetVSync, 0);
+    duk_put_prop_string(ctx, -2, "getVSync");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseIsReleased, 1);
-    duk_put_prop_string(ctx, -2, "isReleased");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowHasFocus, 0);
+    duk_put_prop_string(ctx, -2, "hasFocus");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseGetWheelMove, 0);
-    duk_put_prop_string(ctx, -2, "getWheelMove");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowIsVisible, 0);
+    duk_put_prop_string(ctx, -2, "isVisible");
+    duk_pop_2(ctx);
 
     duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseSetGrabbed, 1);
-    duk_put_prop_string(ctx, -2, "setGrabbed");
-    duk_pop(ctx);
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowIsMaximized, 0);
+    duk_put_prop_string(ctx, -2, "isMaximized");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowIsMinimized, 0);
+    duk_put_prop_string(ctx, -2, "isMinimized");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowMaximize, 0);
+    duk_put_prop_string(ctx, -2, "maximize");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowMinimize, 0);
+    duk_put_prop_string(ctx, -2, "minimize");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowRestore, 0);
+    duk_put_prop_string(ctx, -2, "restore");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowSetFullscreen, 1);
+    duk_put_prop_string(ctx, -2, "setFullscreen");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowSetPosition, 2);
+    duk_put_prop_string(ctx, -2, "setPosition");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowSetTitle, 1);
+    duk_put_prop_string(ctx, -2, "setTitle");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowSetVSync, 1);
+    duk_put_prop_string(ctx, -2, "setVSync");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowSetResizable, 1);
+    duk_put_prop_string(ctx, -2, "setResizable");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowIsResized, 0);
+    duk_put_prop_string(ctx, -2, "isResized");
+    duk_pop_2(ctx);
+
+    duk_get_global_string(ctx, "turtle");
+    duk_get_prop_string(ctx, -1, "window");
+    duk_push_c_function(ctx, windowSetMinSize, 2);
+    duk_put_prop_string(ctx, -2, "setMinSize");
+    duk_pop_2(ctx);
+}
+
+// BYTECODE CACHE
+
+// Returns a directory for name in the user cache directory, or NULL when it
+// can not be created. Caches never write into the game directory.
+
+sds cacheDirectory(const char *name)
+{
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    sds directory = sdsempty();
+
+    if (cacheHome != NULL && cacheHome[0] != '\0')
+        directory = sdscatprintf(directory, "%s/turtle/%s", cacheHome, name);
+    else if (home != NULL && home[0] != '\0')
+        directory = sdscatprintf(directory, "%s/.cache/turtle/%s", home, name);
+
+    if (sdslen(directory) == 0 || !makeDirectories(directory))
+    {
+        sdsfree(directory);
+        return NULL;
+    }
+
+    return directory;
+}
+
+sds absolutePath(const char *path)
+{
+    sds absolute = sdsempty();
+
+    if (path[0] != '/')
+    {
+        char directory[4096];
+
+        if (getcwd(directory, sizeof(directory)) == NULL)
+        {
+            sdsfree(absolute);
+            return NULL;
+        }
+
+        absolute = sdscatprintf(absolute, "%s/", directory);
+    }
+
+    return sdscat(absolute, path);
+}
+
+// The bytecode of a script lives in a file named after the hash of its
+// absolute path and of how it was compiled.
+
+sds bytecodePath(const char *path, duk_uint_t flags)
+{
+    if (!state.scriptCache || state.bytecodeDirectory == NULL)
+        return NULL;
+
+    sds key = absolutePath(path);
+
+    if (key == NULL)
+        return NULL;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseIsGrabbed, 0);
-    duk_put_prop_string(ctx, -2, "isGrabbed");
-    duk_pop(ctx);
+    key = sdscatprintf(key, ":%u", (unsigned int)flags);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseSetVisible, 1);
-    duk_put_prop_string(ctx, -2, "setVisible");
-    duk_pop(ctx);
+    sds cachePath = sdscatprintf(sdsempty(), "%s/%016llx.jsbc", state.bytecodeDirectory, (unsigned long long)hashBytes(key, sdslen(key)));
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "mouse");
-    duk_push_c_function(ctx, mouseIsVisible, 0);
-    duk_put_prop_string(ctx, -2, "isVisible");
-    duk_pop(ctx);
+    sdsfree(key);
+
+    return cachePath;
 }
 
-duk_ret_t networkNewServer(duk_context *ctx)
-{
-    const char *address = duk_require_string(ctx, 0);
-    int port = duk_require_number(ctx, 1);
+// Hashes the build date and the config options that change the bytecode
+// layout, so a rebuilt binary never loads bytecode from an older one.
 
-    ENetAddress enetAddress;
-    enet_address_set_host(&enetAddress, address);
-    enetAddress.port = port;
+uint64_t buildFingerprint()
+{
+    static uint64_t fingerprint = 0;
 
-    ENetHost *server = enet_host_create(&enetAddress, 32, 2, 0, 0);
+    if (fingerprint != 0)
+        return fingerprint;
 
-    if (server == NULL)
-    {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not create server.");
-        duk_throw(ctx);
-    }
+    sds build = sdscatprintf(sdsempty(), "%s %s %s %lu %lu %lu %lu", VERSION, __DATE__, __TIME__, (unsigned long)DUK_VERSION,
+                             (unsigned long)sizeof(void *), (unsigned long)sizeof(duk_double_t), (unsigned long)sizeof(duk_int_t));
 
-    char hostId[UUID4_LEN];
-    uuid4_generate(hostId);
+#if defined(DUK_USE_PACKED_TVAL)
+    build = sdscat(build, " packed");
+#endif
+#if defined(DUK_USE_FASTINT)
+    build = sdscat(build, " fastint");
+#endif
+#if defined(DUK_USE_BYTEORDER)
+    build = sdscatprintf(build, " order%d", DUK_USE_BYTEORDER);
+#endif
 
-    map_set(&state.hosts, hostId, server);
+    fingerprint = hashBytes(build, sdslen(build));
 
-    duk_push_string(ctx, hostId);
+    sdsfree(build);
 
-    return 1;
+    return fingerprint;
 }
 
-duk_ret_t networkNewClient(duk_context *ctx)
+// Pushes the function stored in a bytecode file image. The bytecode is read
+// in place through an external buffer, so a mapped pack is never copied.
+
+bool pushBytecode(duk_context *ctx, const unsigned char *data, size_t length, uint64_t hash, duk_uint_t flags)
 {
-    ENetHost *client = enet_host_create(NULL, 1, 2, 0, 0);
+    if (length < sizeof(BytecodeHeader))
+        return false;
 
-    if (client == NULL)
-    {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not create client.");
-        duk_throw(ctx);
-    }
+    BytecodeHeader header;
+    memcpy(&header, data, sizeof(BytecodeHeader));
 
-    char hostId[UUID4_LEN];
-    uuid4_generate(hostId);
+    if (header.magic != BYTECODE_MAGIC || header.version != DUK_VERSION || header.build != buildFingerprint() ||
+        header.flags != flags || header.hash != hash || header.length != length - sizeof(BytecodeHeader))
+        return false;
 
-    map_set(&state.hosts, hostId, client);
+    duk_push_external_buffer(ctx);
+    duk_config_buffer(ctx, -1, (void *)(data + sizeof(BytecodeHeader)), header.length);
+    duk_load_function(ctx);
 
-    duk_push_string(ctx, hostId);
+    return true;
+}
 
-    return 1;
+bool loadBytecode(duk_context *ctx, const char *cachePath, uint64_t hash, duk_uint_t flags)
+{
+    unsigned int length = 0;
+    unsigned char *data = LoadFileData(cachePath, &length);
+
+    if (data == NULL)
+        return false;
+
+    bool loaded = pushBytecode(ctx, data, length, hash, flags);
+
+    UnloadFileData(data);
+
+    return loaded;
 }
 
-duk_ret_t networkService(duk_context *ctx)
+// Returns the bytecode file image of the function on top of the stack.
+
+sds dumpBytecode(duk_context *ctx, uint64_t hash, duk_uint_t flags)
 {
-    const char *host = duk_require_string(ctx, 0);
-    int timeout = duk_require_number(ctx, 1);
+    duk_dup(ctx, -1);
+    duk_dump_function(ctx);
 
-    ENetEvent event;
+    duk_size_t size;
+    void *bytecode = duk_get_buffer(ctx, -1, &size);
 
-    ENetHost *enetHost = *map_get(&state.hosts, host);
+    BytecodeHeader header = {BYTECODE_MAGIC, DUK_VERSION, flags, 0, buildFingerprint(), hash, size};
 
-    enet_host_service(enetHost, &event, timeout);
+    sds image = sdsnewlen(&header, sizeof(BytecodeHeader));
+    image = sdscatlen(image, bytecode, size);
 
-    sds type = sdsempty();
+    duk_pop(ctx);
 
-    switch (event.type)
-    {
-    case ENET_EVENT_TYPE_CONNECT:
-        sdscat(type, "connect");
-        break;
-    case ENET_EVENT_TYPE_DISCONNECT:
-        sdscat(type, "disconnect");
-        break;
-    case ENET_EVENT_TYPE_RECEIVE:
-        sdscat(type, "receive");
-        break;
-    case ENET_EVENT_TYPE_NONE:
-        break;
-    }
+    return image;
+}
 
-    if (event.type != 0)
-    {
-        char peerId[UUID4_LEN];
-        uuid4_generate(peerId);
+void saveBytecode(duk_context *ctx, const char *cachePath, uint64_t hash, duk_uint_t flags)
+{
+    sds image = dumpBytecode(ctx, hash, flags);
 
-        map_set(&state.peers, peerId, event.peer);
+    writeFileAtomic(cachePath, image, sdslen(image));
 
-        duk_idx_t obj = duk_push_object(ctx);
-        duk_push_string(ctx, type);
-        duk_put_prop_string(ctx, obj, "type");
-        duk_push_string(ctx, peerId);
-        duk_put_prop_string(ctx, obj, "peer");
+    sdsfree(image);
+}
 
-        if (strcmp(type, "receive") == 0)
-        {
-            duk_push_string(ctx, (char *)event.packet->data);
-            duk_put_prop_string(ctx, obj, "data");
-        }
-    }
-    else
-    {
-        duk_idx_t obj = duk_push_object(ctx);
-        duk_push_string(ctx, "none");
-        duk_put_prop_string(ctx, obj, "type");
-    }
+// Compiles a script source, wrapped as a module function when flags ask for
+// DUK_COMPILE_FUNCTION.
 
-    return 1;
+duk_int_t compileScript(duk_context *ctx, const unsigned char *source, size_t length, const char *path, duk_uint_t flags)
+{
+    bool module = (flags & DUK_COMPILE_FUNCTION) != 0;
+
+    duk_push_string(ctx, module ? MODULE_PREFIX : "");
+    duk_push_lstring(ctx, (const char *)source, length);
+    duk_push_string(ctx, module ? MODULE_SUFFIX : "");
+    duk_concat(ctx, 3);
+    duk_push_string(ctx, path);
+
+    return duk_pcompile(ctx, flags);
 }
 
-duk_ret_t networkSend(duk_context *ctx)
+// Pushes the function compiled from a script, taking the bytecode from the
+// pack or from the bytecode cache when the source did not change.
+
+void pushScript(duk_context *ctx, const char *path, duk_uint_t flags)
 {
-    const char *peerId = duk_require_string(ctx, 0);
-    const char *data = duk_require_string(ctx, 1);
-    const char *method = duk_get_string(ctx, 2);
+    VfsFile source = vfsLoad(path);
 
-    if (method == NULL)
+    if (source.data == NULL)
     {
-        method = "reliable";
+        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not read script %s.", path);
+        duk_throw(ctx);
     }
 
-    ENetPacketFlag enetMethod;
+    uint64_t hash = hashBytes(source.data, source.size);
 
-    if (strcmp(data, "reliable") == 0)
-    {
-        enetMethod = ENET_PACKET_FLAG_RELIABLE;
-    }
-    else if (strcmp(data, "unreliable") == 0)
+    if (source.mapped)
     {
-        enetMethod = ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT;
+        sds name = sdscatprintf(sdsempty(), "%s.jsbc", packName(path));
+        PackEntry *entry = findPackEntry(name);
+
+        sdsfree(name);
+
+        if (entry != NULL && pushBytecode(ctx, state.pack.data + entry->offset, entry->size, hash, flags))
+            return;
     }
-    else
+
+    sds cachePath = source.mapped ? NULL : bytecodePath(path, flags);
+
+    if (cachePath != NULL && loadBytecode(ctx, cachePath, hash, flags))
     {
-        enetMethod = ENET_PACKET_FLAG_RELIABLE;
+        vfsUnload(source);
+        sdsfree(cachePath);
+        return;
     }
 
-    ENetPeer *peer = *map_get(&state.peers, peerId);
+    duk_int_t result = compileScript(ctx, source.data, source.size, path, flags);
 
-    ENetPacket *packet = enet_packet_create(data, strlen(data) + 1, enetMethod);
+    vfsUnload(source);
 
-    enet_peer_send(peer, 0, packet);
+    if (result != DUK_EXEC_SUCCESS)
+    {
+        sdsfree(cachePath);
+        duk_throw(ctx);
+    }
 
-    return 0;
+    if (cachePath != NULL)
+    {
+        saveBytecode(ctx, cachePath, hash, flags);
+        sdsfree(cachePath);
+    }
 }
 
-duk_ret_t networkConnect(duk_context *ctx)
+duk_ret_t runScript(duk_context *ctx, void *udata)
 {
-    const char *host = duk_require_string(ctx, 0);
-    const char *address = duk_require_string(ctx, 1);
-    int port = duk_require_number(ctx, 2);
+    pushScript(ctx, udata, 0);
+    duk_call(ctx, 0);
 
-    ENetAddress enetAddress;
+    return 1;
+}
 
-    enet_address_set_host(&enetAddress, address);
-    enetAddress.port = port;
+// Modules are compiled like the module loader would, as a function taking
+// require, exports and module, and called here. Returning undefined tells the
+// loader the module is done.
+
+duk_ret_t modSearch(duk_context *ctx)
+{
+    const char *id = duk_get_string(ctx, 0);
 
-    ENetHost *enetHost = *map_get(&state.hosts, host);
+    sds filename = sdsempty();
 
-    ENetPeer *peer = enet_host_connect(enetHost, &enetAddress, 2, 0);
+    filename = sdscatprintf(filename, "%s/%s.js", state.scriptDirectory, id);
 
-    if (peer == NULL)
+    if (!vfsExists(filename) && strcmp(state.scriptDirectory, state.baseDir) != 0)
     {
-        duk_push_error_object(ctx, DUK_ERR_ERROR, "Could not connect to server.");
-        duk_throw(ctx);
+        sdsclear(filename);
+        filename = sdscatprintf(filename, "%s/%s.js", state.baseDir, id);
     }
 
-    char peerId[UUID4_LEN];
-    uuid4_generate(peerId);
+    duk_push_string(ctx, filename);
 
-    map_set(&state.peers, peerId, peer);
+    sdsfree(filename);
 
-    duk_push_string(ctx, peerId);
+    pushScript(ctx, duk_get_string(ctx, -1), DUK_COMPILE_FUNCTION);
 
-    return 1;
-}
+    const char *name = strrchr(id, '/');
 
-void registerNetworkFunctions(duk_context *ctx)
-{
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "network");
+    duk_push_string(ctx, "name");
+    duk_push_string(ctx, name != NULL ? name + 1 : id);
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_FORCE);
 
-    duk_pop(ctx);
-    duk_pop(ctx);
-    duk_pop(ctx);
-    duk_pop(ctx);  // UNDERSTAND THE DUKTAPE STACK BETTER TO PREVENT... THIS
-    duk_pop(ctx);
-    duk_pop(ctx);
+    duk_dup(ctx, 2);
+    duk_dup(ctx, 1);
+    duk_get_prop_string(ctx, 3, "exports");
+    duk_dup(ctx, 3);
+    duk_call_method(ctx, 3);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "network");
-    duk_push_c_function(ctx, networkNewServer, 2);
-    duk_put_prop_string(ctx, -2, "newServer");
-    duk_pop(ctx);
+    return 0;
+}
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "network");
-    duk_push_c_function(ctx, networkNewClient, 0);
-    duk_put_prop_string(ctx, -2, "newClient");
-    duk_pop(ctx);
+// TYPESCRIPT
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "network");
-    duk_push_c_function(ctx, networkService, 2);
-    duk_put_prop_string(ctx, -2, "service");
-    duk_pop(ctx);
+// Adds the files under root/relative to files, as paths relative to root.
+// Hidden entries and node_modules are skipped.
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "network");
-    duk_push_c_function(ctx, networkSend, 3);
-    duk_put_prop_string(ctx, -2, "send");
-    duk_pop(ctx);
+void findFiles(const char *root, const char *relative, vec_str_t *files)
+{
+    sds directory = sdsnew(root);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "network");
-    duk_push_c_function(ctx, networkConnect, 3);
-    duk_put_prop_string(ctx, -2, "connect");
-    duk_pop(ctx);
-}
+    if (relative[0] != '\0')
+        directory = sdscatprintf(directory, "/%s", relative);
 
-void noGame()
-{
-    SetTraceLogLevel(LOG_NONE);
-    InitWindow(800, 600, "TURTLE 0.1");
-    SetTargetFPS(60);
-    SetExitKey(KEY_NULL);
+    int count = 0;
+    char **entries = GetDirectoryFiles(directory, &count);
 
-    char *text = "NO GAME";
-    int width = MeasureText(text, 50);
+    vec_str_t names;
+    vec_init(&names);
 
-    while (!WindowShouldClose())
+    for (int i = 0; i < count; i++)
     {
-        BeginDrawing();
+        if (entries[i][0] != '.' && strcmp(entries[i], "node_modules") != 0)
+            vec_push(&names, sdsnew(entries[i]));
+    }
 
-        ClearBackground(BLACK);
+    ClearDirectoryFiles();
 
-        DrawText(text, 400 - width / 2, 300 - 50 / 2, 50, WHITE);
+    int i;
+    sds name;
 
-        EndDrawing();
+    vec_foreach(&names, name, i) {
+        sds path = relative[0] != '\0' ? sdscatprintf(sdsempty(), "%s/%s", relative, name) : sdsnew(name);
+        sds full = sdscatprintf(sdsempty(), "%s/%s", root, path);
+
+        if (DirectoryExists(full))
+        {
+            findFiles(root, path, files);
+            sdsfree(path);
+        }
+        else
+        {
+            vec_push(files, path);
+        }
+
+        sdsfree(full);
+        sdsfree(name);
     }
 
-    CloseWindow();
+    vec_deinit(&names);
+    sdsfree(directory);
 }
 
-duk_ret_t physicsNewCircleCollider(duk_context *ctx)
+bool isTypescript(const char *path)
 {
-    int x = duk_require_number(ctx, 0);
-    int y = duk_require_number(ctx, 1);
-    int radius = duk_require_number(ctx, 2);
-
-    cpFloat mass = 1;
-    cpFloat moment = cpMomentForCircle(mass, 0, radius, cpvzero);
+    size_t length = strlen(path);
 
-    cpBody *body = cpSpaceAddBody(state.space, cpBodyNew(mass, moment));
-    cpBodySetPosition(body, cpv(x, y));
+    return IsFileExtension(path, ".ts") && !TextIsEqual(path + (length > 5 ? length - 5 : 0), ".d.ts");
+}
 
-    cpShape *shape = cpSpaceAddShape(state.space, cpCircleShapeNew(body, radius, cpvzero));
+void loadManifest(const char *path, hash_map_t *manifest)
+{
+    char *text = LoadFileText(path);
 
-    Collider collider;
-    collider.body = body;
-    collider.shape = shape;
-    collider.class = "none";
+    if (text == NULL)
+        return;
 
-    char colliderId[UUID4_LEN];
-    uuid4_generate(colliderId);
+    int count = 0;
+    sds *lines = sdssplitlen(text, strlen(text), "\n", 1, &count);
 
-    map_set(&state.colliders, colliderId, collider);
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long long hash;
+        int offset = 0;
 
-    duk_push_string(ctx, colliderId);
+        if (sscanf(lines[i], "%16llx %n", &hash, &offset) == 1 && offset > 0)
+            map_set(manifest, lines[i] + offset, (uint64_t)hash);
+    }
 
-    return 1;
+    sdsfreesplitres(lines, count);
+    UnloadFileText(text);
 }
 
-duk_ret_t physicsNewRectangleCollider(duk_context *ctx)
+// Starts one swc process compiling compilations first to last - 1 into build.
+// swc runs in baseDir with relative sources, so the outputs mirror the game's
+// directories. Outputs are removed first: a missing one means its file failed.
+
+pid_t startSwc(compilation_vec_t *compilations, int first, int last, const char *baseDir, const char *build)
 {
-    int x = duk_require_number(ctx, 0);
-    int y = duk_require_number(ctx, 1);
-    int width = duk_require_number(ctx, 2);
-    int height = duk_require_number(ctx, 3);
+    const char **arguments = malloc(sizeof(char *) * (last - first + 10));
+    int count = 0;
 
-    cpFloat mass = 1;
-    cpFloat moment = cpMomentForBox(mass, width, height);
+    arguments[count++] = "swc";
 
-    cpBody *body = cpSpaceAddBody(state.space, cpBodyNew(mass, moment));
-    cpBodySetPosition(body, cpv(x, y));
+    for (int i = first; i < last; i++)
+    {
+        Compilation *compilation = &compilations->data[i];
 
-    cpShape *shape = cpSpaceAddShape(state.space, cpBoxShapeNew(body, width, height, 0));
+        sds directory = sdsnew(compilation->output);
+        sdsrange(directory, 0, strrchr(directory, '/') - directory - 1);
+        makeDirectories(directory);
+        sdsfree(directory);
 
-    Collider collider;
-    collider.body = body;
-    collider.shape = shape;
+        remove(compilation->output);
 
-    char colliderId[UUID4_LEN];
-    uuid4_generate(colliderId);
+        arguments[count++] = compilation->relative;
+    }
 
-    map_set(&state.colliders, colliderId, collider);
+    const char *options[] = {"-d", build, "-q", "-C", SWC_MODULE, "-C", SWC_STRICT, NULL};
 
-    duk_push_string(ctx, colliderId);
+    for (int i = 0; i < 8; i++)
+        arguments[count++] = options[i];
 
-    return 1;
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        if (chdir(baseDir) == 0)
+            execvp("swc", (char *const *)arguments);
+
+        _exit(127);
+    }
+
+    free(arguments);
+
+    return pid;
 }
 
-duk_ret_t physicsGetX(duk_context *ctx)
+// Splits the compilations into one batch per core and waits for every swc
+// process. Batches report the average time of their files. Returns false if
+// swc could not be started at all.
+
+bool runCompilations(compilation_vec_t *compilations, const char *baseDir, const char *build)
 {
-    const char *colliderId = duk_require_string(ctx, 0);
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int running = 0;
+    bool started = true;
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    if (jobs > compilations->length)
+        jobs = compilations->length;
 
-    cpVect pos = cpBodyGetPosition(collider.body);
+    for (int job = 0; job < jobs; job++)
+    {
+        int first = compilations->length * job / jobs;
+        int last = compilations->length * (job + 1) / jobs;
+        double start = monotonicTime();
+        pid_t pid = startSwc(compilations, first, last, baseDir, build);
 
-    duk_push_number(ctx, pos.x);
+        for (int i = first; i < last; i++)
+        {
+            compilations->data[i].start = start;
+            compilations->data[i].pid = pid;
+            compilations->data[i].failed = pid < 0;
+        }
 
-    return 1;
-}
+        if (pid >= 0)
+            running++;
+    }
 
-duk_ret_t physicsGetY(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    while (running > 0)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+        if (pid < 0)
+            break;
 
-    cpVect pos = cpBodyGetPosition(collider.body);
+        int batch = 0;
 
-    duk_push_number(ctx, pos.y);
+        for (int i = 0; i < compilations->length; i++)
+            batch += compilations->data[i].pid == pid;
 
-    return 1;
+        for (int i = 0; i < compilations->length; i++)
+        {
+            Compilation *compilation = &compilations->data[i];
+
+            if (compilation->pid != pid)
+                continue;
+
+            compilation->time = (monotonicTime() - compilation->start) / batch;
+            compilation->failed = !FileExists(compilation->output);
+        }
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+            started = false;
+
+        if (batch > 0)
+            running--;
+    }
+
+    return started;
 }
 
-duk_ret_t physicsGetType(duk_context *ctx)
+// Compiles the TypeScript files of baseDir that changed since the last run
+// and returns the directory holding the compiled project, or NULL with
+// state.errorString set. The game directory is never written to.
+
+sds compileTypescript(const char *baseDir)
 {
-    const char *colliderId = duk_require_string(ctx, 0);
+    double start = monotonicTime();
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    sds absolute = absolutePath(baseDir);
+    sds name = sdscatprintf(sdsempty(), "typescript/%016llx", (unsigned long long)hashBytes(absolute, absolute ? sdslen(absolute) : 0));
+    sds root = cacheDirectory(name);
 
-    cpBodyType type = cpBodyGetType(collider.body);
+    sdsfree(absolute);
+    sdsfree(name);
 
-    switch (type)
+    if (root == NULL)
     {
-    case CP_BODY_TYPE_STATIC:
-        duk_push_string(ctx, "static");
-        break;
-    case CP_BODY_TYPE_DYNAMIC:
-        duk_push_string(ctx, "dynamic");
-        break;
-    case CP_BODY_TYPE_KINEMATIC:
-        duk_push_string(ctx, "kinematic");
-        break;
+        strcpy(state.errorString, "Error compiling Typescript, could not create the cache directory.");
+        return NULL;
     }
 
-    return 1;
-}
+    sds build = sdscatprintf(sdsempty(), "%s/build", root);
+    sds manifestPath = sdscatprintf(sdsempty(), "%s/manifest", root);
+
+    hash_map_t manifest;
+    map_init(&manifest);
 
-duk_ret_t physicsGetMass(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    if (state.scriptCache)
+        loadManifest(manifestPath, &manifest);
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    vec_str_t files;
+    vec_init(&files);
 
-    cpFloat mass = cpBodyGetMass(collider.body);
+    findFiles(baseDir, "", &files);
 
-    duk_push_number(ctx, mass);
+    int typescriptFiles = 0;
 
-    return 1;
-}
+    for (int i = 0; i < files.length; i++)
+    {
+        if (isTypescript(files.data[i]))
+            files.data[typescriptFiles++] = files.data[i];
+        else
+            sdsfree(files.data[i]);
+    }
 
-duk_ret_t physicsGetFriction(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    files.length = typescriptFiles;
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    uint64_t options = hashBytes(SWC_MODULE SWC_STRICT, strlen(SWC_MODULE SWC_STRICT));
 
-    cpFloat friction = cpShapeGetFriction(collider.shape);
+    compilation_vec_t compilations;
+    vec_init(&compilations);
 
-    duk_push_number(ctx, friction);
+    sds updated = sdsempty();
 
-    return 1;
-}
+    int i;
+    sds relative;
 
-duk_ret_t physicsSetType(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    vec_foreach(&files, relative, i) {
+        Compilation compilation = {0};
+        compilation.relative = relative;
+        compilation.source = sdscatprintf(sdsempty(), "%s/%s", baseDir, relative);
+        compilation.output = sdscatprintf(sdsempty(), "%s/%.*s.js", build, (int)sdslen(relative) - 3, relative);
 
-    const char *type = duk_require_string(ctx, 1);
+        unsigned int length = 0;
+        unsigned char *data = LoadFileData(compilation.source, &length);
+        compilation.hash = hashBytes(data, length) ^ options;
+        UnloadFileData(data);
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+        uint64_t *previous = map_get(&manifest, relative);
 
-    if (strcmp("static", type) == 0)
-    {
-        cpBodySetType(collider.body, CP_BODY_TYPE_STATIC);
-    }
-    else if (strcmp("dynamic", type) == 0)
-    {
-        cpBodySetType(collider.body, CP_BODY_TYPE_DYNAMIC);
-    }
-    else if (strcmp("kinematic", type) == 0)
-    {
-        cpBodySetType(collider.body, CP_BODY_TYPE_KINEMATIC);
-    }
+        if (previous != NULL && *previous == compilation.hash && FileExists(compilation.output))
+        {
+            updated = sdscatprintf(updated, "%016llx %s\n", (unsigned long long)compilation.hash, relative);
+            sdsfree(compilation.source);
+            sdsfree(compilation.output);
+        }
+        else
+        {
+            vec_push(&compilations, compilation);
+        }
 
-    return 0;
-}
+        map_remove(&manifest, relative);
+    }
 
-duk_ret_t physicsSetX(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    bool started = runCompilations(&compilations, baseDir, build);
+    const char *failed = NULL;
+    int failures = 0;
 
-    int x = duk_require_number(ctx, 1);
+    Compilation compilation;
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    vec_foreach(&compilations, compilation, i) {
+        if (compilation.failed)
+        {
+            printf("Error compiling %s\n", compilation.relative);
+            failures++;
 
-    cpVect pos = cpBodyGetPosition(collider.body);
+            if (failed == NULL)
+                failed = compilation.relative;
+        }
+        else
+        {
+            printf("Compiled %s in %.1f ms\n", compilation.relative, compilation.time * 1000);
+            updated = sdscatprintf(updated, "%016llx %s\n", (unsigned long long)compilation.hash, compilation.relative);
+        }
+    }
 
-    cpBodySetPosition(collider.body, cpv(x, pos.y));
+    // Whatever is left in the manifest was deleted from the game.
 
-    return 0;
-}
+    const char *key;
+    map_iter_t iter = map_iter(&manifest);
 
-duk_ret_t physicsSetY(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    while ((key = map_next(&manifest, &iter)))
+    {
+        sds output = sdscatprintf(sdsempty(), "%s/%.*s.js", build, (int)strlen(key) - 3, key);
+        remove(output);
+        sdsfree(output);
+    }
 
-    int y = duk_require_number(ctx, 1);
+    SaveFileText(manifestPath, updated);
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    printf("Typescript: %d compiled, %d failed, %d cached in %.1f ms\n", compilations.length - failures, failures,
+           files.length - compilations.length, (monotonicTime() - start) * 1000);
 
-    cpVect pos = cpBodyGetPosition(collider.body);
+    if (!started)
+        strcpy(state.errorString, "Error compiling Typescript, you might need to install swc.");
+    else if (failed != NULL)
+        snprintf(state.errorString, sizeof(state.errorString), "Error compiling Typescript file %s.", failed);
 
-    cpBodySetPosition(collider.body, cpv(pos.x, y));
+    vec_foreach(&compilations, compilation, i) {
+        sdsfree(compilation.source);
+        sdsfree(compilation.output);
+    }
 
-    return 0;
-}
+    vec_foreach(&files, relative, i) {
+        sdsfree(relative);
+    }
 
-duk_ret_t physicsSetMass(duk_context *ctx)
-{
-    const char *colliderId = duk_require_string(ctx, 0);
+    vec_deinit(&compilations);
+    vec_deinit(&files);
+    map_deinit(&manifest);
+    sdsfree(updated);
+    sdsfree(manifestPath);
+    sdsfree(root);
 
-    float mass = duk_require_number(ctx, 1);
+    if (!started || failed != NULL)
+    {
+        sdsfree(build);
+        return NULL;
+    }
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    return build;
+}
 
-    cpBodySetMass(collider.body, mass);
+// PACK
 
-    return 0;
+int comparePackItems(const void *a, const void *b)
+{
+    return strcmp(((const PackItem *)a)->name, ((const PackItem *)b)->name);
 }
 
-duk_ret_t physicsSetFriction(duk_context *ctx)
+// Compiles every script of a pack to bytecode stored next to it, main.js as a
+// program and everything else as a module. Scripts are named relative to the
+// pack in error messages.
+
+bool compilePackScripts(pack_item_vec_t *items)
 {
-    const char *colliderId = duk_require_string(ctx, 0);
+    duk_context *ctx = duk_create_heap_default();
 
-    float friction = duk_require_number(ctx, 1);
+    if (ctx == NULL)
+        return false;
 
-    Collider collider = *map_get(&state.colliders, colliderId);
+    bool compiled = true;
+    int count = items->length;
 
-    cpShapeSetFriction(collider.shape, friction);
+    for (int i = 0; i < count && compiled; i++)
+    {
+        PackItem item = items->data[i];
 
-    return 0;
-}
+        if (!IsFileExtension(item.name, ".js"))
+            continue;
 
-duk_ret_t physicsIsColliding(duk_context *ctx)
-{
-    const char *colliderIdA = duk_require_string(ctx, 0);
-    const char *colliderIdB = duk_require_string(ctx, 1);
+        unsigned int length = 0;
+        unsigned char *source = LoadFileData(item.path, &length);
+        duk_uint_t flags = strcmp(item.name, "main.js") == 0 ? 0 : DUK_COMPILE_FUNCTION;
 
-    bool colliding = false;
+        if (source == NULL || compileScript(ctx, source, length, item.name, flags) != DUK_EXEC_SUCCESS)
+        {
+            printf("Error compiling %s: %s\n", item.name, source != NULL ? duk_safe_to_string(ctx, -1) : "could not read file");
+            compiled = false;
+        }
+        else
+        {
+            PackItem bytecode = {sdscatprintf(sdsempty(), "%s.jsbc", item.name), NULL, dumpBytecode(ctx, hashBytes(source, length), flags)};
+            vec_push(items, bytecode);
+        }
 
-    int i; Collision val;
-    vec_foreach(&state.collisions, val, i) {
-        if (strcmp(colliderIdA, val.idA) == 0)
-            if (strcmp(colliderIdB, val.idB) == 0)
-                colliding = true;
+        if (source != NULL)
+            UnloadFileData(source);
+
+        duk_set_top(ctx, 0);
     }
 
-    duk_push_boolean(ctx, colliding);
+    duk_destroy_heap(ctx);
 
-    return 1;
+    return compiled;
 }
 
-void collision(cpArbiter *arb, cpSpace *space, cpDataPointer data)
+bool writePack(pack_item_vec_t *items, const char *output)
 {
-    cpBody *a;
-    cpBody *b;
+    uint32_t count = items->length;
+    uint64_t namesSize = 0;
 
-    cpArbiterGetBodies(arb, &a, &b);
+    for (uint32_t i = 0; i < count; i++)
+        namesSize += sdslen(items->data[i].name);
 
-    const char *idA = "";
-    const char *idB = "";
+    PackEntry *entries = calloc(count, sizeof(PackEntry));
+    uint64_t offset = sizeof(PackHeader) + count * sizeof(PackEntry) + namesSize;
+    uint64_t name = 0;
 
-    const char *key;
-    map_iter_t iter = map_iter(&state.colliders);
+    sds temporary = sdscatprintf(sdsempty(), "%s.%d.tmp", output, (int)getpid());
+    FILE *file = fopen(temporary, "wb");
+    bool written = file != NULL;
 
-    while ((key = map_next(&state.colliders, &iter))) {
-        Collider collider = *map_get(&state.colliders, key);
+    // Sizes are known up front for everything but files on disk, which are
+    // measured here so the table can be written first.
 
-        if (collider.body == a)
-            idA = key;
-        else if (collider.body == b)
-            idB = key;
-    }
+    for (uint32_t i = 0; i < count && written; i++)
+    {
+        PackItem *item = &items->data[i];
+        uint64_t size = sdslen(item->name);
 
-    Collision collision;
-    collision.idA = idA;
-    collision.idB = idB;
+        entries[i].name = name;
+        entries[i].nameLength = size;
+        name += size;
 
-    vec_push(&state.collisions, collision);
-}
+        if (item->data != NULL)
+        {
+            size = sdslen(item->data);
+        }
+        else
+        {
+            struct stat info;
+            written = stat(item->path, &info) == 0;
+            size = written ? info.st_size : 0;
+        }
 
-void registerPhysicsFunctions(duk_context *ctx)
-{
-    cpCollisionHandler *handler = cpSpaceAddCollisionHandler(state.space, 0, 0);
-    handler->postSolveFunc = (cpCollisionPostSolveFunc)collision;
+        offset = (offset + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+        entries[i].offset = offset;
+        entries[i].size = size;
+        offset += size;
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "physics");
+    PackHeader header = {PACK_MAGIC, PACK_VERSION, count};
+    uint64_t position = 0;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsNewCircleCollider, 3);
-    duk_put_prop_string(ctx, -2, "newCircleCollider");
-    duk_pop(ctx);
+    if (written)
+    {
+        written = fwrite(&header, sizeof(PackHeader), 1, file) == 1 &&
+                  fwrite(entries, sizeof(PackEntry), count, file) == count;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsNewRectangleCollider, 4);
-    duk_put_prop_string(ctx, -2, "newRectangleCollider");
-    duk_pop(ctx);
+        position = sizeof(PackHeader) + count * sizeof(PackEntry);
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsGetX, 1);
-    duk_put_prop_string(ctx, -2, "getX");
-    duk_pop(ctx);
+    for (uint32_t i = 0; i < count && written; i++)
+    {
+        written = fwrite(items->data[i].name, 1, entries[i].nameLength, file) == entries[i].nameLength;
+        position += entries[i].nameLength;
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsGetY, 1);
-    duk_put_prop_string(ctx, -2, "getY");
-    duk_pop(ctx);
+    static const char padding[PACK_ALIGN] = {0};
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsGetType, 1);
-    duk_put_prop_string(ctx, -2, "getType");
-    duk_pop(ctx);
+    for (uint32_t i = 0; i < count && written; i++)
+    {
+        PackItem *item = &items->data[i];
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsSetType, 2);
-    duk_put_prop_string(ctx, -2, "setType");
-    duk_pop(ctx);
+        written = fwrite(padding, 1, entries[i].offset - position, file) == entries[i].offset - position;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsSetX, 2);
-    duk_put_prop_string(ctx, -2, "setX");
-    duk_pop(ctx);
+        if (item->data != NULL)
+        {
+            written = written && fwrite(item->data, 1, sdslen(item->data), file) == sdslen(item->data);
+        }
+        else if (entries[i].size > 0)
+        {
+            unsigned int length = 0;
+            unsigned char *data = LoadFileData(item->path, &length);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsSetY, 2);
-    duk_put_prop_string(ctx, -2, "setY");
-    duk_pop(ctx);
+            written = written && data != NULL && length == entries[i].size && fwrite(data, 1, length, file) == length;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsGetMass, 1);
-    duk_put_prop_string(ctx, -2, "getMass");
-    duk_pop(ctx);
+            if (data != NULL)
+                UnloadFileData(data);
+        }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsSetMass, 2);
-    duk_put_prop_string(ctx, -2, "setMass");
-    duk_pop(ctx);
+        position = entries[i].offset + entries[i].size;
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsGetFriction, 1);
-    duk_put_prop_string(ctx, -2, "getFriction");
-    duk_pop(ctx);
+    if (file != NULL && fclose(file) != 0)
+        written = false;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsSetFriction, 2);
-    duk_put_prop_string(ctx, -2, "setFriction");
-    duk_pop(ctx);
+    if (written)
+        written = rename(temporary, output) == 0;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "physics");
-    duk_push_c_function(ctx, physicsIsColliding, 2);
-    duk_put_prop_string(ctx, -2, "isColliding");
-    duk_pop(ctx);
+    if (!written)
+        remove(temporary);
+
+    sdsfree(temporary);
+    free(entries);
+
+    return written;
 }
 
-duk_ret_t systemGetClipboardText(duk_context *ctx)
+// Adds the files under root to items. With exclude set, files with that
+// extension are left out.
+
+void addPackFiles(pack_item_vec_t *items, const char *root, const char *exclude)
 {
-    const char *text = GetClipboardText();
+    vec_str_t files;
+    vec_init(&files);
 
-    duk_push_string(ctx, text);
+    findFiles(root, "", &files);
 
-    return 1;
+    int i;
+    sds relative;
+
+    vec_foreach(&files, relative, i) {
+        if (exclude != NULL && IsFileExtension(relative, exclude))
+        {
+            sdsfree(relative);
+            continue;
+        }
+
+        PackItem item = {relative, sdscatprintf(sdsempty(), "%s/%s", root, relative), NULL};
+        vec_push(items, item);
+    }
+
+    vec_deinit(&files);
 }
 
-duk_ret_t systemGetOS(duk_context *ctx)
+// Packs a game directory into a single file. TypeScript games are compiled
+// first and packed as JavaScript.
+
+int packGame(const char *directory, const char *output)
 {
-    char *os;
+    double start = monotonicTime();
 
-    #ifdef _WIN32
-        os = "Windows";
-    #elif _WIN64
-        os = "Windows";
-    #elif __APPLE__ || __MACH__
-        os = "OS X";
-    #elif __linux__
-        os = "Linux";
-    #elif __FreeBSD__
-        os = "FreeBSD";
-    #else
-        os = "Other";
-    #endif
+    sds base = sdsnew(directory);
 
-    duk_push_string(ctx, os);
+    while (sdslen(base) > 1 && base[sdslen(base) - 1] == '/')
+        sdsrange(base, 0, -2);
 
-    return 1;
-}
+    sds target = output != NULL ? sdsnew(output) : sdscatprintf(sdsempty(), "%s.turtle", base);
+    sds mainJs = sdscatprintf(sdsempty(), "%s/main.js", base);
+    sds mainTs = sdscatprintf(sdsempty(), "%s/main.ts", base);
 
-duk_ret_t systemOpenURL(duk_context *ctx)
-{
-    const char *url = duk_require_string(ctx, 0);
+    pack_item_vec_t items;
+    vec_init(&items);
 
-    OpenURL(url);
+    bool packed = true;
 
-    return 0;
-}
+    if (FileExists(mainJs))
+    {
+        addPackFiles(&items, base, NULL);
+    }
+    else if (FileExists(mainTs))
+    {
+        sds build = compileTypescript(base);
 
-duk_ret_t systemSetClipboardText(duk_context *ctx)
-{
-    const char *text = duk_require_string(ctx, 0);
+        if (build != NULL)
+        {
+            addPackFiles(&items, base, ".ts");
+            addPackFiles(&items, build, NULL);
+            sdsfree(build);
+        }
+        else
+        {
+            printf("%s\n", state.errorString);
+            packed = false;
+        }
+    }
+    else
+    {
+        printf("Point to a directory containing a main.js or main.ts file.\n");
+        packed = false;
+    }
 
-    SetClipboardText(text);
+    int scripts = items.length;
 
-    return 0;
-}
+    packed = packed && compilePackScripts(&items);
+    scripts = items.length - scripts;
 
-void registerSystemFunctions(duk_context *ctx)
-{
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "system");
+    if (packed)
+    {
+        qsort(items.data, items.length, sizeof(PackItem), comparePackItems);
+
+        for (int i = 1; i < items.length && packed; i++)
+        {
+            if (strcmp(items.data[i - 1].name, items.data[i].name) == 0)
+            {
+                printf("The file %s is in the pack twice.\n", items.data[i].name);
+                packed = false;
+            }
+        }
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "system");
-    duk_push_c_function(ctx, systemGetClipboardText, 0);
-    duk_put_prop_string(ctx, -2, "getClipboardText");
-    duk_pop(ctx);
+    if (packed)
+    {
+        packed = writePack(&items, target);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "system");
-    duk_push_c_function(ctx, systemGetOS, 0);
-    duk_put_prop_string(ctx, -2, "getOS");
-    duk_pop(ctx);
+        if (packed)
+            printf("Packed %d files and %d scripts into %s in %.1f ms\n", items.length - scripts, scripts, target, (monotonicTime() - start) * 1000);
+        else
+            printf("Error writing %s.\n", target);
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "system");
-    duk_push_c_function(ctx, systemOpenURL, 1);
-    duk_put_prop_string(ctx, -2, "openURL");
-    duk_pop(ctx);
+    int i;
+    PackItem item;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "system");
-    duk_push_c_function(ctx, systemSetClipboardText, 1);
-    duk_put_prop_string(ctx, -2, "setClipboardText");
-    duk_pop(ctx);
+    vec_foreach(&items, item, i) {
+        sdsfree(item.name);
+        sdsfree(item.path);
+        sdsfree(item.data);
+    }
+
+    vec_deinit(&items);
+    sdsfree(base);
+    sdsfree(target);
+    sdsfree(mainJs);
+    sdsfree(mainTs);
+
+    return packed ? 0 : 1;
 }
 
-duk_ret_t timerGetDelta(duk_context *ctx)
-{
-    float delta = GetFrameTime();
+// HOT RELOAD
 
-    duk_push_number(ctx, delta);
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
 
-    return 1;
-}
+// Watches a directory and everything under it, skipping hidden entries and
+// node_modules like the TypeScript compiler does. Watch descriptors index
+// state.watchDirectories.
 
-duk_ret_t timerGetFPS(duk_context *ctx)
+void watchDirectory(const char *path)
 {
-    int fps = GetFPS();
+    int descriptor = inotify_add_watch(state.watcher, path, WATCH_MASK);
 
-    duk_push_number(ctx, fps);
+    if (descriptor < 0)
+        return;
 
-    return 1;
-}
+    while (state.watchDirectories.length <= descriptor)
+        vec_push(&state.watchDirectories, NULL);
 
-duk_ret_t timerGetTime(duk_context *ctx)
-{
-    double time = GetTime();
+    sdsfree(state.watchDirectories.data[descriptor]);
+    state.watchDirectories.data[descriptor] = sdsnew(path);
 
-    duk_push_number(ctx, time);
+    int count = 0;
+    char **entries = GetDirectoryFiles(path, &count);
 
-    return 1;
-}
+    vec_str_t names;
+    vec_init(&names);
 
-void registerTimerFunctions(duk_context *ctx)
-{
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "timer");
+    for (int i = 0; i < count; i++)
+    {
+        if (entries[i][0] != '.' && strcmp(entries[i], "node_modules") != 0)
+            vec_push(&names, sdsnew(entries[i]));
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "timer");
-    duk_push_c_function(ctx, timerGetDelta, 0);
-    duk_put_prop_string(ctx, -2, "getDelta");
-    duk_pop(ctx);
+    ClearDirectoryFiles();
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "timer");
-    duk_push_c_function(ctx, timerGetFPS, 0);
-    duk_put_prop_string(ctx, -2, "getFPS");
-    duk_pop(ctx);
+    int i;
+    sds name;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "timer");
-    duk_push_c_function(ctx, timerGetTime, 0);
-    duk_put_prop_string(ctx, -2, "getTime");
-    duk_pop(ctx);
-}
+    vec_foreach(&names, name, i) {
+        sds full = sdscatprintf(sdsempty(), "%s/%s", path, name);
 
-duk_ret_t windowClose(duk_context *ctx)
-{
-    state.close = 1;
+        if (DirectoryExists(full))
+            watchDirectory(full);
 
-    return 0;
+        sdsfree(full);
+        sdsfree(name);
+    }
+
+    vec_deinit(&names);
 }
 
-duk_ret_t windowGetDisplayWidth(duk_context *ctx)
+void startWatcher()
 {
-    int displayWidth = GetMonitorWidth(GetCurrentMonitor());
+    state.watcher = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-    duk_push_number(ctx, displayWidth);
+    if (state.watcher < 0)
+    {
+        printf("Could not watch %s for changes.\n", state.baseDir);
+        return;
+    }
 
-    return 1;
+    watchDirectory(state.baseDir);
 }
 
-duk_ret_t windowGetDisplayHeight(duk_context *ctx)
+void stopWatcher()
 {
-    int displayHeight = GetMonitorHeight(GetCurrentMonitor());
+    if (state.watcher >= 0)
+        close(state.watcher);
 
-    duk_push_number(ctx, displayHeight);
+    state.watcher = -1;
 
-    return 1;
-}
+    int i;
+    sds directory;
 
-duk_ret_t windowGetWidth(duk_context *ctx)
-{
-    int width = GetScreenWidth();
+    vec_foreach(&state.watchDirectories, directory, i) {
+        sdsfree(directory);
+    }
 
-    duk_push_number(ctx, width);
+    vec_deinit(&state.watchDirectories);
 
-    return 1;
+    const char *path;
+    map_iter_t iter = map_iter(&state.watchedAssets);
+
+    while ((path = map_next(&state.watchedAssets, &iter)))
+        vec_deinit(map_get(&state.watchedAssets, path));
+
+    map_deinit(&state.watchedAssets);
 }
 
-duk_ret_t windowGetHeight(duk_context *ctx)
+// Reloads an image or sound behind every handle that was loaded from path.
+// Handles that were released since are forgotten, and a file that does not
+// decode keeps the old resource.
+
+void reloadAsset(const char *path)
 {
-    int height = GetScreenHeight();
+    watched_asset_vec_t *assets = map_get(&state.watchedAssets, path);
 
-    duk_push_number(ctx, height);
+    if (assets == NULL)
+        return;
 
-    return 1;
-}
+    const char *relative = path + strlen(state.baseDir) + 1;
 
-duk_ret_t windowGetDisplayName(duk_context *ctx)
-{
-    const char *displayName = GetMonitorName(GetCurrentMonitor());
+    for (int i = 0; i < assets->length;)
+    {
+        WatchedAsset asset = assets->data[i];
 
-    duk_push_string(ctx, displayName);
+        TextureRegion *image = asset.type == ASSET_IMAGE ? pool_get(&state.images, asset.handle) : NULL;
+        Sound *sound = asset.type == ASSET_SOUND ? pool_get(&state.sounds, asset.handle) : NULL;
 
-    return 1;
-}
+        if (image == NULL && sound == NULL)
+        {
+            vec_splice(assets, i, 1);
+            continue;
+        }
 
-duk_ret_t windowGetFullscreen(duk_context *ctx)
-{
-    bool fullscreen = IsWindowFullscreen();
+        i++;
 
-    duk_push_boolean(ctx, fullscreen);
+        // Reloading a shared resource would leave its aliases drawing from the
+        // unloaded one.
 
-    return 1;
-}
+        if (state.headless || isAssetLoading(asset.type, asset.handle) || cacheShared(asset.type, asset.handle))
+            continue;
 
-duk_ret_t windowGetX(duk_context *ctx)
-{
-    Vector2 position = GetWindowPosition();
+        CacheEntry *entry = cacheFind(asset.type, asset.handle);
 
-    duk_push_number(ctx, position.x);
+        if (image != NULL)
+        {
+            Texture2D texture = vfsLoadTexture(path);
 
-    return 1;
-}
+            if (texture.id == 0)
+            {
+                printf("Could not reload %s\n", relative);
+                continue;
+            }
 
-duk_ret_t windowGetY(duk_context *ctx)
-{
-    Vector2 position = GetWindowPosition();
+            UnloadTexture(image->texture);
+            *image = textureRegion(texture);
 
-    duk_push_number(ctx, position.y);
+            if (entry != NULL)
+                entry->bytes = textureBytes(texture);
+        }
+        else
+        {
+            Sound reloaded = vfsLoadSound(path);
 
-    return 1;
-}
+            if (reloaded.frameCount == 0)
+            {
+                printf("Could not reload %s\n", relative);
+                continue;
+            }
 
-duk_ret_t windowGetTitle(duk_context *ctx)
-{
-    char *title = state.title;
+            UnloadSound(*sound);
+            *sound = reloaded;
 
-    duk_push_string(ctx, title);
+            if (entry != NULL)
+                entry->bytes = soundBytes(reloaded);
+        }
 
-    return 1;
+        printf("Reloaded %s\n", relative);
+    }
 }
 
-duk_ret_t windowGetVSync(duk_context *ctx)
+bool isModuleLoaded(duk_context *ctx, const char *id)
 {
-    bool vSync = state.vSync;
+    duk_get_global_string(ctx, "Duktape");
+    duk_get_prop_string(ctx, -1, "modLoaded");
 
-    duk_push_boolean(ctx, vSync);
+    bool loaded = duk_has_prop_string(ctx, -1, id);
 
-    return 1;
+    duk_pop_2(ctx);
+
+    return loaded;
 }
 
-duk_ret_t windowHasFocus(duk_context *ctx)
+// Copies the own properties of the new exports onto the old ones, which are
+// the two values on top of the stack. Run as a safe call, because exports
+// defined as getters, like the ones swc emits, can not be assigned.
+
+duk_ret_t patchExports(duk_context *ctx, void *udata)
 {
-    bool focus = IsWindowFocused();
+    duk_idx_t old = duk_normalize_index(ctx, -1);
 
-    duk_push_boolean(ctx, focus);
+    duk_enum(ctx, old - 1, DUK_ENUM_OWN_PROPERTIES_ONLY);
 
-    return 1;
+    while (duk_next(ctx, -1, 1))
+        duk_put_prop(ctx, old);
+
+    return 0;
 }
 
-duk_ret_t windowIsVisible(duk_context *ctx)
+// Runs a changed module again through require and swaps it into
+// Duktape.modLoaded. When both are objects the new exports are copied onto
+// the old ones, so modules holding the old exports see the new code. If they
+// can not be patched the new module is only swapped in, and modules holding
+// the old exports keep the old code. A module that fails to load stays as it
+// was.
+
+bool reloadModule(duk_context *ctx, const char *id)
 {
-    bool visible = !IsWindowHidden();
+    duk_idx_t top = duk_get_top(ctx);
+    bool reloaded = true;
 
-    duk_push_boolean(ctx, visible);
+    duk_get_global_string(ctx, "Duktape");
+    duk_get_prop_string(ctx, -1, "modLoaded");
+    duk_get_prop_string(ctx, -1, id);
 
-    return 1;
-}
+    if (duk_is_object(ctx, top + 2))
+    {
+        duk_del_prop_string(ctx, top + 1, id);
 
-duk_ret_t windowIsMaximized(duk_context *ctx)
-{
-    bool maximized = IsWindowMaximized();
+        duk_get_global_string(ctx, "require");
+        duk_push_string(ctx, id);
 
-    duk_push_boolean(ctx, maximized);
+        if (duk_pcall(ctx, 1) != DUK_EXEC_SUCCESS)
+        {
+            error(ctx);
+            reloaded = false;
 
-    return 1;
-}
+            duk_dup(ctx, top + 2);
+            duk_put_prop_string(ctx, top + 1, id);
+        }
+        else
+        {
+            duk_get_prop_string(ctx, top + 2, "exports");
 
-duk_ret_t windowIsMinimized(duk_context *ctx)
-{
-    bool minimized = IsWindowMinimized();
+            bool patch = duk_is_object(ctx, top + 3) && !duk_is_function(ctx, top + 3) &&
+                         duk_is_object(ctx, top + 4) && !duk_is_function(ctx, top + 4) &&
+                         !duk_strict_equals(ctx, top + 3, top + 4);
 
-    duk_push_boolean(ctx, minimized);
+            if (patch)
+            {
+                duk_dup(ctx, top + 3);
+                duk_dup(ctx, top + 4);
+
+                if (duk_safe_call(ctx, patchExports, NULL, 2, 1) == DUK_EXEC_SUCCESS)
+                {
+                    duk_get_prop_string(ctx, top + 1, id);
+                    duk_dup(ctx, top + 4);
+                    duk_put_prop_string(ctx, -2, "exports");
+                }
+                else
+                {
+                    printf("Could not patch the exports of %s, modules importing it keep the old code: %s\n", id, duk_safe_to_string(ctx, -1));
+                }
+            }
+        }
+    }
 
-    return 1;
+    duk_set_top(ctx, top);
+
+    return reloaded;
 }
 
-duk_ret_t windowMaximize(duk_context *ctx)
+// Running main again would create its colliders, images, hosts and batches a
+// second time, so the game restarts instead: every handle is released like at
+// exit and modules are loaded afresh. Handles kept from before become invalid.
+
+bool reloadMain(duk_context *ctx)
 {
-    MaximizeWindow();
+    freeCache();
+    releaseAll();
 
-    return 0;
-}
+    duk_get_global_string(ctx, "Duktape");
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "modLoaded");
+    duk_pop(ctx);
 
-duk_ret_t windowMinimize(duk_context *ctx)
-{
-    MinimizeWindow();
+    duk_idx_t top = duk_get_top(ctx);
+    sds mainJs = sdscatprintf(sdsempty(), "%s/main.js", state.scriptDirectory);
 
-    return 0;
-}
+    bool reloaded = duk_safe_call(ctx, runScript, mainJs, 0, 1) == DUK_EXEC_SUCCESS;
 
-duk_ret_t windowRestore(duk_context *ctx)
-{
-    RestoreWindow();
+    if (!reloaded)
+        error(ctx);
 
-    return 0;
+    duk_set_top(ctx, top);
+    sdsfree(mainJs);
+
+    return reloaded;
 }
 
-duk_ret_t windowSetFullscreen(duk_context *ctx)
+// TypeScript games recompile first, which only rebuilds the changed files.
+// A script that fails to reload shows its error like any other, and the
+// next successful reload clears it. While an error is shown, main is run
+// again too, so a game that failed to start can recover. Headless games have
+// no error screen, so there a failed reload is logged and the old code keeps
+// running.
+
+void reloadFiles(duk_context *ctx, vec_str_t *changed)
 {
-    bool fullscreen = duk_require_boolean(ctx, 0);
+    bool wasError = state.error;
+    bool typescript = strcmp(state.scriptDirectory, state.baseDir) != 0;
+    const char *extension = typescript ? ".ts" : ".js";
 
-    bool isFullscreen = IsWindowFullscreen();
+    bool scripts = false;
+    bool failed = false;
 
-    if (fullscreen && !isFullscreen)
-    {
-        ToggleFullscreen();
-    }
-    else if (!fullscreen && isFullscreen)
+    for (int i = 0; i < changed->length; i++)
+        scripts = scripts || (typescript ? isTypescript(changed->data[i]) : IsFileExtension(changed->data[i], ".js"));
+
+    if (scripts && typescript)
     {
-        ToggleFullscreen();
+        sds build = compileTypescript(state.baseDir);
+
+        if (build == NULL)
+        {
+            state.error = true;
+            scripts = false;
+            failed = true;
+        }
+
+        sdsfree(build);
     }
 
-    return 0;
-}
+    bool mainReloaded = false;
 
-duk_ret_t windowSetPosition(duk_context *ctx)
-{
-    int x = duk_require_number(ctx, 0);
-    int y = duk_require_number(ctx, 1);
+    for (int i = 0; i < changed->length; i++)
+    {
+        const char *path = changed->data[i];
+        const char *relative = path + strlen(state.baseDir) + 1;
 
-    SetWindowPosition(x, y);
+        if (!IsFileExtension(path, extension) || (typescript && !isTypescript(path)))
+        {
+            reloadAsset(path);
+            continue;
+        }
 
-    return 0;
-}
+        if (!scripts)
+            continue;
 
-duk_ret_t windowSetTitle(duk_context *ctx)
-{
-    const char *title = duk_require_string(ctx, 0);
+        double start = monotonicTime();
+        sds id = sdsnewlen(relative, strlen(relative) - 3);
+        bool main = strcmp(id, "main") == 0;
 
-    SetWindowTitle(title);
+        if (!main && !isModuleLoaded(ctx, id))
+        {
+            sdsfree(id);
+            continue;
+        }
 
-    return 0;
-}
+        if (main ? reloadMain(ctx) : reloadModule(ctx, id))
+            printf("Reloaded %s in %.1f ms\n", relative, (monotonicTime() - start) * 1000);
+        else
+            failed = true;
 
-duk_ret_t windowSetVSync(duk_context *ctx)
-{
-    bool vSync = duk_require_boolean(ctx, 0);
+        mainReloaded = mainReloaded || main;
 
-    if (vSync)
-    {
-        SetTargetFPS(GetMonitorRefreshRate(GetCurrentMonitor()));
-        state.vSync = true;
-    }
-    else
-    {
-        SetTargetFPS(0);
-        state.vSync = false;
+        sdsfree(id);
     }
 
-    return 0;
-}
+    if (scripts && !failed && state.error && !mainReloaded)
+        failed = !reloadMain(ctx);
 
-duk_ret_t windowSetResizable(duk_context *ctx)
-{
-    bool resizable = duk_require_boolean(ctx, 0);
+    if (scripts && !failed)
+        state.error = false;
 
-    if (resizable)
-    {
-        SetWindowState(FLAG_WINDOW_RESIZABLE);
-    }
-    else
+    if (failed && state.headless)
     {
-        ClearWindowState(FLAG_WINDOW_RESIZABLE);
+        fprintf(stderr, "%s\n", state.errorString);
+        state.error = wasError;
     }
-
-    return 0;
 }
 
-duk_ret_t windowIsResized(duk_context *ctx)
+// Called at the start of a frame. Events are gathered until the queue is
+// empty, so a file saved in several writes is only reloaded once.
+
+void pollWatcher(duk_context *ctx)
 {
-    bool resized = IsWindowResized();
+    if (state.watcher < 0)
+        return;
 
-    duk_push_boolean(ctx, resized);
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
 
-    return 1;
-}
+    vec_str_t changed;
+    vec_init(&changed);
 
-duk_ret_t windowSetMinSize(duk_context *ctx)
-{
-    int width = duk_require_number(ctx, 0);
-    int height = duk_require_number(ctx, 1);
+    while ((length = read(state.watcher, buffer, sizeof(buffer))) > 0)
+    {
+        const struct inotify_event *event;
 
-    SetWindowMinSize(width, height);
+        for (char *next = buffer; next < buffer + length; next += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *)next;
 
-    return 0;
-}
+            if (event->len == 0 || event->name[0] == '.' || event->wd >= state.watchDirectories.length)
+                continue;
 
-void registerWindowFunctions(duk_context *ctx)
-{
-    duk_get_global_string(ctx, "turtle");
-    duk_push_object(ctx);
-    duk_put_prop_string(ctx, -2, "window");
+            sds directory = state.watchDirectories.data[event->wd];
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowClose, 0);
-    duk_put_prop_string(ctx, -2, "close");
-    duk_pop(ctx);
+            if (directory == NULL)
+                continue;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetDisplayWidth, 0);
-    duk_put_prop_string(ctx, -2, "getDisplayWidth");
-    duk_pop(ctx);
+            sds path = sdscatprintf(sdsempty(), "%s/%s", directory, event->name);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetDisplayHeight, 0);
-    duk_put_prop_string(ctx, -2, "getDisplayHeight");
-    duk_pop(ctx);
+            if (event->mask & IN_ISDIR)
+            {
+                if (strcmp(event->name, "node_modules") != 0)
+                    watchDirectory(path);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetWidth, 0);
-    duk_put_prop_string(ctx, -2, "getWidth");
-    duk_pop(ctx);
+                sdsfree(path);
+                continue;
+            }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetHeight, 0);
-    duk_put_prop_string(ctx, -2, "getHeight");
-    duk_pop(ctx);
+            bool seen = event->mask & IN_CREATE;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetDisplayName, 0);
-    duk_put_prop_string(ctx, -2, "getDisplayName");
-    duk_pop(ctx);
+            for (int i = 0; i < changed.length && !seen; i++)
+                seen = strcmp(changed.data[i], path) == 0;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetFullscreen, 0);
-    duk_put_prop_string(ctx, -2, "getFullscreen");
-    duk_pop(ctx);
+            if (seen)
+                sdsfree(path);
+            else
+                vec_push(&changed, path);
+        }
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetX, 0);
-    duk_put_prop_string(ctx, -2, "getX");
-    duk_pop(ctx);
+    if (changed.length > 0)
+        reloadFiles(ctx, &changed);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetY, 0);
-    duk_put_prop_string(ctx, -2, "getY");
-    duk_pop(ctx);
+    int i;
+    sds path;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetTitle, 0);
-    duk_put_prop_string(ctx, -2, "getTitle");
-    duk_pop(ctx);
+    vec_foreach(&changed, path, i) {
+        sdsfree(path);
+    }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowGetVSync, 0);
-    duk_put_prop_string(ctx, -2, "getVSync");
-    duk_pop(ctx);
+    vec_deinit(&changed);
+}
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowHasFocus, 0);
-    duk_put_prop_string(ctx, -2, "hasFocus");
-    duk_pop(ctx);
+void sigintHandler(int sig)
+{
+    state.close = true;
+}
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowIsVisible, 0);
-    duk_put_prop_string(ctx, -2, "isVisible");
-    duk_pop(ctx);
+// Headless games only run update, at state.tickRate updates per second. Ticks
+// are scheduled on absolute deadlines so sleeping does not accumulate drift,
+// and ticks that were missed because an update ran long are skipped. An error
+// ends the game, unless it is watched: then the error is logged and ticks
+// only poll the watcher until a reload fixes it, like the error screen does.
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowIsMaximized, 0);
-    duk_put_prop_string(ctx, -2, "isMaximized");
-    duk_pop(ctx);
+void runHeadless(duk_context *ctx)
+{
+    double tick = 1.0 / state.tickRate;
+    double previous = monotonicTime();
+    double next = previous + tick;
+    bool logged = false;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowIsMinimized, 0);
-    duk_put_prop_string(ctx, -2, "isMinimized");
-    duk_pop(ctx);
+    while (!state.close)
+    {
+        if (state.error && state.watcher < 0)
+            break;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowMaximize, 0);
-    duk_put_prop_string(ctx, -2, "maximize");
-    duk_pop(ctx);
+        if (state.error && !logged)
+        {
+            fprintf(stderr, "%s\n", state.errorString);
+            logged = true;
+        }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowMinimize, 0);
-    duk_put_prop_string(ctx, -2, "minimize");
-    duk_pop(ctx);
+        struct timespec deadline;
+        deadline.tv_sec = (time_t)next;
+        deadline.tv_nsec = (long)((next - deadline.tv_sec) * 1e9);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowRestore, 0);
-    duk_put_prop_string(ctx, -2, "restore");
-    duk_pop(ctx);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowSetFullscreen, 1);
-    duk_put_prop_string(ctx, -2, "setFullscreen");
-    duk_pop(ctx);
+        double now = monotonicTime();
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowSetPosition, 2);
-    duk_put_prop_string(ctx, -2, "setPosition");
-    duk_pop(ctx);
+        state.headlessDelta = now - previous;
+        previous = now;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowSetTitle, 1);
-    duk_put_prop_string(ctx, -2, "setTitle");
-    duk_pop(ctx);
+        next += tick;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowSetVSync, 1);
-    duk_put_prop_string(ctx, -2, "setVSync");
-    duk_pop(ctx);
+        if (next < now)
+            next = now + tick;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowSetResizable, 1);
-    duk_put_prop_string(ctx, -2, "setResizable");
-    duk_pop(ctx);
+        if (state.error)
+        {
+            pollWatcher(ctx);
+            frameGarbageCollection(ctx);
+            continue;
+        }
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowIsResized, 0);
-    duk_put_prop_string(ctx, -2, "isResized");
-    duk_pop(ctx);
+        logged = false;
 
-    duk_get_global_string(ctx, "turtle");
-    duk_get_prop_string(ctx, -1, "window");
-    duk_push_c_function(ctx, windowSetMinSize, 2);
-    duk_put_prop_string(ctx, -2, "setMinSize");
-    duk_pop(ctx);
-}
+        beginFrameProfile();
 
-duk_ret_t modSearch(duk_context *ctx)
-{
-    const char *id = duk_get_string(ctx, 0);
+        double start = monotonicTime();
+        pollWatcher(ctx);
+        uploadAssets(ctx);
+        finishFileJobs(ctx);
+        profilePhase(PHASE_UPLOAD, start);
 
-    sds filename = sdsempty();
+        start = monotonicTime();
+        stepPhysics(state.headlessDelta);
+        profilePhase(PHASE_PHYSICS, start);
 
-    filename = sdscatprintf(filename, "%s/%s.js", state.baseDir, id);
+        start = monotonicTime();
 
-    duk_push_string_file(ctx, filename);
+        duk_get_global_string(ctx, "update");
+        duk_push_number(ctx, state.headlessDelta);
 
-    sdsfree(filename);
+        if (duk_pcall(ctx, 1) != DUK_EXEC_SUCCESS)
+            error(ctx);
 
-    return 1;
-}
+        duk_pop(ctx);
 
-void error(duk_context *ctx)
-{
-    duk_get_prop_string(ctx, -1, "stack");
-    strcpy(state.errorString, duk_safe_to_string(ctx, -1));
-    state.error = true;
-}
+        profilePhase(PHASE_UPDATE, start);
+        profileZone(ZONE_UPDATE, start);
 
-void sigintHandler(int sig)
-{
-    state.close = true;
+        frameGarbageCollection(ctx);
+
+        endFrameProfile();
+    }
+
+    if (state.error && !logged)
+        fprintf(stderr, "%s\n", state.errorString);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    const char *path = NULL;
+    const char *arguments[2] = {NULL, NULL};
+    int argumentCount = 0;
+    bool headless = false;
+    bool trackHandles = false;
+    bool scriptCache = true;
+    bool watch = false;
+    bool profileNatives = false;
+    int tickRate = 60;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--leaks") == 0)
+            trackHandles = true;
+        else if (strcmp(argv[i], "--no-cache") == 0)
+            scriptCache = false;
+        else if (strcmp(argv[i], "--watch") == 0)
+            watch = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profileNatives = true;
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+            tickRate = atoi(argv[++i]);
+        else if (path == NULL)
+            path = argv[i];
+        else if (argumentCount < 2)
+            arguments[argumentCount++] = argv[i];
+    }
+
+    if (path == NULL)
     {
+        if (headless)
+        {
+            printf("Headless mode needs a path to main.js/ts.\n");
+            return 1;
+        }
+
         noGame();
         return 0;
     }
 
-    if (strcmp(argv[1], "version") == 0)
+    if (strcmp(path, "version") == 0)
     {
         printf("TURTLE %s\n", VERSION);
         return 0;
     }
 
-    if (strcmp(argv[1], "help") == 0)
+    if (strcmp(path, "help") == 0)
     {
-        printf("turtle [path to main.js/ts] [version] [help]\n");
+        printf("turtle [path to main.js/ts or pack] [version] [help] [pack directory [output]] [--headless] [--rate updates per second] [--leaks] [--no-cache] [--watch] [--profile]\n");
         return 0;
     }
 
+    if (strcmp(path, "pack") == 0)
+    {
+        if (arguments[0] == NULL)
+        {
+            printf("Pack needs the path of a directory containing a main.js or main.ts file.\n");
+            return 1;
+        }
+
+        SetTraceLogLevel(LOG_NONE);
+
+        state.scriptCache = scriptCache;
+
+        return packGame(arguments[0], arguments[1]);
+    }
+
+    if (tickRate <= 0)
+    {
+        printf("The update rate must be positive.\n");
+        return 1;
+    }
+
     signal(SIGINT, sigintHandler);
+    signal(SIGTERM, sigintHandler);
 
-    duk_context *ctx = duk_create_heap_default();
+    state.gcMode = GC_FRAME;
+    state.gcThreshold = GC_THRESHOLD;
+
+    initHeap();
+
+    duk_context *ctx = duk_create_heap(heapAlloc, heapRealloc, heapFree, NULL, NULL);
 
     if (!ctx)
     {
@@ -2296,9 +9975,18 @@ int main(int argc, char *argv[])
     state.currentColor = WHITE;
     state.currentBackgroundColor = BLACK;
     state.currentFont = GetFontDefault();
-    state.space = cpSpaceNew();
-    state.typescript = false;
-    state.baseDir = argv[1];
+    state.physicsThreads = 1;
+    state.spatialHashCellSize = 0;
+    state.spatialHashCount = 0;
+    state.space = createSpace(state.physicsThreads);
+    state.physicsStep = 1.0 / 60.0;
+    state.physicsMaxSubsteps = 4;
+    state.physicsAccumulator = 0;
+    state.headless = headless;
+    state.tickRate = tickRate;
+    state.headlessStart = monotonicTime();
+    state.headlessDelta = 0;
+    state.baseDir = path;
 
     state.camera.target = (Vector2){0, 0};
     state.camera.zoom = 1.0f;
@@ -2309,16 +9997,46 @@ int main(int argc, char *argv[])
     enet_initialize();
 
     map_init(&state.keys);
-    map_init(&state.images);
-    map_init(&state.fonts);
-    map_init(&state.sounds);
-    map_init(&state.colliders);
-    map_init(&state.hosts);
-    map_init(&state.peers);
 
-    vec_init(&state.collisions);
+    pool_init(&state.images);
+    pool_init(&state.fonts);
+    pool_init(&state.sounds);
+    pool_init(&state.colliders);
+    pool_init(&state.hosts);
+    pool_init(&state.peers);
+    pool_init(&state.batches);
 
-    uuid4_init();
+    vec_init(&state.collisions);
+    vec_init(&state.queryResults);
+    vec_init(&state.raycastHits);
+    state.collisionTable = NULL;
+    state.collisionTableSize = 0;
+
+    vec_init(&state.loading);
+    state.loaderStarted = false;
+    state.nextCallbackId = 0;
+    state.uploadBudget = ASSET_UPLOAD_BUDGET;
+
+    map_init(&state.cache);
+    map_init(&state.cacheKeys);
+    state.cacheMode = CACHE_PATH;
+    state.cacheHits = 0;
+    state.cacheMisses = 0;
+
+    state.trackHandles = trackHandles;
+    state.scriptCache = scriptCache;
+    state.bytecodeDirectory = scriptCache ? cacheDirectory("bytecode") : NULL;
+    state.scriptDirectory = sdsnew(path);
+    state.watcher = -1;
+    vec_init(&state.watchDirectories);
+    map_init(&state.watchedAssets);
+    vec_init(&state.siteNames);
+    map_init(&state.siteIds);
+
+    for (int type = 0; type < HANDLE_TYPES; type++)
+        vec_init(&state.handleSites[type]);
+
+    initProfiler();
 
     duk_console_init(ctx, DUK_CONSOLE_PROXY_WRAPPER);
     duk_module_duktape_init(ctx);
@@ -2346,14 +10064,28 @@ int main(int argc, char *argv[])
     registerPhysicsFunctions(ctx);
     registerCameraFunctions(ctx);
     registerNetworkFunctions(ctx);
+    registerProfilerFunctions(ctx);
 
     SetTraceLogLevel(LOG_NONE);
-    InitWindow(800, 600, state.title);
-    SetExitKey(KEY_NULL);
 
-    InitAudioDevice();
+    if (state.headless)
+    {
+        registerHeadlessFunctions(ctx);
+    }
+    else
+    {
+        InitWindow(800, 600, state.title);
+        SetExitKey(KEY_NULL);
+
+        InitAudioDevice();
+
+        SetTargetFPS(GetMonitorRefreshRate(GetCurrentMonitor()));
+    }
+
+    collectNatives(ctx);
 
-    SetTargetFPS(GetMonitorRefreshRate(GetCurrentMonitor()));
+    state.profileNatives = profileNatives;
+    updateTrampolines(ctx);
 
     char mainJs[100];
     strcpy(mainJs, state.baseDir);
@@ -2363,32 +10095,42 @@ int main(int argc, char *argv[])
     strcpy(mainTs, state.baseDir);
     strcat(mainTs, "/main.ts");
 
-    if (FileExists(mainJs))
+    struct stat info;
+    bool packed = stat(state.baseDir, &info) == 0 && S_ISREG(info.st_mode);
+
+    if (watch && !packed)
+        startWatcher();
+
+    if (packed && !mountPack(state.baseDir))
+    {
+        strcpy(state.errorString, "Invalid pack, create it again with turtle pack.");
+        state.error = true;
+    }
+    else if (vfsExists(mainJs))
     {
-        if (duk_peval_file(ctx, mainJs) != DUK_EXEC_SUCCESS)
+        if (duk_safe_call(ctx, runScript, mainJs, 0, 1) != DUK_EXEC_SUCCESS)
             error(ctx);
     }
-    else if(FileExists(mainTs))
+    else if(vfsExists(mainTs))
     {
-        char command[100];
-        strcpy(command, "swc ");
-        strcat(command, state.baseDir);
-        strcat(command, " -d ");
-        strcat(command, state.baseDir);
-        strcat(command, " -q -C module.type=commonjs -C module.strictMode=false");
+        sds directory = compileTypescript(state.baseDir);
 
-        if (system(command) != 0)
+        if (directory == NULL)
         {
-            strcpy(state.errorString, "Error compiling Typescript, you might need to install swc.");
             state.error = true;
         }
         else
         {
-            if (duk_peval_file(ctx, mainJs) != DUK_EXEC_SUCCESS)
+            sdsfree(state.scriptDirectory);
+            state.scriptDirectory = directory;
+
+            sds compiledMain = sdscatprintf(sdsempty(), "%s/main.js", directory);
+
+            if (duk_safe_call(ctx, runScript, compiledMain, 0, 1) != DUK_EXEC_SUCCESS)
                 error(ctx);
-        }
 
-        state.typescript = true;
+            sdsfree(compiledMain);
+        }
     }
     else
     {
@@ -2396,24 +10138,46 @@ int main(int argc, char *argv[])
         state.error = true;
     }
 
-    while (!WindowShouldClose() && !state.close)
+    frameGarbageCollection(ctx);
+
+    if (state.headless)
+        runHeadless(ctx);
+
+    while (!state.headless && !WindowShouldClose() && !state.close)
     {
         if (!state.error)
         {
-            cpSpaceStep(state.space, GetFrameTime());
+            beginFrameProfile();
+
+            double start = monotonicTime();
+            pollWatcher(ctx);
+            uploadAssets(ctx);
+            finishFileJobs(ctx);
+            profilePhase(PHASE_UPLOAD, start);
+
+            start = monotonicTime();
+            stepPhysics(frameTime());
+            profilePhase(PHASE_PHYSICS, start);
+
+            start = monotonicTime();
 
             duk_get_global_string(ctx, "update");
-            duk_push_number(ctx, GetFrameTime());
+            duk_push_number(ctx, frameTime());
 
             if (duk_pcall(ctx, 1) != DUK_EXEC_SUCCESS)
                 error(ctx);
 
             duk_pop(ctx);
 
+            profilePhase(PHASE_UPDATE, start);
+            profileZone(ZONE_UPDATE, start);
+
             BeginDrawing();
 
             ClearBackground(state.currentBackgroundColor);
 
+            start = monotonicTime();
+
             duk_get_global_string(ctx, "draw");
 
             if (duk_pcall(ctx, 0) != DUK_EXEC_SUCCESS)
@@ -2421,14 +10185,27 @@ int main(int argc, char *argv[])
 
             duk_pop(ctx);
 
+            profilePhase(PHASE_DRAW, start);
+            profileZone(ZONE_DRAW, start);
+
+            if (state.profileOverlay)
+                drawProfileOverlay();
+
+            start = monotonicTime();
             EndDrawing();
+            profilePhase(PHASE_PRESENT, start);
+
+            frameGarbageCollection(ctx);
 
-            vec_clear(&state.collisions);
+            endFrameProfile();
         }
         else
         {
             static bool copied = false;
 
+            pollWatcher(ctx);
+            frameGarbageCollection(ctx);
+
             if (IsMouseButtonPressed(0))
             {
                 SetClipboardText(state.errorString);
@@ -2451,35 +10228,68 @@ int main(int argc, char *argv[])
         }
     }
 
-    CloseWindow();
+    stopAssetLoader();
+    stopFileWorker();
+    stopWatcher();
 
-    CloseAudioDevice();
+    // Destroying the heap runs the finalizers of releaseWith owners, what is
+    // left afterwards was never released.
+    duk_destroy_heap(ctx);
+
+    if (state.trackHandles)
+        reportLeaks();
+
+    freeCache();
+    releaseAll();
+    freeNatives();
+    freeProfiler();
+    freeHeap();
+    unmountPack();
+    sdsfree(state.bytecodeDirectory);
+    sdsfree(state.scriptDirectory);
+
+    freeSpace(state.space, state.physicsThreads);
 
-    // TRY TO CLEANUP IMAGES, FONTS AND SOUNDS AND PHYSICS!!! LOADS OF MEMORY LEAKS...
+    if (!state.headless)
+    {
+        CloseWindow();
+
+        CloseAudioDevice();
+    }
 
     map_deinit(&state.keys);
-    map_deinit(&state.images);
-    map_deinit(&state.fonts);
-    map_deinit(&state.sounds);
-    map_deinit(&state.colliders);
-    map_deinit(&state.hosts);
-    map_init(&state.peers);
+
+    pool_deinit(&state.images);
+    pool_deinit(&state.fonts);
+    pool_deinit(&state.sounds);
+    pool_deinit(&state.colliders);
+    pool_deinit(&state.hosts);
+    pool_deinit(&state.peers);
+    pool_deinit(&state.batches);
 
     vec_deinit(&state.collisions);
+    vec_deinit(&state.queryResults);
+    vec_deinit(&state.raycastHits);
+    free(state.collisionTable);
+    vec_deinit(&state.loading);
 
-    duk_destroy_heap(ctx);
+    int i;
+    sds site;
 
-    enet_deinitialize();
+    vec_foreach(&state.siteNames, site, i) {
+        sdsfree(site);
+    }
 
-    if (state.typescript)
-    {
-        sds command = sdsempty();
+    vec_deinit(&state.siteNames);
+    map_deinit(&state.siteIds);
 
-        command = sdscatprintf(command, "find %s -name \"*.js\" -type f -delete", state.baseDir);
+    for (int type = 0; type < HANDLE_TYPES; type++)
+        vec_deinit(&state.handleSites[type]);
 
-        if (system(command) != 0)
-            printf("Error removing compiled JavaScript files.");
-    }
+    enet_deinitialize();
+
+    if (state.headless && state.error)
+        return 1;
 
     return 0;
 }
\ No newline at end of file